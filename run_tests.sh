@@ -13,24 +13,36 @@ make
 count=0
 SUB='trader'
 
+# Run the suite with each of the exchange's loops: the signal loop, the
+# epoll loop (-e) and the shared-memory transport (-s)
+# A test that only applies to some of them lists them in a "modes" file
+declare -A MODE_FLAGS=([signal]="" [event]="-e" [shm]="-s")
+
 # Assume all ".in" and ".out" files are located in a separate `tests/E2E/*/` directory
+for mode in signal event shm; do
 for folder in `ls -d tests/E2E/*/ | sort -V`; do
 
     name=$(basename "$folder")
 
-    echo Running $name.
+    if [[ -f $folder/modes ]] && ! grep -qx "$mode" $folder/modes; then
+        continue
+    fi
+
+    echo Running $name \($mode\).
 
     expected_file=tests/E2E/$name/*.out
+    flags=${MODE_FLAGS[$mode]}
 
     if [[ "$name" == *"$SUB"* ]]; then
-        ./spx_exchange products.txt ./spx_test_trader ./spx_trader $folder/test.in | diff - $expected_file || echo "Test $name: failed!"
+        ./spx_exchange $flags products.txt ./spx_test_trader ./spx_trader $folder/test.in | diff - $expected_file || echo "Test $name ($mode): failed!"
     else
-        ./spx_exchange products.txt ./spx_test_trader ./spx_test_trader $folder/test.in | diff - $expected_file || echo "Test $name: failed!"
+        ./spx_exchange $flags products.txt ./spx_test_trader ./spx_test_trader $folder/test.in | diff - $expected_file || echo "Test $name ($mode): failed!"
     fi
 
     count=$((count+1))
 
 done
+done
 
 echo ""
 echo "Finished running $count E2E tests!"
@@ -38,6 +50,9 @@ echo ""
 
 # Run unit-tests
 gcc -Wall -Werror -Wvla -O0 -std=c11 -g -D TESTING -D UNIT_TEST -c spx_exchange.c -o tests/spx_exchange.o
+gcc -Wall -Werror -Wvla -O0 -std=c11 -g -D TESTING -c spx_framing.c -o tests/spx_framing.o
+gcc -Wall -Werror -Wvla -O0 -std=c11 -g -D TESTING -c spx_shm.c -o tests/spx_shm.o
+gcc -Wall -Werror -Wvla -O0 -std=c11 -g -D TESTING -c spx_log.c -o tests/spx_log.o
 gcc -Wall -Werror -Wvla -O0 -std=c11 -g -D TESTING  -lm -c tests/unit-tests.c -o tests/unit-tests.o
-gcc tests/unit-tests.o tests/spx_exchange.o tests/libcmocka-static.a -lm -o tests/unit-tests
+gcc tests/unit-tests.o tests/spx_exchange.o tests/spx_framing.o tests/spx_shm.o tests/spx_log.o tests/libcmocka-static.a -pthread -lm -o tests/unit-tests
 ./tests/unit-tests
\ No newline at end of file
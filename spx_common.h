@@ -14,8 +14,11 @@
 #include <sys/stat.h>
 #include <sys/errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
+#include "spx_framing.h"
+
 #define LOG_PREFIX "[SPX]"
 #define FIFO_EXCHANGE "/tmp/spx_exchange_%d"
 #define FIFO_TRADER "/tmp/spx_trader_%d"
@@ -25,12 +28,17 @@
 #define TIME_250MS (250000000L)
 #define TIME_100MS (100000000L)
 #define TIME_500MS (500000000L)
+#define PROTOCOL_BINARY "PROTOCOL BINARY;"
+
+// Binary messages are the packed structs as laid out in memory
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    #error "the binary protocol expects a little-endian host"
+#endif
 
-typedef struct node node;
-typedef struct queue queue;
 typedef struct order order;
 typedef struct trader trader;
 typedef struct position position;
+typedef struct binary_command binary_command;
 
 enum order_type {
     BUY = 0,
@@ -39,6 +47,21 @@ enum order_type {
     AMEND = 3
 };
 
+// Fixed-width little-endian order entry message
+// A trader switches to it by sending PROTOCOL BINARY; as its first command,
+// the exchange replies with PROTOCOL BINARY <n>; then PRODUCT <id> <name>;
+// for each product
+struct __attribute__((packed)) binary_command {
+    // enum order_type
+    uint8_t type;
+    uint32_t order_id;
+    // Ignored for AMEND/CANCEL
+    uint16_t product_id;
+    // Ignored for CANCEL
+    uint32_t quantity;
+    uint32_t price;
+};
+
 // Stores the trader_id
 struct trader {
     int trader_id;
@@ -47,39 +70,44 @@ struct trader {
 
     int current_order_id;
 
+    // Live orders of the trader indexed by order id (exchange only)
+    order **orders;
+    // Product of every order id used, for routing to a matcher thread
+    // (exchange only)
+    int *order_products;
+    int orders_capacity;
+
     pid_t pid;
-    position *positions;
-    int num_positions;
 
     int e2t_fd_wronly;
     int t2e_fd_rdonly;
+
+    // Commands read from t2e_fd_rdonly but not yet processed (exchange only)
+    frame_reader input;
+    // Messages for e2t_fd_wronly, flushed at the end of each event
+    // (exchange only)
+    frame_writer output;
+    // Messages the trader's full pipe could not take yet (exchange only)
+    frame_backlog backlog;
+    // Set by the thread writing the trader's messages once the backlog has
+    // overflowed, the main thread then disconnects it (exchange only)
+    atomic_bool is_cut_off;
+    // Shared-memory rings replacing the pipes' data, NULL with the FIFO
+    // transport (exchange only)
+    shm_channel *channel;
+    // The channel's eventfds, kept out of the region the trader can write
+    shm_eventfds eventfds;
 };
 
+// A trader's position on one product
 struct position {
-    char *product_name;
     int64_t quantity;
     int64_t value;
-
-    position *next;
-    position *prev;
-};
-
-struct node {
-    int pid;
-    int signal;
-
-    node *next;
-    node *prev;
-};
-
-struct queue {
-    int size;
-    node *head;
-
 };
 
 struct order {
     char *product_name;
+    int product_id;
     enum order_type type;
 
     bool amended;
@@ -90,6 +118,9 @@ struct order {
     int quantity;
     int price;
 
+    // Price level the order is resting at (exchange only)
+    struct price_level *level;
+
     order *next;
     order *prev;
 };
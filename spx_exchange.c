@@ -4,10 +4,34 @@
  * gtro3802
  */
 
+// For ppoll()
+#define _GNU_SOURCE
 #include "spx_exchange.h"
 
 static volatile int num_current_traders = 0;
-static queue *my_queue = NULL;
+// Whether a trader has been cut off since the main thread last looked
+static atomic_bool has_cut_off_traders = false;
+static signal_ring my_queue = {0};
+static symbol_table *symbols = NULL;
+static position_matrix *positions = NULL;
+static trader_registry *registry = NULL;
+static _Thread_local trade_batch trades = {0};
+static object_pool order_pool = {0};
+static object_pool level_pool = {0};
+// Pools of the calling thread, each matcher thread has its own
+static _Thread_local object_pool *thread_order_pool = &order_pool;
+static _Thread_local object_pool *thread_level_pool = &level_pool;
+// MARKET messages shared by the writers, each fan-out worker has its own
+static _Thread_local char market_data[BUFFER_SIZE] = {0};
+static _Thread_local int market_data_len = 0;
+static match_engine *engine = NULL;
+// Event the publisher is putting together, the messages queued on its
+// thread go to the fan-out workers instead of the traders' writers
+static _Thread_local market_event *staged_event = NULL;
+#ifdef IO_URING
+// The loop of the calling thread, a publisher thread writes without one
+static _Thread_local uring_loop *uring_state = NULL;
+#endif
 
 // Wrapper function for calloc
 void *my_calloc(size_t count, size_t size) {
@@ -15,19 +39,362 @@ void *my_calloc(size_t count, size_t size) {
     return ptr;
 }
 
+// Wrapper function for realloc
+void *my_realloc(void *ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
 // Wrapper function for free
 void my_free(void *ptr) {
     free(ptr);
 }
 
+// Initialise a pool with room for capacity objects
+// A growable pool adds another chunk of capacity objects when it runs out
+int init_pool(object_pool *pool, size_t object_size, int capacity,
+                bool growable) {
+    // Free objects store the next pointer of the free list in place
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+
+    pool->object_size = object_size;
+    pool->chunk_size = (capacity > 0) ? capacity : 1;
+    pool->growable = growable;
+    pool->free_list = NULL;
+    pool->num_free = 0;
+    pool->chunks = NULL;
+    pool->num_chunks = 0;
+
+    return grow_pool(pool);
+}
+
+// Allocate another chunk and thread its objects onto the free list
+int grow_pool(object_pool *pool) {
+    void **chunks = my_realloc(pool->chunks,
+                                (pool->num_chunks + 1) * sizeof(void *));
+    if (NULL == chunks) {
+        return -1;
+    }
+    pool->chunks = chunks;
+
+    char *chunk = my_calloc(pool->chunk_size, pool->object_size);
+    if (NULL == chunk) {
+        return -1;
+    }
+    pool->chunks[pool->num_chunks] = chunk;
+    pool->num_chunks += 1;
+
+    for (int i = pool->chunk_size - 1; i >= 0; i--) {
+        void **object = (void **) (chunk + i * pool->object_size);
+        *object = pool->free_list;
+        pool->free_list = object;
+    }
+    pool->num_free += pool->chunk_size;
+
+    return 0;
+}
+
+// Take a zeroed object from the pool
+// Returns NULL if the pool is empty and cannot grow
+void *pool_alloc(object_pool *pool) {
+    if (NULL == pool->free_list) {
+        if (!pool->growable || -1 == grow_pool(pool)) {
+            return NULL;
+        }
+    }
+
+    void **object = pool->free_list;
+    pool->free_list = *object;
+    pool->num_free -= 1;
+
+    memset(object, 0, pool->object_size);
+    return object;
+}
+
+// Return an object to the pool
+void pool_free(object_pool *pool, void *ptr) {
+    if (NULL == ptr) {
+        return;
+    }
+
+    void **object = ptr;
+    *object = pool->free_list;
+    pool->free_list = object;
+    pool->num_free += 1;
+}
+
+// Free every chunk of the pool
+void free_pool(object_pool *pool) {
+    for (int i = 0; i < pool->num_chunks; i++) {
+        my_free(pool->chunks[i]);
+    }
+    my_free(pool->chunks);
+    memset(pool, 0, sizeof(object_pool));
+}
+
+// Initialise the order and price level pools
+int init_pools(int capacity) {
+    if (-1 == init_pool(&order_pool, sizeof(order), capacity, true)) {
+        return -1;
+    } else if (-1 == init_pool(&level_pool, sizeof(price_level),
+                                capacity, true)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Free the memory associated with the pools
+void free_pools() {
+    free_pool(&order_pool);
+    free_pool(&level_pool);
+}
+
+// Parse a positive option value
+// Returns the value, or -1 if it is not a positive number
+static int parse_positive(char option, char *argument) {
+    char *end = NULL;
+    errno = 0;
+    long value = strtol(argument, &end, 10);
+    if (0 != errno || '\0' != *end || value <= 0 || value > INT_MAX) {
+        #ifdef DEBUG
+            printf("Error: -%c must be positive\n", option);
+        #endif
+        return -1;
+    }
+    return value;
+}
+
+// Parse the options before the products file, in any order
+// ./spx_exchange [-s] [-e] [-l] [-p] [-f threads] [-m threads]
+// [-c capacity] [-t traders] <products> <traders> ...
+// Strips the options from the arguments, keeping the program name in argv[0]
+// Returns 0, or -1 on an unknown option or an invalid value
+int parse_options(int *argc_ptr, char ***argv_ptr, exchange_options *options) {
+    memset(options, 0, sizeof(exchange_options));
+    options->pool_capacity = DEFAULT_POOL_CAPACITY;
+
+    int argc = *argc_ptr;
+    char **argv = *argv_ptr;
+    opterr = 0;
+    optind = 1;
+    int option = -1;
+    while (-1 != (option = getopt(argc, argv, EXCHANGE_OPTIONS))) {
+        int *value = NULL;
+        switch (option) {
+            case SHM_TRANSPORT_FLAG:
+                options->is_shm = true;
+                break;
+            case EVENT_LOOP_FLAG:
+                options->is_event_loop = true;
+                break;
+            case LOG_THREAD_FLAG:
+                options->is_log_thread = true;
+                break;
+            case PIPELINE_FLAG:
+                options->is_pipelined = true;
+                break;
+            case FANOUT_THREADS_FLAG:
+                value = &options->num_workers;
+                break;
+            case MATCHER_THREADS_FLAG:
+                value = &options->num_matchers;
+                break;
+            case POOL_CAPACITY_FLAG:
+                value = &options->pool_capacity;
+                break;
+            case TRADER_FILE_FLAG:
+                options->trader_file = optarg;
+                break;
+            default:
+                #ifdef DEBUG
+                    printf("Error: unknown option or missing value -%c\n",
+                            optopt);
+                #endif
+                return -1;
+        }
+        if (NULL != value && -1 == (*value = parse_positive(option, optarg))) {
+            return -1;
+        }
+    }
+
+    // The shared-memory transport needs the event loop, the pipeline
+    // publishes after at least one matcher thread, and the fan-out workers
+    // take the messages from the publisher
+    options->is_event_loop = options->is_event_loop || options->is_shm;
+    options->is_pipelined = options->is_pipelined || options->num_workers > 0;
+    if (options->is_pipelined && 0 == options->num_matchers) {
+        options->num_matchers = 1;
+    }
+
+    argv[optind - 1] = argv[0];
+    *argv_ptr = argv + optind - 1;
+    *argc_ptr = argc - (optind - 1);
+    return 0;
+}
+
+// Read the traders to launch from a file instead of the arguments
+// One trader binary per line, optionally followed by how many copies of it
+// to launch, eg. "./spx_trader 100", '#' starts a comment line
+// Returns the arguments with the traders inserted after the products file,
+// as if they had been given there, and updates argc_ptr
+// The new arguments point into *contents_ptr, both are freed by the caller
+// Returns NULL on error
+char **load_trader_file(char *filename, int *argc_ptr, char **argv,
+                        char **contents_ptr) {
+    FILE *file = fopen(filename, "r");
+    if (NULL == file) {
+        #ifdef DEBUG
+            printf("Error in load_trader_file(): fopen returned NULL, \
+                    errno: %s (%d)\n", strerror(errno), errno);
+        #endif
+        return NULL;
+    }
+
+    // Read the whole file, the lines are split in place
+    long size = -1;
+    if (0 == fseek(file, 0, SEEK_END)) {
+        size = ftell(file);
+    }
+    if (size < 0) {
+        #ifdef DEBUG
+            printf("Error in load_trader_file(): could not get the size of \
+                    %s, errno: %s (%d)\n", filename, strerror(errno), errno);
+        #endif
+        fclose(file);
+        return NULL;
+    }
+    rewind(file);
+    char *contents = my_calloc(size + 1, sizeof(char));
+    if (NULL == contents || size != (long) fread(contents, 1, size, file)) {
+        fclose(file);
+        my_free(contents);
+        return NULL;
+    }
+    fclose(file);
+
+    // Count the traders first to size the arguments
+    int num_traders = 0;
+    int num_lines = 1;
+    for (long i = 0; i < size; i++) {
+        num_lines += ('\n' == contents[i]);
+    }
+    char **names = my_calloc(num_lines, sizeof(char *));
+    int *copies = my_calloc(num_lines, sizeof(int));
+    if (NULL == names || NULL == copies) {
+        my_free(names);
+        my_free(copies);
+        my_free(contents);
+        return NULL;
+    }
+    int num_names = 0;
+    char *save = NULL;
+    for (char *line = strtok_r(contents, "\n", &save); NULL != line;
+            line = strtok_r(NULL, "\n", &save)) {
+        char *fields = NULL;
+        char *name = strtok_r(line, " \t\r", &fields);
+        if (NULL == name || TRADER_FILE_COMMENT == name[0]) {
+            continue;
+        }
+        char *count = strtok_r(NULL, " \t\r", &fields);
+        long num_copies = 1;
+        char *end = NULL;
+        if (NULL != count) {
+            num_copies = strtol(count, &end, 10);
+        }
+        if (num_copies <= 0 || (NULL != end && '\0' != *end)
+            || num_copies > INT_MAX - *argc_ptr - num_traders - 1) {
+            #ifdef DEBUG
+                printf("Error in load_trader_file(): bad count for %s\n",
+                        name);
+            #endif
+            my_free(names);
+            my_free(copies);
+            my_free(contents);
+            return NULL;
+        }
+        copies[num_names] = num_copies;
+        names[num_names] = name;
+        num_traders += copies[num_names];
+        num_names++;
+    }
+
+    // <program> <products> <traders from the file> <the rest>
+    int argc = *argc_ptr + num_traders;
+    char **new_argv = my_calloc(argc + 1, sizeof(char *));
+    if (NULL == new_argv) {
+        my_free(names);
+        my_free(copies);
+        my_free(contents);
+        return NULL;
+    }
+    int arg = 0;
+    for (; arg < 2 && arg < *argc_ptr; arg++) {
+        new_argv[arg] = argv[arg];
+    }
+    for (int i = 0; i < num_names; i++) {
+        for (int j = 0; j < copies[i]; j++) {
+            new_argv[arg++] = names[i];
+        }
+    }
+    for (int i = 2; i < *argc_ptr; i++) {
+        new_argv[arg++] = argv[i];
+    }
+
+    my_free(names);
+    my_free(copies);
+    *argc_ptr = arg;
+    *contents_ptr = contents;
+    return new_argv;
+}
+
+// Raise the limit on open files to what the traders' pipes (and eventfds)
+// need, as far as the hard limit allows
+// Returns 0 if there is room for every trader, -1 otherwise
+int raise_fd_limit(int num_traders) {
+    struct rlimit limit;
+    if (-1 == getrlimit(RLIMIT_NOFILE, &limit)) {
+        return -1;
+    }
+
+    rlim_t needed = (rlim_t) FDS_PER_TRADER * num_traders + MAX_EPOLL_EVENTS;
+    if (limit.rlim_cur >= needed) {
+        return 0;
+    }
+    limit.rlim_cur = (RLIM_INFINITY == limit.rlim_max
+                        || limit.rlim_max >= needed) ? needed
+                                                     : limit.rlim_max;
+    if (-1 == setrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur < needed) {
+        #ifdef DEBUG
+            printf("Error in raise_fd_limit(): %d traders need %llu files\n",
+                    num_traders, (unsigned long long) needed);
+        #endif
+        return -1;
+    }
+    return 0;
+}
+
+// Allocate a zeroed order from the order pool
+order *alloc_order() {
+    return pool_alloc(thread_order_pool);
+}
+
 // Frees the memory associated with the order struct
 void free_order(order *current_order) {
-    if (NULL != current_order->product_name) {
-        my_free(current_order->product_name);
-    }
-    my_free(current_order);
+    pool_free(thread_order_pool, current_order);
+}
+
+// Allocate a zeroed price level from the level pool
+price_level *alloc_level() {
+    return pool_alloc(thread_level_pool);
+}
+
+// Return the price level to the level pool
+void free_level(price_level *level) {
+    pool_free(thread_level_pool, level);
 }
 
+
 // Frees the memory on the heap that stores names of the named pipes
 int free_pipenames(char **e2t_pipenames, char **t2e_pipenames, int size) {
     for (int i = 0; i < size; i++) {
@@ -118,6 +485,21 @@ trader *launch_trader(char *trader_filename, char *e2t_pipename,
     current_trader->is_autotrader = (0 == strcmp(trader_filename,
                                         "./spx_trader"));
 
+    // Create the shared-memory channel before fork so the trader inherits
+    // its eventfds
+    if (is_shm_transport()) {
+        current_trader->channel = create_shm_channel(trader_id,
+                                                    &current_trader->eventfds);
+        if (NULL == current_trader->channel) {
+            printf("Error in launch_trader(): could not create the shared \
+                    memory channel, errno: %s (%d)\n", strerror(errno), errno);
+            my_free(current_trader);
+            return NULL;
+        }
+    }
+
+    // The child must not inherit the lines still buffered
+    fflush(stdout);
     int pid = fork();
 
     if (pid < 0) {
@@ -131,6 +513,14 @@ trader *launch_trader(char *trader_filename, char *e2t_pipename,
         printf("%s Starting trader %d (%s)\n", LOG_PREFIX, trader_id,
                 trader_filename);
 
+        // Only this trader's eventfds stay open across execv
+        if (NULL != current_trader->channel
+            && -1 == inherit_shm_eventfds(&current_trader->eventfds)) {
+            printf("Error in launch_trader(): inherit_shm_eventfds returned \
+                    -1, errno: %s (%d)\n", strerror(errno), errno);
+            return NULL;
+        }
+
         // fork() exchange and then replace it with a trader image
         #ifdef TESTING
             char *char_array[]= {trader_filename, char_trader_id,
@@ -151,8 +541,30 @@ trader *launch_trader(char *trader_filename, char *e2t_pipename,
     } else {
         // Parent
         current_trader->pid = pid;
-        current_trader->e2t_fd_wronly = open(e2t_pipename, O_WRONLY);
-        current_trader->t2e_fd_rdonly = open(t2e_pipename, O_RDONLY);
+        // The traders launched later do not inherit this one's pipes
+        current_trader->e2t_fd_wronly = open(e2t_pipename,
+                                                O_WRONLY | O_CLOEXEC);
+        current_trader->t2e_fd_rdonly = open(t2e_pipename,
+                                                O_RDONLY | O_CLOEXEC);
+        init_frame_reader(&current_trader->input, current_trader->t2e_fd_rdonly);
+        init_frame_writer(&current_trader->output,
+                            current_trader->e2t_fd_wronly);
+
+        // The FIFOs stay open as the connection, messages use the rings
+        if (NULL != current_trader->channel) {
+            current_trader->input.ring = &current_trader->channel->t2e;
+            current_trader->input.room_eventfd =
+                current_trader->eventfds.t2e_room;
+            current_trader->output.ring = &current_trader->channel->e2t;
+            current_trader->output.room_eventfd =
+                current_trader->eventfds.e2t_room;
+        } else {
+            int fd = current_trader->e2t_fd_wronly;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+        // A trader that stops reading never blocks the exchange, its
+        // messages wait in the backlog
+        current_trader->output.backlog = &current_trader->backlog;
 
         printf("%s Connected to %s\n", LOG_PREFIX, e2t_pipename);
         printf("%s Connected to %s\n", LOG_PREFIX, t2e_pipename);
@@ -170,22 +582,19 @@ void unlink_pipes(char **e2t_pipenames, int size) {
 
 // Opens the market
 int open_market(trader **traders, int num_traders) {
-    char *market_open = "MARKET OPEN;";
-
-    // Writes to all the named pipes
+    // Writes to all the named pipes (or rings)
     for (int i = 0; i < num_traders; i++) {
         trader *current_trader = traders[i];
-        if (-1 == write(current_trader->e2t_fd_wronly, market_open,
-                            strlen(market_open))) {
+        if (-1 == append_frame(&current_trader->output, "MARKET OPEN;")
+            || -1 == flush_frames(&current_trader->output)) {
             printf("Error in open_market(): write returned -1, \
                     errno: %s (%d)\n", strerror(errno), errno);
         }
     }
 
-    // Send SIGUSR1 to every trader
+    // Wake every trader
     for (int i = 0; i < num_traders; i++) {
-        trader *current_trader = traders[i];
-        if (0 != kill(current_trader->pid, SIGUSR1)) {
+        if (-1 == wake_trader(traders[i])) {
             printf("Error in open_market(): kill returned -1, \
                     errno: %s (%d)\n", strerror(errno), errno);
         }
@@ -194,104 +603,156 @@ int open_market(trader **traders, int num_traders) {
     return 0;
 }
 
-// Search for the order that with the order id associated with the current trader
-order *search_orders(trader *current_trader, int order_id, order *orders) {
-    order *cursor = orders;
-    while (NULL != cursor) {
-        bool equal_order_ids = (cursor->order_id == order_id);
-        bool equal_pids = (cursor->owner->pid == current_trader->pid);
-        if (equal_order_ids && equal_pids) {
-            return cursor;
-        }
-        cursor = cursor->next;
+// Tell the trader that there are messages for it, with SIGUSR1 or through
+// the eventfd of its shared-memory channel
+// A trader cut off for falling too far behind is not woken any more, it is
+// disconnected instead
+int wake_trader(trader *current_trader) {
+    if (current_trader->backlog.is_overflowed) {
+        return 0;
     }
-    return NULL;
+    if (NULL != current_trader->channel) {
+        return wake_peer(current_trader->eventfds.e2t);
+    }
+    return kill(current_trader->pid, SIGUSR1);
 }
 
-// Search through the buy and sell orders of every product for the current trader's
-// order with the matching order id
-order *search_orderbook(trader *current_trader, int order_id,
-                        product_order **orderbook, int num_products) {
+// Mark a trader whose backlog has overflowed for the main thread to
+// disconnect, the writer may be the publisher or a fan-out worker
+static void cut_off_trader(trader *current_trader) {
+    if (!atomic_exchange(&current_trader->is_cut_off, true)) {
+        atomic_store(&has_cut_off_traders, true);
+    }
+}
 
-    // Search through every product
-    for (int i = 0; i < num_products; i++) {
-        product_order *current_product = orderbook[i];
+// Get the current trader's live order with the order id
+// Returns NULL if the order has been filled, cancelled or never existed
+order *get_order(trader *current_trader, int order_id) {
+    if (order_id < 0 || order_id >= current_trader->orders_capacity) {
+        return NULL;
+    }
+    return current_trader->orders[order_id];
+}
 
-        order *buy_order = search_orders(current_trader, order_id,
-                                            current_product->buy_orders);
-        order *sell_order = search_orders(current_trader, order_id,
-                                            current_product->sell_orders);
+// Make room in the trader's order index for the order id
+// Order ids are dense, so grow the index by doubling
+int reserve_order_index(trader *current_trader, int order_id) {
+    if (order_id < current_trader->orders_capacity) {
+        return 0;
+    }
 
-        if (NULL != buy_order) {
-            return buy_order;
-        } else if (NULL != sell_order) {
-            return sell_order;
-        }
+    int capacity = (0 == current_trader->orders_capacity) ?
+                    INITIAL_ORDER_CAPACITY : current_trader->orders_capacity;
+    while (order_id >= capacity) {
+        capacity *= 2;
     }
 
-    return NULL;
-}
+    order **orders = my_realloc(current_trader->orders,
+                                capacity * sizeof(order *));
+    int *order_products = my_realloc(current_trader->order_products,
+                                        capacity * sizeof(int));
+    if (NULL != orders) {
+        current_trader->orders = orders;
+    }
+    if (NULL != order_products) {
+        current_trader->order_products = order_products;
+    }
+    if (NULL == orders || NULL == order_products) {
+        return -1;
+    }
 
-// Enqueue a node at the head
-// The node contains the pid of the trader that sent SIGUSR1
-void enqueue(queue *my_queue, int pid, int signal_type) {
-    node *new_node = my_calloc(1, sizeof(node));
-    new_node->pid = pid;
-    new_node->signal = signal_type;
+    memset(orders + current_trader->orders_capacity, 0,
+            (capacity - current_trader->orders_capacity) * sizeof(order *));
+    current_trader->orders_capacity = capacity;
+    return 0;
+}
 
-    node *head = my_queue->head;
-    if (NULL == head) {
-        new_node->next = NULL;
-        new_node->prev = NULL;
-    } else {
-        new_node->next = head;
-        new_node->prev = NULL;
-        head->prev = new_node;
+// Add the order to its owner's order index
+// Returns 0 on success, -1 if the index could not grow
+int index_order(order *current_order) {
+    trader *owner = current_order->owner;
+    if (NULL == owner) {
+        return 0;
+    }
+    if (-1 == reserve_order_index(owner, current_order->order_id)) {
+        #ifdef DEBUG
+            printf("Error in index_order(): could not grow the index to %d\n",
+                    current_order->order_id);
+        #endif
+        return -1;
     }
 
-    my_queue->size += 1;
-    my_queue->head = new_node;
+    owner->orders[current_order->order_id] = current_order;
+    return 0;
 }
 
-// Dequeue the node from the tail
-node *dequeue(queue *my_queue) {
-    node *head = my_queue->head;
-    if (NULL == head) {
-        return NULL;
+// Remove the order from its owner's order index
+void unindex_order(order *current_order) {
+    trader *owner = current_order->owner;
+    if (NULL == owner) {
+        return;
     }
 
-    node *cursor = my_queue->head;
-
-    // Traverse to the tail node
-    while (NULL != cursor->next) {
-        cursor = cursor->next;
+    if (current_order == get_order(owner, current_order->order_id)) {
+        owner->orders[current_order->order_id] = NULL;
     }
+}
 
-    // Remove the tail node
-    bool reset = true;
-    if (NULL != cursor->prev) {
-        cursor->prev->next = NULL;
-        reset = false;
+// Write the signal and the pid of its sender to the ring
+// Called from the signal handlers: no allocation, lock-free atomics only
+// Returns false (dropping the signal) if the ring is full
+bool enqueue(signal_ring *ring, pid_t pid, int signal_type) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == SIGNAL_RING_CAPACITY) {
+        return false;
     }
 
-    if (reset) {
-        my_queue->head = NULL;
+    signal_record *record = &ring->records[head & (SIGNAL_RING_CAPACITY - 1)];
+    record->pid = pid;
+    record->signal = signal_type;
+
+    // Publish the record to the consumer
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Read the oldest signal from the ring
+// Returns false if the ring is empty
+bool dequeue(signal_ring *ring, signal_record *record) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        return false;
     }
 
-    my_queue->size -= 1;
-    return cursor;
+    *record = ring->records[tail & (SIGNAL_RING_CAPACITY - 1)];
+
+    // Hand the slot back to the producer
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Returns whether there are no signals waiting in the ring
+bool is_queue_empty(signal_ring *ring) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return head == tail;
 }
 
 void sigusr1_handler(int signo, siginfo_t* sinfo, void* context) {
-    enqueue(my_queue, sinfo->si_pid, SIGUSR1);
+    enqueue(&my_queue, sinfo->si_pid, SIGUSR1);
 }
 
 void sigchild_handler(int signo, siginfo_t* sinfo, void* context) {
-    enqueue(my_queue, sinfo->si_pid, SIGCHLD);
+    enqueue(&my_queue, sinfo->si_pid, SIGCHLD);
 }
 
 // Gets the information of the products from the product file
-char **get_products(char *product_filename, int *num_products_ptr) {
+// Each line is a product name, optionally followed by "ladder" to select the
+// price ladder book for that product
+char **get_products(char *product_filename, int *num_products_ptr,
+                    enum book_mode **modes_ptr) {
     FILE *fp = fopen(product_filename, "r");
 
     char buffer[BUFFER_SIZE] = {0};
@@ -304,6 +765,8 @@ char **get_products(char *product_filename, int *num_products_ptr) {
     }
 
     char **products = my_calloc(*num_products_ptr, sizeof(char *));
+    enum book_mode *modes = my_calloc(*num_products_ptr,
+                                        sizeof(enum book_mode));
 
     // Store each product name in a array of strings
     for (int i = 0; i < *num_products_ptr; i++) {
@@ -321,15 +784,110 @@ char **get_products(char *product_filename, int *num_products_ptr) {
             *ptr = '\0';
         }
 
+        // Split off the book mode
+        modes[i] = SORTED_BOOK;
+        ptr = strchr(buffer, ' ');
+        if (ptr) {
+            *ptr = '\0';
+            if (0 == strcmp(ptr + 1, LADDER_KEYWORD)) {
+                modes[i] = LADDER_BOOK;
+            }
+        }
+
         // Allocate memory and store within the array
         products[i] = my_calloc(strlen(buffer) + 1, sizeof(char));
         strcpy(products[i], buffer);
 
     }
 
+    fclose(fp);
+    *modes_ptr = modes;
     return products;
 }
 
+// Hash a product name (FNV-1a)
+static unsigned int hash_symbol(char *name) {
+    unsigned int hash = 2166136261u;
+    while ('\0' != *name) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+        name++;
+    }
+    return hash;
+}
+
+// Build the symbol table that interns every product name to its index
+// in the products file
+int init_symbol_table(char **products, int num_products) {
+    symbols = my_calloc(1, sizeof(symbol_table));
+    symbols->names = products;
+    symbols->num_symbols = num_products;
+
+    // Keep the load factor at or below 1/2
+    int capacity = 1;
+    while (capacity < 2 * num_products) {
+        capacity *= 2;
+    }
+    symbols->capacity = capacity;
+    symbols->slots = my_calloc(capacity, sizeof(int));
+    for (int i = 0; i < capacity; i++) {
+        symbols->slots[i] = -1;
+    }
+
+    for (int id = 0; id < num_products; id++) {
+        unsigned int slot = hash_symbol(products[id]) & (capacity - 1);
+        while (-1 != symbols->slots[slot]) {
+            if (0 == strcmp(products[symbols->slots[slot]], products[id])) {
+                #ifdef DEBUG
+                    printf("Error: duplicate product %s\n", products[id]);
+                #endif
+                return -1;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+        symbols->slots[slot] = id;
+    }
+
+    return 0;
+}
+
+// Free the symbol table (the product names are owned by the products array)
+void free_symbol_table() {
+    if (NULL == symbols) {
+        return;
+    }
+    my_free(symbols->slots);
+    my_free(symbols);
+    symbols = NULL;
+}
+
+// Get the product id of the product name, or -1 if it is not traded
+int get_product_id(char *product_name) {
+    if (NULL == symbols || NULL == product_name) {
+        return -1;
+    }
+
+    unsigned int mask = symbols->capacity - 1;
+    unsigned int slot = hash_symbol(product_name) & mask;
+    while (-1 != symbols->slots[slot]) {
+        int id = symbols->slots[slot];
+        if (0 == strcmp(symbols->names[id], product_name)) {
+            return id;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+// Get the product name of the product id, or NULL if it is not traded
+char *get_product_name(int product_id) {
+    if (NULL == symbols || product_id < 0
+        || product_id >= symbols->num_symbols) {
+        return NULL;
+    }
+    return symbols->names[product_id];
+}
+
 // Frees the memory associated with a 2d char array
 void free_2d_char_array(char **array, int size) {
     for (int i = 0; i < size; i++) {
@@ -351,12 +909,11 @@ void print_products(char **products, int num_products) {
 
 // Free the memory on the heap associated with the trader
 void free_trader(trader *current_trader) {
-    position *head = current_trader->positions;
-    while (NULL != head) {
-        position *tmp = head;
-        head = head->next;
-        my_free(tmp);
-    }
+    my_free(current_trader->orders);
+    my_free(current_trader->order_products);
+    free_backlog(&current_trader->backlog);
+    close_shm_channel(current_trader->channel, current_trader->trader_id,
+                        &current_trader->eventfds);
 }
 
 // Free the memory on the heap associated with all traders
@@ -368,243 +925,769 @@ void free_traders(trader **traders, int size) {
         my_free(traders[i]);
     }
     my_free(traders);
+    free_trader_registry();
 }
 
-// Given a pid, get the corresponding trader struct
-trader *get_trader_id(trader **traders, int num_traders, int pid) {
+// Hash of a pid, Fibonacci hashing spreads the consecutive pids of the
+// traders over the table
+static unsigned int hash_pid(int pid) {
+    return (unsigned int) pid * 2654435761u;
+}
+
+// Build the registry that finds each launched trader by its pid
+// Returns 0 on success, -1 on error
+int init_trader_registry(trader **traders, int num_traders) {
+    registry = my_calloc(1, sizeof(trader_registry));
+    registry->traders = traders;
+    registry->num_traders = num_traders;
+
+    // Keep the load factor at or below 1/2
+    int capacity = 1;
+    while (capacity < 2 * num_traders) {
+        capacity *= 2;
+    }
+    registry->capacity = capacity;
+    registry->slots = my_calloc(capacity, sizeof(int));
+    if (NULL == registry->slots) {
+        return -1;
+    }
+    for (int i = 0; i < capacity; i++) {
+        registry->slots[i] = -1;
+    }
+
     for (int i = 0; i < num_traders; i++) {
-        if (pid == traders[i]->pid) {
-            return traders[i];
+        // A trader that failed to launch is never signalled
+        if (NULL == traders[i]) {
+            continue;
         }
+        unsigned int slot = hash_pid(traders[i]->pid) & (capacity - 1);
+        while (-1 != registry->slots[slot]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        registry->slots[slot] = i;
     }
-    return NULL;
-}
-
-// Creates an order struct that stores the associated information from the buffer
-order *init_amended_order(char buffer[BUFFER_SIZE],
-                            trader *current_trader, order *old_order) {
 
-    char tmp[BUFFER_SIZE] = {0};
-    strcpy(tmp, buffer);
+    return 0;
+}
 
-    // Get the values from the buffer
-    order *new_order = my_calloc(1, sizeof(order));
-    strtok(tmp, " ");
-    int order_id = atoi(strtok(NULL, " "));
-    int quantity = atoi(strtok(NULL, " "));
-    int price = atoi(strtok(NULL, " "));
+// Free the trader registry (the traders are owned by the traders array)
+void free_trader_registry() {
+    if (NULL == registry) {
+        return;
+    }
+    my_free(registry->slots);
+    my_free(registry);
+    registry = NULL;
+}
 
-    if (price < 0 || quantity < 0 || (old_order->order_id != order_id)) {
-        #ifdef DEBUG
-            printf("Error in init_amended_order(): \
-                    price and/or quantity < 0 and/or order id not equal\n");
-        #endif
-        free_order(new_order);
+// Given a pid, get the corresponding trader struct, or NULL
+trader *get_trader_id(int pid) {
+    if (NULL == registry) {
         return NULL;
     }
 
-    // Initialise trader fields
-    new_order->product_name = my_calloc(strlen(old_order->product_name) + 1,
-                                        sizeof(char));
-    strcpy(new_order->product_name, old_order->product_name);
-
-    new_order->type = old_order->type;
-    new_order->amended = true;
-
-    new_order->owner = current_trader;
-    new_order->order_id = order_id;
-    new_order->quantity = quantity;
-    new_order->price = price;
+    unsigned int mask = registry->capacity - 1;
+    unsigned int slot = hash_pid(pid) & mask;
+    while (-1 != registry->slots[slot]) {
+        trader *current_trader = registry->traders[registry->slots[slot]];
+        if (pid == current_trader->pid) {
+            return current_trader;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
 
-    return new_order;
+// Get the next command from the trader's input buffer, reading the pipe in
+// chunks when the buffer holds no complete command
+// Returns 1 with the command in buffer, 0 if the pipe has no complete
+// command yet, -1 on end of file or error
+int read_command(trader *current_trader, char buffer[BUFFER_SIZE]) {
+    return read_frame(&current_trader->input, buffer);
 }
 
 // Creates an order struct that stores the associated information from the buffer
+// The buffer must hold a cmd command (the ';' is optional)
 order *init_new_order(enum order_state cmd, char buffer[BUFFER_SIZE],
                         trader *current_trader, enum order_type type) {
+    command parsed;
+    if (-1 == parse_text_command(buffer, &parsed) || cmd != parsed.cmd) {
+        return NULL;
+    }
+    return init_order(&parsed, current_trader, type);
+}
 
-    char tmp[BUFFER_SIZE] = {0};
-    strcpy(tmp, buffer);
-
-    order *new_order = my_calloc(1, sizeof(order));
-
-    // Get the values from the buffer
-    strtok(tmp, " ");
-    int order_id = atoi(strtok(NULL, " "));
-    char *product_name = strtok(NULL, " ");
-    int quantity = atoi(strtok(NULL, " "));
-    int price = atoi(strtok(NULL, " "));
+// Creates an order struct from a decoded BUY/SELL command
+order *init_order(command *parsed, trader *current_trader,
+                    enum order_type type) {
+    if (parsed->price < 0 || parsed->quantity < 0) {
+        #ifdef DEBUG
+            printf("Error in init_order(): price and/or quantity < 0\n");
+        #endif
+        return NULL;
+    }
 
-    if (price < 0 || quantity < 0) {
+    order *new_order = alloc_order();
+    if (NULL == new_order) {
         #ifdef DEBUG
-            printf("Error in init_new_order(): price and/or quantity < 0\n");
+            printf("Error in init_order(): the order pool is empty\n");
         #endif
-        free_order(new_order);
         return NULL;
     }
 
     // Initialise order fields
-    new_order->product_name = my_calloc(strlen(product_name) + 1, sizeof(char));
-    strcpy(new_order->product_name, product_name);
+    new_order->product_id = parsed->product_id;
 
     new_order->type = type;
     new_order->amended = false;
 
     new_order->owner = current_trader;
-    new_order->order_id = order_id;
-    new_order->quantity = quantity;
-    new_order->price = price;
+    new_order->order_id = parsed->order_id;
+    new_order->quantity = parsed->quantity;
+    new_order->price = parsed->price;
 
     return new_order;
 }
 
-// Insert a new order into the linked list of orders
-order *insert_linked_list(order *head, order *cursor, order *new_order) {
-    if (NULL == cursor) {
-        // Travel to the tail
-        order *tmp = head;
-        while (NULL != tmp->next) {
-            tmp = tmp->next;
-        }
-
-        // Insert at the tail
-        tmp->next = new_order;
-        new_order->prev = tmp;
-        new_order->next = NULL;
-
-        return head;
-    } else if (NULL == cursor->prev) {
-        // Insert at the head
-        cursor->prev = new_order;
-        new_order->next = cursor;
-        new_order->prev = NULL;
-        return new_order;
+// Initialise an empty BUY or SELL side of a product
+void init_book_side(book_side *side, enum order_type type,
+                    enum book_mode mode) {
+    side->type = type;
+    side->mode = mode;
+    side->best_price = 0;
+    side->total_quantity = 0;
+    side->num_levels = 0;
+
+    if (LADDER_BOOK == mode) {
+        side->levels = NULL;
+        side->capacity = 0;
+        init_ladder(&side->ladder);
     } else {
-        // Insert in the middle
-        new_order->prev = cursor->prev;
-        new_order->next = cursor;
-        (cursor->prev)->next = new_order;
-        cursor->prev = new_order;
-        return head;
+        side->levels = my_calloc(INITIAL_LEVEL_CAPACITY, sizeof(price_level *));
+        side->capacity = INITIAL_LEVEL_CAPACITY;
+        memset(&side->ladder, 0, sizeof(price_ladder));
     }
 }
 
-// Inserts new order into the BUY or SELL linked list
-// BUY is arranged in descending order
-// SELL is arranged in ascending order
-order *insert_order(order *head, order *new_order, enum order_type cmd) {
-    if (NULL == head) {
-        return new_order;
+// Initialise an empty price ladder
+// The window is positioned around the first price inserted
+void init_ladder(price_ladder *ladder) {
+    ladder->base_price = -1;
+    ladder->window = LADDER_WINDOW;
+    ladder->best = -1;
+    ladder->num_levels = 0;
+    ladder->slots = my_calloc(LADDER_WINDOW, sizeof(price_level *));
+    ladder->bitmap = my_calloc(LADDER_WINDOW / BITS_PER_WORD, sizeof(uint64_t));
+}
+
+// Get the highest non-empty slot strictly below the slot, or -1
+int ladder_highest_below(price_ladder *ladder, int slot) {
+    if (slot <= 0) {
+        return -1;
     }
+    slot -= 1;
 
-    order *cursor = head;
-    while (NULL != cursor) {
-        if ((BUY == cmd) && (new_order->price > cursor->price)) {
-            // Stop once reach a lower priced order
-            break;
-        } else if ((SELL == cmd) && (new_order->price < cursor->price)) {
-            // Stop once reach a higher priced order
-            break;
+    int word = slot / BITS_PER_WORD;
+    int bit = slot % BITS_PER_WORD;
+
+    // Mask out the bits above the slot in the first word
+    uint64_t bits = ladder->bitmap[word];
+    if (BITS_PER_WORD - 1 != bit) {
+        bits &= ((uint64_t) 1 << (bit + 1)) - 1;
+    }
+
+    while (true) {
+        if (0 != bits) {
+            int highest_bit = (BITS_PER_WORD - 1) - __builtin_clzll(bits);
+            return word * BITS_PER_WORD + highest_bit;
+        }
+        word -= 1;
+        if (word < 0) {
+            return -1;
         }
-        cursor = cursor->next;
+        bits = ladder->bitmap[word];
     }
+}
 
-    // Insert the order within the linked list
-    order *new_head = insert_linked_list(head, cursor, new_order);;
+// Get the lowest non-empty slot strictly above the slot, or -1
+int ladder_lowest_above(price_ladder *ladder, int slot) {
+    slot += 1;
+    if (slot >= ladder->window) {
+        return -1;
+    }
 
-    return new_head;
-}
+    int num_words = ladder->window / BITS_PER_WORD;
+    int word = slot / BITS_PER_WORD;
+    int bit = slot % BITS_PER_WORD;
 
-// Get the product struct corresponding to the product name
-// The product struct stores the BUY and SELL orders associated with the name
-product_order *get_product_from_orderbook(product_order **orderbook,
-                                            char *product_name,
-                                            int num_products) {
+    // Mask out the bits below the slot in the first word
+    uint64_t bits = ladder->bitmap[word] & ~(((uint64_t) 1 << bit) - 1);
 
-    for (int i = 0; i < num_products; i++) {
-        if (0 == strcmp(orderbook[i]->product_name, product_name)) {
-            return orderbook[i];
+    while (true) {
+        if (0 != bits) {
+            return word * BITS_PER_WORD + __builtin_ctzll(bits);
+        }
+        word += 1;
+        if (word >= num_words) {
+            return -1;
         }
+        bits = ladder->bitmap[word];
     }
-    return NULL;
 }
 
-// Delete the order within the linked list
-order *delete_order(order *current_order, order *head) {
-    if (NULL == head) {
+// Move (and if needed widen) the window so it covers the price and every
+// existing level, centred on them
+// Returns -1 if that would take more than LADDER_MAX_WINDOW slots
+int recentre_ladder(price_ladder *ladder, int price) {
+    int low = price;
+    int high = price;
+
+    int lowest = ladder_lowest_above(ladder, -1);
+    if (-1 != lowest) {
+        int highest = ladder_highest_below(ladder, ladder->window);
+        low = (ladder->base_price + lowest < low) ?
+                ladder->base_price + lowest : low;
+        high = (ladder->base_price + highest > high) ?
+                ladder->base_price + highest : high;
+    }
+
+    int window = ladder->window;
+    while (high - low + 1 > window) {
+        window *= 2;
+    }
+    if (window > LADDER_MAX_WINDOW) {
+        return -1;
+    }
+
+    int base_price = low - (window - (high - low + 1)) / 2;
+    if (base_price < 0) {
+        base_price = 0;
+    }
+
+    price_level **slots = my_calloc(window, sizeof(price_level *));
+    uint64_t *bitmap = my_calloc(window / BITS_PER_WORD, sizeof(uint64_t));
+    if (NULL == slots || NULL == bitmap) {
+        my_free(slots);
+        my_free(bitmap);
+        return -1;
+    }
+
+    // Move the existing levels into the new window
+    int best_price = (-1 == ladder->best) ? -1 :
+                        ladder->slots[ladder->best]->price;
+    int slot = lowest;
+    while (-1 != slot) {
+        int new_slot = ladder->base_price + slot - base_price;
+        slots[new_slot] = ladder->slots[slot];
+        bitmap[new_slot / BITS_PER_WORD] |=
+                        (uint64_t) 1 << (new_slot % BITS_PER_WORD);
+        slot = ladder_lowest_above(ladder, slot);
+    }
+
+    my_free(ladder->slots);
+    my_free(ladder->bitmap);
+    ladder->slots = slots;
+    ladder->bitmap = bitmap;
+    ladder->window = window;
+    ladder->base_price = base_price;
+    ladder->best = (-1 == best_price) ? -1 : best_price - base_price;
+
+    return 0;
+}
+
+// Returns whether the price falls in the ladder's window
+static bool is_in_window(price_ladder *ladder, int price) {
+    int slot = price - ladder->base_price;
+    return -1 != ladder->base_price && slot >= 0 && slot < ladder->window;
+}
+
+// Get the level at the price in the ladder, or NULL if it is empty
+price_level *ladder_get_level(price_ladder *ladder, int price) {
+    if (!is_in_window(ladder, price)) {
         return NULL;
     }
+    return ladder->slots[price - ladder->base_price];
+}
+
+// Put the level in its slot of the ladder
+void ladder_link_level(book_side *side, price_level *level) {
+    price_ladder *ladder = &side->ladder;
+    int slot = level->price - ladder->base_price;
+
+    ladder->slots[slot] = level;
+    ladder->bitmap[slot / BITS_PER_WORD] |=
+                    (uint64_t) 1 << (slot % BITS_PER_WORD);
+    ladder->num_levels += 1;
+
+    // BUY levels are better when higher, SELL levels when lower
+    bool is_better = (BUY == side->type) ? (slot > ladder->best) :
+                                            (slot < ladder->best);
+    if (-1 == ladder->best || is_better) {
+        ladder->best = slot;
+    }
+}
+
+// Move the sorted levels that now fall in the window into the ladder
+void ladder_adopt_levels(book_side *side) {
+    int num_kept = 0;
+    for (int i = 0; i < side->num_levels; i++) {
+        price_level *level = side->levels[i];
+        if (is_in_window(&side->ladder, level->price)) {
+            ladder_link_level(side, level);
+        } else {
+            side->levels[num_kept++] = level;
+        }
+    }
+    side->num_levels = num_kept;
+}
+
+// Position the window so it covers the price, if it can without growing
+// past LADDER_MAX_WINDOW
+// Returns whether the price is in the window
+bool ladder_fit_price(book_side *side, int price) {
+    price_ladder *ladder = &side->ladder;
+    if (is_in_window(ladder, price)) {
+        return true;
+    }
+
+    if (-1 == ladder->base_price) {
+        ladder->base_price = (price > ladder->window / 2) ?
+                                price - ladder->window / 2 : 0;
+    } else if (-1 == recentre_ladder(ladder, price)) {
+        return false;
+    }
+
+    ladder_adopt_levels(side);
+    return true;
+}
+
+// Get the level at the price in the ladder, creating it if it does not exist
+// The price must be in the window
+price_level *ladder_insert_level(book_side *side, int price) {
+    price_ladder *ladder = &side->ladder;
+    int slot = price - ladder->base_price;
+    if (NULL != ladder->slots[slot]) {
+        return ladder->slots[slot];
+    }
 
-    if (NULL == current_order->prev && NULL == current_order->next) {
-        // Only node in the linked list
-        free_order(current_order);
+    price_level *new_level = alloc_level();
+    if (NULL == new_level) {
         return NULL;
-    } else if (NULL == current_order->prev && NULL != current_order->next) {
-        // Head node in the linked list
-        order *tmp = current_order->next;
-        tmp->prev = NULL;
-        free_order(current_order);
-        return tmp;
-    } else if (NULL != current_order->prev && NULL == current_order->next) {
-        // Tail node
-        order *tmp = current_order->prev;
-        tmp->next = NULL;
-        free_order(current_order);
-        return head;
-    } else if (NULL != current_order->prev && NULL != current_order->next) {
-       // Middle node
-       (current_order->next)->prev = current_order->prev;
-       (current_order->prev)->next = current_order->next;
-       free_order(current_order);
-       return head;
-   } else {
-       return NULL;
-   }
+    }
+    new_level->price = price;
+    ladder_link_level(side, new_level);
+
+    return new_level;
 }
 
-// Get the trader's position on the input product
-position *get_position(trader *current_trader, char *product_name) {
-    position *head = current_trader->positions;
+// Remove an empty level from the ladder
+void ladder_remove_level(book_side *side, price_level *level) {
+    price_ladder *ladder = &side->ladder;
+    int slot = level->price - ladder->base_price;
+
+    ladder->slots[slot] = NULL;
+    ladder->bitmap[slot / BITS_PER_WORD] &=
+                    ~((uint64_t) 1 << (slot % BITS_PER_WORD));
+    ladder->num_levels -= 1;
+
+    // Find the next best level
+    if (slot == ladder->best) {
+        ladder->best = (BUY == side->type) ?
+                        ladder_highest_below(ladder, slot) :
+                        ladder_lowest_above(ladder, slot);
+    }
 
-    // Search the positions for the position corresponding to the product
-    while (NULL != head) {
-        if (0 == strcmp(head->product_name, product_name)) {
-            return head;
+    free_level(level);
+
+    // An empty ladder is positioned afresh by the next price, back at its
+    // initial size
+    if (0 == ladder->num_levels) {
+        ladder->base_price = -1;
+        ladder->best = -1;
+        if (ladder->window > LADDER_WINDOW) {
+            price_level **slots = my_calloc(LADDER_WINDOW,
+                                            sizeof(price_level *));
+            uint64_t *bitmap = my_calloc(LADDER_WINDOW / BITS_PER_WORD,
+                                            sizeof(uint64_t));
+            if (NULL == slots || NULL == bitmap) {
+                my_free(slots);
+                my_free(bitmap);
+                return;
+            }
+            my_free(ladder->slots);
+            my_free(ladder->bitmap);
+            ladder->slots = slots;
+            ladder->bitmap = bitmap;
+            ladder->window = LADDER_WINDOW;
         }
-        head = head->next;
     }
-    return NULL;
 }
 
-// Notify the trader that their order has been filled
-void fill_notify_trader(order *current_order, int quantity) {
-    trader *current_trader = current_order->owner;
-    if (!current_trader->is_connected) {
+// Get the next level below the level in price, or NULL
+price_level *ladder_next_level(price_ladder *ladder, price_level *level) {
+    int slot = (NULL == level) ? ladder->window :
+                level->price - ladder->base_price;
+    int next = ladder_highest_below(ladder, slot);
+    return (-1 == next) ? NULL : ladder->slots[next];
+}
+
+// Map a price onto the sort key of the side
+// BUY levels are ascending in price, SELL levels are descending in price
+static int level_key(enum order_type type, int price) {
+    return (BUY == type) ? price : -price;
+}
+
+// Binary search the levels for the price
+// Returns the index of the level, or the index it would be inserted at
+int search_levels(book_side *side, int price, bool *found) {
+    int key = level_key(side->type, price);
+    int low = 0;
+    int high = side->num_levels;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        int mid_key = level_key(side->type, side->levels[mid]->price);
+        if (mid_key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    *found = (low < side->num_levels) && (side->levels[low]->price == price);
+    return low;
+}
+
+// Get the level at the price, or NULL if there are no orders at that price
+price_level *get_level(book_side *side, int price) {
+    if (LADDER_BOOK == side->mode && is_in_window(&side->ladder, price)) {
+        return ladder_get_level(&side->ladder, price);
+    }
+
+    bool found = false;
+    int idx = search_levels(side, price, &found);
+    return found ? side->levels[idx] : NULL;
+}
+
+// Get the level at the price, creating an empty level if it does not exist
+// Returns NULL if the level could not be allocated
+price_level *insert_level(book_side *side, int price) {
+    if (LADDER_BOOK == side->mode && ladder_fit_price(side, price)) {
+        return ladder_insert_level(side, price);
+    }
+
+    bool found = false;
+    int idx = search_levels(side, price, &found);
+    if (found) {
+        return side->levels[idx];
+    }
+
+    // Grow the array of levels
+    if (side->num_levels == side->capacity) {
+        int capacity = (0 == side->capacity) ? INITIAL_LEVEL_CAPACITY
+                                             : 2 * side->capacity;
+        price_level **levels = my_realloc(side->levels,
+                                            capacity * sizeof(price_level *));
+        if (NULL == levels) {
+            return NULL;
+        }
+        side->levels = levels;
+        side->capacity = capacity;
+    }
+
+    price_level *new_level = alloc_level();
+    if (NULL == new_level) {
+        return NULL;
+    }
+    new_level->price = price;
+
+    // Shift the better priced levels up by one
+    memmove(side->levels + idx + 1, side->levels + idx,
+            (side->num_levels - idx) * sizeof(price_level *));
+    side->levels[idx] = new_level;
+    side->num_levels += 1;
+
+    return new_level;
+}
+
+// Remove an empty level from the side
+void remove_level(book_side *side, price_level *level) {
+    if (LADDER_BOOK == side->mode
+        && is_in_window(&side->ladder, level->price)) {
+        ladder_remove_level(side, level);
+        return;
+    }
+
+    bool found = false;
+    int idx = search_levels(side, level->price, &found);
+    if (!found) {
+        #ifdef DEBUG
+            printf("Error in remove_level(): level not found\n");
+        #endif
         return;
     }
 
-    char response[BUFFER_SIZE] = {0};
-    sprintf(response, "FILL %d %d;", current_order->order_id, quantity);
+    memmove(side->levels + idx, side->levels + idx + 1,
+            (side->num_levels - idx - 1) * sizeof(price_level *));
+    side->num_levels -= 1;
+    free_level(level);
+}
 
-    // Write to the trader
-    if (-1 == write(current_trader->e2t_fd_wronly, response, strlen(response))) {
-        printf("Error in fill_notify_trader(): write returned -1, \
-                errno: %s (%d)\n", strerror(errno), errno);
+// Get the level with the best price
+price_level *get_best_level(book_side *side) {
+    price_level *best = (0 == side->num_levels) ? NULL
+                            : side->levels[side->num_levels - 1];
+    if (LADDER_BOOK == side->mode && -1 != side->ladder.best) {
+        price_level *rung = side->ladder.slots[side->ladder.best];
+        if (NULL == best || level_key(side->type, rung->price)
+                                > level_key(side->type, best->price)) {
+            best = rung;
+        }
+    }
+    return best;
+}
+
+// Get the order with the highest price-time priority
+order *get_best_order(book_side *side) {
+    price_level *best_level = get_best_level(side);
+    return (NULL == best_level) ? NULL : best_level->head;
+}
+
+// Refresh the cached best price after a level is added or removed
+void update_best_price(book_side *side) {
+    price_level *best_level = get_best_level(side);
+    side->best_price = (NULL == best_level) ? 0 : best_level->price;
+}
+
+// Get the cached best BUY price of the product, or 0 if there are no BUYs
+int get_best_bid(product_order *product) {
+    return product->buy_side.best_price;
+}
+
+// Get the cached best SELL price of the product, or 0 if there are no SELLs
+int get_best_ask(product_order *product) {
+    return product->sell_side.best_price;
+}
+
+// Get the cached total resting quantity of the side
+int64_t get_depth(book_side *side) {
+    return side->total_quantity;
+}
+
+// Get the BUY or SELL side of the product
+book_side *get_book_side(product_order *product, enum order_type type) {
+    return (BUY == type) ? &product->buy_side : &product->sell_side;
+}
+
+// Inserts new order at the back of the level matching its price
+// Maintains price-time priority
+int insert_order(book_side *side, order *new_order) {
+    if (NULL == side || NULL == new_order) {
+        return -1;
+    }
+
+    // Index the order first, an order in the book can always be found by id
+    if (-1 == index_order(new_order)) {
+        return -1;
+    }
+
+    price_level *level = insert_level(side, new_order->price);
+    if (NULL == level) {
+        unindex_order(new_order);
+        return -1;
+    }
+
+    new_order->level = level;
+    new_order->next = NULL;
+    new_order->prev = level->tail;
+
+    if (NULL == level->tail) {
+        level->head = new_order;
+    } else {
+        level->tail->next = new_order;
+    }
+    level->tail = new_order;
+
+    level->total_quantity += new_order->quantity;
+    level->num_orders += 1;
+    side->total_quantity += new_order->quantity;
+
+    // A new level may be the new best price
+    if (1 == level->num_orders) {
+        update_best_price(side);
+    }
+
+    return 0;
+}
+
+// Reduce the quantity of a resting order (and its level and side) after a fill
+void reduce_order(book_side *side, order *current_order, int quantity) {
+    current_order->quantity -= quantity;
+    current_order->level->total_quantity -= quantity;
+    side->total_quantity -= quantity;
+}
+
+// Unlink the order from its level, removing the level once it is empty
+// The order itself is left allocated and indexed
+void unlink_order(book_side *side, order *current_order) {
+    price_level *level = current_order->level;
+
+    if (NULL == current_order->prev) {
+        level->head = current_order->next;
+    } else {
+        current_order->prev->next = current_order->next;
+    }
+
+    if (NULL == current_order->next) {
+        level->tail = current_order->prev;
+    } else {
+        current_order->next->prev = current_order->prev;
+    }
+
+    level->total_quantity -= current_order->quantity;
+    level->num_orders -= 1;
+    side->total_quantity -= current_order->quantity;
+
+    if (0 == level->num_orders) {
+        remove_level(side, level);
+        update_best_price(side);
+    }
+
+    current_order->level = NULL;
+    current_order->next = NULL;
+    current_order->prev = NULL;
+}
+
+// Delete the order from its level, removing the level once it is empty
+int delete_order(book_side *side, order *current_order) {
+    if (NULL == side || NULL == current_order) {
+        return -1;
+    }
+
+    unlink_order(side, current_order);
+    unindex_order(current_order);
+    free_order(current_order);
+    return 0;
+}
+
+// Amend the order in place
+// The order loses its time priority: it moves to the back of the level at
+// its new price (which may be the same level)
+// Returns 0, or -1 if the order could not be moved (it is left at its old
+// price and quantity)
+int amend_order(book_side *side, order *current_order, int quantity,
+                int price) {
+    if (NULL == side || NULL == current_order || quantity < 0 || price < 0) {
+        #ifdef DEBUG
+            printf("Error in amend_order(): invalid price or quantity\n");
+        #endif
+        return -1;
+    }
+
+    unlink_order(side, current_order);
+
+    int old_quantity = current_order->quantity;
+    int old_price = current_order->price;
+    bool was_amended = current_order->amended;
+    current_order->amended = true;
+    current_order->quantity = quantity;
+    current_order->price = price;
+
+    if (-1 == insert_order(side, current_order)) {
+        // Put the order back at its old price, the level it left is back in
+        // the pool
+        current_order->amended = was_amended;
+        current_order->quantity = old_quantity;
+        current_order->price = old_price;
+        if (-1 == insert_order(side, current_order)) {
+            unindex_order(current_order);
+            free_order(current_order);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Get the trader's position on the input product
+position *get_position(trader *current_trader, int product_id) {
+    if (product_id < 0 || product_id >= positions->num_products) {
+        return NULL;
+    }
+    int row = current_trader->trader_id * positions->num_products;
+    return &positions->cells[row + product_id];
+}
+
+// Add a message for the trader to the staged event
+// Returns 0 on success, -1 on error
+static int stage_message(trader *current_trader, const char *format,
+                            va_list args) {
+    if (staged_event->num_messages == staged_event->messages_capacity) {
+        int capacity = (0 == staged_event->messages_capacity) ?
+                        TRADE_BATCH_CAPACITY
+                        : 2 * staged_event->messages_capacity;
+        direct_message *messages = my_realloc(staged_event->messages,
+                                                capacity
+                                                * sizeof(direct_message));
+        if (NULL == messages) {
+            return -1;
+        }
+        staged_event->messages = messages;
+        staged_event->messages_capacity = capacity;
+    }
+
+    direct_message *message =
+        &staged_event->messages[staged_event->num_messages];
+    message->target = current_trader;
+    int length = vsnprintf(message->text, FANOUT_MESSAGE_SIZE, format, args);
+    if (length < 0 || length >= FANOUT_MESSAGE_SIZE) {
+        return -1;
     }
+    staged_event->num_messages += 1;
+    return 0;
+}
+
+// Queue a message for the trader, it is sent when the event is flushed
+// On the publisher with fan-out workers it goes into the staged event
+// Returns 0 on success, -1 on error
+static int queue_message(trader *current_trader, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int status = (NULL != staged_event) ?
+                    stage_message(current_trader, format, args)
+                    : vappend_frame(&current_trader->output, format, args);
+    va_end(args);
+    return status;
+}
 
+// Notify the trader that their order has been filled
+void fill_notify_trader(trader *current_trader, int order_id, int quantity) {
+    if (!current_trader->is_connected) {
+        return;
+    }
 
-    // Send the trader SIGUSR1
-    if (0 != kill(current_trader->pid, SIGUSR1)) {
-        printf("Error in fill_notify_trader(): kill returned -1, \
+    // Queue the message, it is sent when the event is flushed
+    if (-1 == queue_message(current_trader, "FILL %d %d;", order_id,
+                            quantity)) {
+        printf("Error in fill_notify_trader(): append_frame returned -1, \
                 errno: %s (%d)\n", strerror(errno), errno);
     }
 }
 
 // Notify the traders that their orders have been filled
-void fill_notify_traders(order *buy_order, order *sell_order, int quantity) {
-    fill_notify_trader(buy_order, quantity);
-    nanosleep((const struct timespec[]){{0, TIME_100MS}}, NULL);
-    fill_notify_trader(sell_order, quantity);
+// The BUY order's owner is notified first
+void fill_notify_traders(trade *current_trade) {
+    int quantity = current_trade->quantity;
+    if (BUY == current_trade->new_type) {
+        fill_notify_trader(current_trade->new_owner,
+                            current_trade->new_order_id, quantity);
+        fill_notify_trader(current_trade->resting_owner,
+                            current_trade->resting_order_id, quantity);
+    } else {
+        fill_notify_trader(current_trade->resting_owner,
+                            current_trade->resting_order_id, quantity);
+        fill_notify_trader(current_trade->new_owner,
+                            current_trade->new_order_id, quantity);
+    }
 }
 
 
@@ -632,42 +1715,47 @@ int64_t calculate_value(int64_t quantity, int64_t price) {
 }
 
 // Updates the current trader's position
-void update_trader_position(order *current_order, int64_t final_value,
-                            int64_t final_quantity) {
+void update_trader_position(trader *current_trader, int product_id,
+                            int64_t final_value, int64_t final_quantity) {
 
-    position *current_position = get_position(current_order->owner,
-                                                current_order->product_name);
+    position *current_position = get_position(current_trader, product_id);
     if (NULL == current_position) {
         printf("Error in update_trader_position(): position not found\n");
+        return;
     }
 
     current_position->value += final_value;
     current_position->quantity += final_quantity;
 }
 
-void update_trader_positions(order *matched_order, order *new_order,
-                            int64_t total_value, int64_t fee, int quantity) {
-    if (BUY == new_order->type) {
-        // We are in fill_buy_order()
+// Updates the positions of the owners of both orders of the trade
+// The new order's owner pays the fee
+void update_trader_positions(trade *current_trade, int64_t total_value,
+                                int64_t fee) {
+    int product_id = current_trade->product_id;
+    int quantity = current_trade->quantity;
 
+    if (BUY == current_trade->new_type) {
         // Matched order is the SELL order
         // hence we are PAID to DECREASE our quantity
-        update_trader_position(matched_order, total_value, -1 * quantity);
+        update_trader_position(current_trade->resting_owner, product_id,
+                                total_value, -1 * quantity);
 
         // New order is the BUY order
         // hence we PAY (plus fees) to INCREASE our quantity
-        update_trader_position(new_order, -1 * (total_value + fee), quantity);
+        update_trader_position(current_trade->new_owner, product_id,
+                                -1 * (total_value + fee), quantity);
 
     } else {
-        // We are in fill_sell_order()
-
         // Matched order is the BUY order
         // hence we PAY to INCREASE our quantity
-        update_trader_position(matched_order, -1 * total_value, quantity);
+        update_trader_position(current_trade->resting_owner, product_id,
+                                -1 * total_value, quantity);
 
         // New order is the SELL order
         // hence we are PAID (minus fees) to DECREASE our quantity
-        update_trader_position(new_order, total_value - fee, -1 * quantity);
+        update_trader_position(current_trade->new_owner, product_id,
+                                total_value - fee, -1 * quantity);
 
     }
 }
@@ -675,305 +1763,219 @@ void update_trader_positions(order *matched_order, order *new_order,
 // Removes the current order from the orderbook
 void remove_order_from_orderbook(order *current_order,
                                     product_order **orderbook, int num_products) {
-    product_order *current_product = get_product_from_orderbook(orderbook,
-                                    current_order->product_name, num_products);
+    product_order *current_product = orderbook[current_order->product_id];
 
     if (BUY == current_order->type) {
-        current_product->buy_orders = delete_order(current_order,
-                                                    current_product->buy_orders);
+        delete_order(&current_product->buy_side, current_order);
         current_product->buy_size -= 1;
 
     } else {
-        current_product->sell_orders = delete_order(current_order,
-                                                    current_product->sell_orders);
+        delete_order(&current_product->sell_side, current_order);
         current_product->sell_size -= 1;
     }
 }
 
-// Updates the orderbook when a BUY order results in an order match
-int64_t fill_buy_order(order *buy_order, product_order *product) {
-    order *cursor = product->sell_orders;
-    int64_t total_fee = 0;
-
-    // Travel through the SELL orders of the product
-    // Continue filling orders until either there are no more sell orders
-    // Or the buy order is consumed (ie. quantity = 0)
-    while (NULL != cursor) {
-        if (buy_order->price < cursor->price) {
-            break;
-        } else if (NULL == product->sell_orders) {
-            break;
-        }
-
-        bool consumed_buy_order = false;
-        bool consumed_sell_order = false;
-
-        int tmp_buy_quantity = buy_order->quantity;
-        int tmp_sell_quantity = cursor->quantity;
-
-        if (buy_order->quantity < cursor->quantity) {
-            // Buy order is filled
-            cursor->quantity -= buy_order->quantity;
-            buy_order->quantity = 0;
-            consumed_buy_order = true;
-        } else if (buy_order->quantity > cursor->quantity) {
-            // Sell order is filled
-            buy_order->quantity -= cursor->quantity;
-            cursor->quantity = 0;
-            consumed_sell_order = true;
-        } else {
-            // Orders are equal in quantity -> both are filled
-            buy_order->quantity = 0;
-            cursor->quantity = 0;
-            consumed_buy_order = true;
-            consumed_sell_order = true;
+// Record a fill of the resting order by the new order
+int append_trade(trade_batch *batch, order *resting_order, order *new_order,
+                    int quantity) {
+    // Grow the buffer (only on a sweep deeper than the capacity)
+    if (batch->size == batch->capacity) {
+        int capacity = (0 == batch->capacity) ?
+                        TRADE_BATCH_CAPACITY : 2 * batch->capacity;
+        trade *new_trades = my_realloc(batch->trades, capacity * sizeof(trade));
+        if (NULL == new_trades) {
+            return -1;
         }
+        batch->trades = new_trades;
+        batch->capacity = capacity;
+    }
 
-        order *tmp = cursor;
-        cursor = cursor->next;
-
-        if (consumed_sell_order) {
-            // Calculate the fees
-            int64_t value = calculate_value(tmp_sell_quantity, tmp->price);
-            int64_t fee = calculate_fee(value);
-            total_fee += fee;
-
-            int order_id = tmp->order_id;
-            int trader_id = tmp->owner->trader_id;
-
-            printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%lld, fee: $%lld.\n",
-            LOG_PREFIX, order_id, trader_id,
-            buy_order->order_id, buy_order->owner->trader_id, value, fee);
-
-            update_trader_positions(tmp, buy_order, value, fee, tmp_sell_quantity);
-            fill_notify_traders(buy_order, tmp, tmp_sell_quantity);
+    trade *new_trade = &batch->trades[batch->size];
+    new_trade->new_type = new_order->type;
+    new_trade->product_id = new_order->product_id;
+    new_trade->resting_owner = resting_order->owner;
+    new_trade->resting_order_id = resting_order->order_id;
+    new_trade->new_owner = new_order->owner;
+    new_trade->new_order_id = new_order->order_id;
+    new_trade->quantity = quantity;
+    new_trade->price = resting_order->price;
+
+    batch->size += 1;
+    return 0;
+}
 
-            // Update the orderbook
-            product->sell_orders = delete_order(tmp, product->sell_orders);
-            product->sell_size -= 1;
-        }
+// Free the memory associated with the trade buffer
+void free_trade_batch(trade_batch *batch) {
+    my_free(batch->trades);
+    memset(batch, 0, sizeof(trade_batch));
+}
 
-        if (consumed_buy_order && consumed_sell_order) {
-            product->buy_orders = delete_order(buy_order, product->buy_orders);
-            product->buy_size -= 1;
+// Match the new order against the opposite side of the product
+// Only updates the orderbook, each fill is appended to the batch
+// A fill is recorded before the book changes, matching stops (leaving the
+// rest of the order in the book) if it cannot be
+// Returns the number of trades
+int match_order(order *new_order, product_order *product, trade_batch *batch) {
+    enum order_type opposite_type = (BUY == new_order->type) ? SELL : BUY;
+    book_side *new_side = get_book_side(product, new_order->type);
+    book_side *opposite_side = get_book_side(product, opposite_type);
+    int *new_size = (BUY == new_order->type) ? &product->buy_size :
+                                                &product->sell_size;
+    int *opposite_size = (BUY == new_order->type) ? &product->sell_size :
+                                                    &product->buy_size;
+
+    int num_trades = 0;
+
+    // Continue filling orders until either there are no more crossing orders
+    // or the new order is consumed (ie. quantity = 0)
+    order *resting_order = get_best_order(opposite_side);
+    while (NULL != resting_order) {
+        int buy_price = (BUY == new_order->type) ? new_order->price :
+                                                    resting_order->price;
+        int sell_price = (BUY == new_order->type) ? resting_order->price :
+                                                    new_order->price;
+        if (buy_price < sell_price) {
             break;
         }
 
-        if (consumed_buy_order) {
-            // Calculate the fees
-            int64_t value = calculate_value(tmp_buy_quantity, tmp->price);
-            int64_t fee = calculate_fee(value);
-            total_fee += fee;
+        int quantity = (new_order->quantity < resting_order->quantity) ?
+                        new_order->quantity : resting_order->quantity;
 
-            int order_id = buy_order->order_id;
-            int trader_id = buy_order->owner->trader_id;
-
-            printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%lld, fee: $%lld.\n",
-            LOG_PREFIX, tmp->order_id,
-            tmp->owner->trader_id, order_id, trader_id, value, fee);
-
-            update_trader_positions(tmp, buy_order, value, fee, tmp_buy_quantity);
-            fill_notify_traders(buy_order, tmp, tmp_buy_quantity);
-
-            // Update the orderbook
-            product->buy_orders = delete_order(buy_order, product->buy_orders);
-            product->buy_size -= 1;
+        if (-1 == append_trade(batch, resting_order, new_order, quantity)) {
+            #ifdef DEBUG
+                printf("Error in match_order(): append_trade returned -1\n");
+            #endif
             break;
         }
-    }
-    return total_fee;
-}
+        num_trades += 1;
 
-// Updates the orderbook when a SELL order results in an order match
-int64_t fill_sell_order(order *sell_order, product_order *product) {
-    order *cursor = product->buy_orders;
-    int64_t total_fee = 0;
+        reduce_order(opposite_side, resting_order, quantity);
+        reduce_order(new_side, new_order, quantity);
 
-    // Travel through the BUY orders of the product
-    // Continue filling orders until either there are no more buy orders
-    // Or the sell order is consumed (ie. quantity = 0)
-    while (NULL != cursor) {
-        if (cursor->price < sell_order->price) {
-            break;
-        } else if (NULL == product->buy_orders) {
-            break;
+        if (0 == resting_order->quantity) {
+            delete_order(opposite_side, resting_order);
+            *opposite_size -= 1;
         }
 
-        bool consumed_sell_order = false;
-        bool consumed_buy_order = false;
-
-        int tmp_sell_quantity = sell_order->quantity;
-        int tmp_buy_quantity = cursor->quantity;
-
-        if (sell_order->quantity < cursor->quantity) {
-            // Consume sell order
-            cursor->quantity -= sell_order->quantity;
-            sell_order->quantity = 0;
-            consumed_sell_order = true;
-        } else if (sell_order->quantity > cursor->quantity) {
-            // Consume buy order
-            sell_order->quantity -= cursor->quantity;
-            cursor->quantity = 0;
-            consumed_buy_order = true;
-        } else {
-            // Orders are equal in quantity -> both are filled
-            cursor->quantity = 0;
-            sell_order->quantity = 0;
-            consumed_sell_order = true;
-            consumed_buy_order = true;
+        if (0 == new_order->quantity) {
+            delete_order(new_side, new_order);
+            *new_size -= 1;
+            break;
         }
 
-        order *tmp = cursor;
-        cursor = cursor->next;
-
-        if (consumed_buy_order) {
-            // Calculate the new fee
-            int64_t value = calculate_value(tmp_buy_quantity, tmp->price);
-            int64_t fee = calculate_fee(value);
-            total_fee += fee;
-
-            int order_id = tmp->order_id;
-            int trader_id = tmp->owner->trader_id;
-
-            printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%lld, fee: $%lld.\n",
-            LOG_PREFIX, order_id, trader_id,
-            sell_order->order_id, sell_order->owner->trader_id, value, fee);
-
-            // Update the positions of the owners of both matched orders
-            update_trader_positions(tmp, sell_order, value, fee,
-                                        tmp_buy_quantity);
-            fill_notify_traders(tmp, sell_order, tmp_buy_quantity);
-
-            // Remove the buy order from linked list
-            product->buy_orders = delete_order(tmp, product->buy_orders);
-            product->buy_size -= 1;
-        }
+        resting_order = get_best_order(opposite_side);
+    }
 
-        if (consumed_buy_order && consumed_sell_order) {
-            product->sell_orders = delete_order(sell_order, product->sell_orders);
-            product->sell_size -= 1;
-            break;
-        }
+    return num_trades;
+}
 
-        if (consumed_sell_order) {
-            // Calculate the new fee
-            int64_t value = calculate_value(tmp_sell_quantity, tmp->price);
-            int64_t fee = calculate_fee(value);
-            total_fee += fee;
+// Apply the side effects of the trades: Match log line, positions, fees and
+// FILL messages
+// Returns the total fee collected
+int64_t apply_trades(trade_batch *batch) {
+    int64_t total_fee = 0;
 
-            // Remove sell order from the linked list
-            int order_id = sell_order->order_id;
-            int trader_id = sell_order->owner->trader_id;
+    for (int i = 0; i < batch->size; i++) {
+        trade *current_trade = &batch->trades[i];
 
-            printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%lld, fee: $%lld.\n",
-            LOG_PREFIX, tmp->order_id,
-            tmp->owner->trader_id, order_id, trader_id, value, fee);
+        // Calculate the fees
+        int64_t value = calculate_value(current_trade->quantity,
+                                        current_trade->price);
+        int64_t fee = calculate_fee(value);
+        total_fee += fee;
 
-            // Update the positions of the owners of both matched orders
-            update_trader_positions(tmp, sell_order, value, fee,
-                                    tmp_sell_quantity);
-            fill_notify_traders(tmp, sell_order, tmp_sell_quantity);
+        long long match[] = {current_trade->resting_order_id,
+                                current_trade->resting_owner->trader_id,
+                                current_trade->new_order_id,
+                                current_trade->new_owner->trader_id, value,
+                                fee};
+        log_record(LOG_MATCH, match, 6, NULL, 0);
 
-            // Remove the sell order from linked list
-            product->sell_orders = delete_order(sell_order,
-                                                product->sell_orders);
-            product->sell_size -= 1;
-            break;
-        }
+        update_trader_positions(current_trade, value, fee);
+        fill_notify_traders(current_trade);
     }
+
+    batch->size = 0;
     return total_fee;
 }
 
+// Fill the new order against the orderbook, the fills are left in trades
+// Returns the number of trades
+int fill_order(order *new_order, product_order *product) {
+    return match_order(new_order, product, &trades);
+}
+
 // Returns whether there is a match of orders
 bool is_order_match(product_order *product) {
-    if (NULL == product->buy_orders || NULL == product->sell_orders) {
+    int best_bid = get_best_bid(product);
+    int best_ask = get_best_ask(product);
+    if (0 == best_bid || 0 == best_ask) {
         return false;
     }
-    return product->buy_orders->price >= product->sell_orders->price;
+    return best_bid >= best_ask;
 }
 
 // Processes the commands written by the traders to the exchange
-order *process_command(enum order_state cmd, char buffer[BUFFER_SIZE],
-                        trader *current_trader, product_order **orderbook,
-                        int num_products) {
+// Returns the new or amended order, or the order to cancel (removed from the
+// book when the command is matched), NULL on error
+order *process_command(command *parsed, trader *current_trader,
+                        product_order **orderbook, int num_products) {
+    enum order_state cmd = parsed->cmd;
 
     if (CANCELLED == cmd) {
-        order *tmp_order = my_calloc(1, sizeof(order));
-        char tmp[BUFFER_SIZE] = {0};
-        strcpy(tmp, buffer);
-
-        // Extract tokens from the string
-        strtok(tmp, " ");
-        int order_id = atoi(strtok(NULL, " "));
-
-        tmp_order->order_id = order_id;
-        tmp_order->owner = current_trader;
-        tmp_order->type = CANCEL;
-        return tmp_order;
+        return get_order(current_trader, parsed->order_id);
     }
 
-    order *new_order = NULL;
-
     if (AMENDED == cmd) {
-        char tmp[BUFFER_SIZE] = {0};
-        strcpy(tmp, buffer);
+        int quantity = parsed->quantity;
+        int price = parsed->price;
 
-        // Extract tokens from the string
-        strtok(tmp, " ");
-        int order_id = atoi(strtok(NULL, " "));
-
-        // Get the old order (and hence product name)
-        order *old_order = search_orderbook(current_trader,
-                                            order_id, orderbook, num_products);
+        // Get the existing order and amend it in place
+        order *old_order = get_order(current_trader, parsed->order_id);
         if (NULL == old_order) {
             #ifdef DEBUG
                 printf("Error in process command\n");
             #endif
+            return NULL;
         }
 
-        // Create an amended order
-        new_order = init_amended_order(buffer, current_trader, old_order);
+        product_order *product = orderbook[old_order->product_id];
+        if (-1 == amend_order(get_book_side(product, old_order->type),
+                                old_order, quantity, price)) {
+            return NULL;
+        }
+        return old_order;
+    }
 
-        // Remove the old order from the orderbook
-        remove_order_from_orderbook(old_order, orderbook, num_products);
-    } else {
-        // Assign the fields to an order struct
-        enum order_type type = (ACCEPTED_BUY == cmd) ? BUY : SELL;
-        new_order = init_new_order(cmd, buffer, current_trader, type);
+    // Assign the fields to an order struct
+    enum order_type type = (ACCEPTED_BUY == cmd) ? BUY : SELL;
+    order *new_order = init_order(parsed, current_trader, type);
+    if (NULL == new_order) {
+        return NULL;
     }
 
     // Find which product is associated with the order
-    product_order *product = get_product_from_orderbook(orderbook,
-                                                        new_order->product_name,
-                                                        num_products);
-    if (NULL == product) {
+    if (new_order->product_id < 0 || new_order->product_id >= num_products) {
         #ifdef DEBUG
             printf("Error in process_buy(): product does not exist\n");
         #endif
         free_order(new_order);
         return NULL;
     }
+    product_order *product = orderbook[new_order->product_id];
 
-    // Insert the new order into the corresponding linked list
-    order *new_head = NULL;
-    if (BUY == new_order->type) {
-        new_head = insert_order(product->buy_orders, new_order, BUY);
-    } else {
-        new_head = insert_order(product->sell_orders, new_order, SELL);
-    }
-
-    if (NULL == new_head) {
+    // Insert the new order into the corresponding price level
+    if (-1 == insert_order(get_book_side(product, new_order->type), new_order)) {
         #ifdef DEBUG
-            printf("Error: insert_order returned NULL\n");
+            printf("Error: insert_order returned -1\n");
         #endif
+        free_order(new_order);
+        return NULL;
     }
 
-    // Update the linked list head pointers
     if (BUY == new_order->type) {
-        product->buy_orders = new_head;
         product->buy_size++;
     } else {
-        product->sell_orders = new_head;
         product->sell_size++;
     }
 
@@ -981,99 +1983,79 @@ order *process_command(enum order_state cmd, char buffer[BUFFER_SIZE],
 }
 
 // Process an AMEND command
-int64_t process_amend(char buffer[BUFFER_SIZE], trader *current_trader,
-                        product_order **orderbook, int num_products) {
-    char tmp[BUFFER_SIZE] = {0};
-    strcpy(tmp, buffer);
-
-    strtok(tmp, " ");
-    int order_id = atoi(strtok(NULL, " "));
-
+// Returns the number of trades
+int process_amend(command *parsed, trader *current_trader,
+                    product_order **orderbook, int num_products) {
     // Find the order that corresponds to the order id
-    order *tmp_order = search_orderbook(current_trader, order_id,
-                                        orderbook, num_products);
+    order *tmp_order = get_order(current_trader, parsed->order_id);
+    if (NULL == tmp_order) {
+        #ifdef DEBUG
+            printf("Error in process_amend(): tmp_order is NULL\n");
+        #endif
+        return 0;
+    }
     // Get the corresponding product name
-    product_order *product = get_product_from_orderbook(orderbook,
-                                                        tmp_order->product_name,
-                                                        num_products);
+    product_order *product = orderbook[tmp_order->product_id];
 
-    int64_t fee = 0;
+    int num_trades = 0;
     // Check if there is an order match as a result of the amended order
     if (is_order_match(product)) {
         // If there is an order match, fill the orders
-        if (BUY == tmp_order->type) {
-            fee = fill_buy_order(product->buy_orders, product);
-        } else {
-            fee = fill_sell_order(product->sell_orders, product);
-        }
+        num_trades = fill_order(tmp_order, product);
     }
 
-    return fee;
+    return num_trades;
 }
 
 // Processes the SELL command
-int64_t process_sell(char buffer[BUFFER_SIZE],
-                        trader *current_trader, product_order **orderbook,
-                        int num_products) {
+// Returns the number of trades
+int process_sell(command *parsed, trader *current_trader,
+                    product_order **orderbook, int num_products) {
 
     // Get the corresponding product from the orderbook
-    order *tmp_order = init_new_order(ACCEPTED_SELL, buffer,
-                                        current_trader, SELL);
-    product_order *product = get_product_from_orderbook(orderbook,
-                                                        tmp_order->product_name,
-                                                        num_products);
+    product_order *product = orderbook[parsed->product_id];
 
-    order *sell_order = product->sell_orders;
-    int64_t fee = 0;
+    order *sell_order = get_best_order(&product->sell_side);
+    int num_trades = 0;
 
     // Check if there is an order match
     if (is_order_match(product)) {
         // Fill the orders
-        fee = fill_sell_order(sell_order, product);
+        num_trades = fill_order(sell_order, product);
     }
-    free_order(tmp_order);
-    return fee;
+    return num_trades;
 }
 
 // Processes the BUY command
-int64_t process_buy(char buffer[BUFFER_SIZE], trader *current_trader,
-                    product_order **orderbook, int num_products) {
+// Returns the number of trades
+int process_buy(command *parsed, trader *current_trader,
+                product_order **orderbook, int num_products) {
 
     // Get the corresponding product from the orderbook
-    order *tmp_order = init_new_order(ACCEPTED_BUY, buffer, current_trader, BUY);
-    product_order *product = get_product_from_orderbook(orderbook,
-                                                        tmp_order->product_name,
-                                                        num_products);
+    product_order *product = orderbook[parsed->product_id];
 
-    order *buy_order = product->buy_orders;
-    int64_t fee = 0;
+    order *buy_order = get_best_order(&product->buy_side);
+    int num_trades = 0;
 
     // Check if there is an order match
     if (is_order_match(product)) {
         // Fill the orders
-        fee = fill_buy_order(buy_order, product);
+        num_trades = fill_order(buy_order, product);
     }
 
-    free_order(tmp_order);
-    return fee;
+    return num_trades;
 }
 
 // Process the CANCEL command
-int process_cancel(char buffer[BUFFER_SIZE], trader *current_trader,
+int process_cancel(command *parsed, trader *current_trader,
                     product_order **orderbook, int num_products) {
-    char tmp[BUFFER_SIZE] = {0};
-    strcpy(tmp, buffer);
-
-    strtok(tmp, " ");
-    int order_id = atoi(strtok(NULL, " "));
-
     // Get the order matching with the order id
-    order *current_order = search_orderbook(current_trader, order_id,
-                                            orderbook, num_products);
+    order *current_order = get_order(current_trader, parsed->order_id);
     if (NULL == current_order) {
         #ifdef DEBUG
             printf("Error in process cancel(): current_order is NULL\n");
         #endif
+        return -1;
     }
 
     // Remove the order from the orderbook
@@ -1081,395 +2063,278 @@ int process_cancel(char buffer[BUFFER_SIZE], trader *current_trader,
     return 0;
 }
 
-// Check that the command name is valid
-bool is_valid_command_name(char buffer[BUFFER_SIZE]) {
-    bool amend = (0 == strncmp("AMEND ", buffer, 6));
-    bool cancel = (0 == strncmp("CANCEL ", buffer, 7));
-    bool buy = (0 == strncmp("BUY ", buffer, 4));
-    bool sell = (0 == strncmp("SELL ", buffer, 5));
-
-    return (amend || cancel || buy || sell);
-}
-
-// Check that the product exists
-bool is_valid_product(char buffer[BUFFER_SIZE], product_order **orderbook,
-                        int num_products) {
-
-    bool amend = (0 == strncmp("AMEND ", buffer, STRLEN_AMEND + 1));
-    bool cancel = (0 == strncmp("CANCEL ", buffer, STRLEN_CANCEL + 1));
-    if (amend || cancel) {
-        return true;
+// Parse a value of the command: one or more digits
+// Values above MAX_VALUE are kept as MAX_VALUE + 1 so they fail validation
+// Returns the position after the digits, or NULL if there are none
+static char *parse_value(char *cursor, int *value) {
+    if (!isdigit(*cursor)) {
+        return NULL;
     }
 
-    char tmp[BUFFER_SIZE] = {0};
-    strcpy(tmp, buffer);
-
-    strtok(tmp, " ");
-    strtok(NULL, " ");
-    char *product_name = strtok(NULL, " ");
-
-    // Search the orderbook for a match on the order product name
-    for (int i = 0; i < num_products; i++) {
-        if (0 == strcmp(product_name, orderbook[i]->product_name)) {
-            return true;
+    *value = 0;
+    while (isdigit(*cursor)) {
+        if (*value <= MAX_VALUE) {
+            *value = *value * 10 + (*cursor - '0');
         }
+        cursor++;
     }
-    return false;
-}
-
-// Check that the order id is valid
-bool is_valid_order_id(char buffer[BUFFER_SIZE], trader *current_trader) {
-    bool cancel = (0 == strncmp("CANCEL ", buffer, STRLEN_CANCEL + 1));
-    bool amend = (0 == strncmp("AMEND ", buffer, STRLEN_AMEND + 1));
-    if (cancel || amend) {
-        return true;
-    }
-
-    char tmp[BUFFER_SIZE] = {0};
-    strcpy(tmp, buffer);
-
-    strtok(tmp, " ");
-    int order_id = atoi(strtok(NULL, " "));
-
-    if (order_id > 999999) {
-        return false;
+    if (*value > MAX_VALUE) {
+        *value = MAX_VALUE + 1;
     }
-
-    return (current_trader->current_order_id == order_id);
+    return cursor;
 }
 
-// Check that the order referred to in AMEND/CANCEL exists
-bool is_valid_order(char buffer[BUFFER_SIZE], trader *current_trader,
-                    product_order **orderbook, int num_products) {
-    bool buy = (0 == strncmp("BUY ", buffer, STRLEN_BUY + 1));
-    bool sell = (0 == strncmp("SELL ", buffer, STRLEN_SELL + 1));
-    if (buy || sell) {
-        return true;
-    }
-
-    char tmp[BUFFER_SIZE] = {0};
-    strcpy(tmp, buffer);
-
-    strtok(tmp, " ");
-    int order_id = atoi(strtok(NULL, " "));
-
-    order *current_order = search_orderbook(current_trader, order_id,
-                                            orderbook, num_products);
-
-    if (NULL == current_order) {
-        return false;
+// Parse a text command (eg. "BUY 0 GPU 10 200;") in one pass over the buffer
+// The fields are separated by single spaces: digits for the values and
+// alphanumerics for the product (looked up in the symbol table, -1 if it is
+// not traded). Validation of the values is left to is_valid_decoded_command
+// Returns 1 if the command ends with ';', 0 if it ends at the end of the
+// string, -1 if the syntax is invalid (parsed->cmd is then INVALID)
+int parse_text_command(char buffer[BUFFER_SIZE], command *parsed) {
+    memset(parsed, 0, sizeof(command));
+    parsed->cmd = INVALID;
+    parsed->product_id = -1;
+
+    enum order_state cmd = INVALID;
+    char *cursor = buffer;
+    if (0 == strncmp("AMEND ", cursor, STRLEN_AMEND + 1)) {
+        cmd = AMENDED;
+        cursor += STRLEN_AMEND + 1;
+    } else if (0 == strncmp("CANCEL ", cursor, STRLEN_CANCEL + 1)) {
+        cmd = CANCELLED;
+        cursor += STRLEN_CANCEL + 1;
+    } else if (0 == strncmp("BUY ", cursor, STRLEN_BUY + 1)) {
+        cmd = ACCEPTED_BUY;
+        cursor += STRLEN_BUY + 1;
+    } else if (0 == strncmp("SELL ", cursor, STRLEN_SELL + 1)) {
+        cmd = ACCEPTED_SELL;
+        cursor += STRLEN_SELL + 1;
     } else {
-        return true;
+        return -1;
     }
-}
-
-// Check that the value in the order is valid ie. [1, 999999]
-bool is_valid_value(char buffer[BUFFER_SIZE]) {
-    bool cancel = (0 == strncmp("CANCEL ", buffer, STRLEN_CANCEL + 1));
-    bool amend = (0 == strncmp("AMEND ", buffer, STRLEN_AMEND + 1));
 
-    char tmp[BUFFER_SIZE] = {0};
-    strcpy(tmp, buffer);
+    cursor = parse_value(cursor, &parsed->order_id);
+    if (NULL == cursor) {
+        return -1;
+    }
 
-    int quantity = 0;
-    int price = 0;
+    if (ACCEPTED_BUY == cmd || ACCEPTED_SELL == cmd) {
+        if (' ' != *cursor) {
+            return -1;
+        }
+        char *product_name = ++cursor;
+        while (isalnum(*cursor)) {
+            cursor++;
+        }
+        if (product_name == cursor || ' ' != *cursor) {
+            return -1;
+        }
 
-    // Extract tokens from the string
-    if (cancel) {
-        return true;
-    } else if (amend) {
-        strtok(tmp, " ");
-        atoi(strtok(NULL, " "));
-        quantity = atoi(strtok(NULL, " "));
-        price = atoi(strtok(NULL, " "));
-    } else {
-        strtok(tmp, " ");
-        atoi(strtok(NULL, " "));
-        strtok(NULL, " ");
-        quantity = atoi(strtok(NULL, " "));
-        price = atoi(strtok(NULL, " "));
+        // Terminate the name in place for the lookup
+        *cursor = '\0';
+        parsed->product_id = get_product_id(product_name);
+        *cursor = ' ';
     }
 
-    // Check that the quantity and price are valid
-    if (quantity <= 0 || price <= 0) {
-        return false;
-    }  else if (quantity > 999999 || price > 999999) {
-        return false;
-    } else {
-        return true;
+    if (CANCELLED != cmd) {
+        if (' ' != *cursor) {
+            return -1;
+        }
+        cursor = parse_value(cursor + 1, &parsed->quantity);
+        if (NULL == cursor || ' ' != *cursor) {
+            return -1;
+        }
+        cursor = parse_value(cursor + 1, &parsed->price);
+        if (NULL == cursor) {
+            return -1;
+        }
     }
-}
 
-// Check the product name is alphanumeric
-int check_product_name(char *buffer, enum order_state cmd) {
-    int i = 0;
-    while (isalnum(buffer[i])) {
-        i++;
+    int is_delimited = 0;
+    if (';' == *cursor) {
+        is_delimited = 1;
+        cursor++;
     }
-
-    if (' ' == buffer[i]) {
-        return i+1;
-    } else {
+    if ('\0' != *cursor) {
         return -1;
     }
-}
 
-// Check the price is a numeric
-int check_price(char *buffer, enum order_state cmd) {
-    int i = 0;
-    while (isdigit(buffer[i])) {
-        i++;
-    }
+    parsed->cmd = cmd;
+    return is_delimited;
+}
 
-    if (';' == buffer[i]) {
-        return i+1;
-    } else {
-        return -1;
-    }
+// Log the command the trader sent, len bytes of text
+void log_parsing(trader *current_trader, const char *text, int len) {
+    long long trader_id = current_trader->trader_id;
+    log_record(LOG_PARSING, &trader_id, 1, text, len);
 }
 
-// Check the quantity is a numeric
-int check_quantity(char *buffer, enum order_state cmd) {
-    int i = 0;
-    while (isdigit(buffer[i])) {
-        i++;
-    }
+// Get the command from the buffer, logging it
+// The command is parsed into parsed, and validated
+// Returns the command type, or INVALID
+enum order_state get_command(char buffer[BUFFER_SIZE], command *parsed,
+                                trader *current_trader,
+                                product_order **orderbook, int num_products) {
+    // Logged up to the ';'
+    log_parsing(current_trader, buffer, strcspn(buffer, ";"));
 
-    if (' ' == buffer[i]) {
-        return i+1;
-    } else {
-        return -1;
+    if (1 != parse_text_command(buffer, parsed)
+        || !is_valid_decoded_command(parsed, current_trader, num_products)) {
+        parsed->cmd = INVALID;
     }
+    return parsed->cmd;
 }
 
-// Check the order id numeric
-int check_order_id(char *buffer, enum order_state cmd) {
-    int i = 0;
-    while (isdigit(buffer[i])) {
-        i++;
+// Decode the binary_command at the start of buffer, its type is mapped to
+// the matching order_state
+// Unknown types decode to INVALID
+void decode_binary_command(const char *buffer, command *parsed) {
+    binary_command message;
+    memcpy(&message, buffer, sizeof(binary_command));
+
+    memset(parsed, 0, sizeof(command));
+    parsed->order_id = message.order_id;
+    parsed->product_id = -1;
+    parsed->quantity = message.quantity;
+    parsed->price = message.price;
+
+    // Out of range values fail validation rather than wrapping around
+    if (message.order_id > MAX_VALUE || message.quantity > MAX_VALUE
+        || message.price > MAX_VALUE) {
+        parsed->cmd = INVALID;
+        return;
     }
 
-    if (CANCELLED == cmd && ';' == buffer[i]) {
-        return i+1;
-    } else if (CANCELLED != cmd && ' ' == buffer[i]) {
-        return i+1;
+    if (BUY == message.type) {
+        parsed->cmd = ACCEPTED_BUY;
+    } else if (SELL == message.type) {
+        parsed->cmd = ACCEPTED_SELL;
+    } else if (AMEND == message.type) {
+        parsed->cmd = AMENDED;
+    } else if (CANCEL == message.type) {
+        parsed->cmd = CANCELLED;
+        parsed->quantity = 0;
+        parsed->price = 0;
     } else {
-        return -1;
+        parsed->cmd = INVALID;
     }
-}
-
-// Check the command syntax is valid
-bool is_valid_command_format(char buffer[BUFFER_SIZE]) {
-    bool amend = (0 == strncmp("AMEND ", buffer, STRLEN_AMEND + 1));
-    bool cancel = (0 == strncmp("CANCEL ", buffer, STRLEN_CANCEL + 1));
-    bool buy = (0 == strncmp("BUY ", buffer, STRLEN_BUY + 1));
-    bool sell = (0 == strncmp("SELL ", buffer, STRLEN_SELL + 1));
-
-    int offset = 0;
-    int result = 0;
-    if (amend) {
-        offset = STRLEN_AMEND + 1;
-        result = check_order_id(buffer + offset, AMENDED);
-        if (result <= 0) {
-            return false;
-        } else {
-            offset += result;
-        }
-
-        result = check_quantity(buffer + offset, AMENDED);
-        if (result <= 0) {
-            return false;
-        } else {
-            offset += result;
-        }
-
-        result = check_price(buffer + offset, AMENDED);
-        if (result <= 0) {
-            return false;
-        } else {
-            offset += result;
-        }
-
-    } else if (cancel) {
-        offset = STRLEN_CANCEL + 1;
-        result = check_order_id(buffer + offset, CANCELLED);
-        if (result <= 0) {
-            return false;
-        } else {
-            offset += result;
-        }
 
-    } else if (buy) {
-        offset = STRLEN_BUY + 1;
-        result = check_order_id(buffer + offset, ACCEPTED_BUY);
-        if (result <= 0) {
-            return false;
-        } else {
-            offset += result;
-        }
+    if (ACCEPTED_BUY == parsed->cmd || ACCEPTED_SELL == parsed->cmd) {
+        parsed->product_id = message.product_id;
+    }
+}
 
-        result = check_product_name(buffer + offset, ACCEPTED_BUY);
-        if (result <= 0) {
-            return false;
-        } else {
-            offset += result;
-        }
+// Check the values of a decoded command
+// The product must be traded, BUY/SELL must use the trader's next order id,
+// AMEND/CANCEL must refer to a live order, values are in [1, 999999]
+bool is_valid_decoded_command(command *parsed, trader *current_trader,
+                                int num_products) {
+    if (INVALID == parsed->cmd) {
+        return false;
+    }
 
-        result = check_quantity(buffer + offset, ACCEPTED_BUY);
-        if (result <= 0) {
+    // The order referred to by AMEND/CANCEL must exist
+    if (AMENDED == parsed->cmd || CANCELLED == parsed->cmd) {
+        if (NULL == get_order(current_trader, parsed->order_id)) {
             return false;
-        } else {
-            offset += result;
         }
-
-        result = check_price(buffer + offset, ACCEPTED_BUY);
-        if (result <= 0) {
-            return false;
-        } else {
-            offset += result;
+        if (CANCELLED == parsed->cmd) {
+            return true;
         }
-    } else if (sell) {
-        offset = STRLEN_SELL + 1;
-        result = check_order_id(buffer + offset, ACCEPTED_SELL);
-        if (result <= 0) {
+    } else {
+        // BUY/SELL must use the next order id on a traded product
+        if (parsed->product_id < 0 || parsed->product_id >= num_products) {
             return false;
-        } else {
-            offset += result;
         }
-
-        result = check_product_name(buffer + offset, ACCEPTED_SELL);
-        if (result <= 0) {
+        if (parsed->order_id > MAX_VALUE
+            || current_trader->current_order_id != parsed->order_id) {
             return false;
-        } else {
-            offset += result;
         }
+    }
 
-        result = check_quantity(buffer + offset, ACCEPTED_SELL);
-        if (result <= 0) {
-            return false;
-        } else {
-            offset += result;
-        }
+    return (parsed->quantity > 0 && parsed->quantity <= MAX_VALUE
+            && parsed->price > 0 && parsed->price <= MAX_VALUE);
+}
 
-        result = check_price(buffer + offset, ACCEPTED_SELL);
-        if (result <= 0) {
-            return false;
+// Write the command the way it is written in the text protocol, without ';'
+// Used to log binary commands, an unknown product is written as its id
+void format_command(command *parsed, char buffer[BUFFER_SIZE]) {
+    if (CANCELLED == parsed->cmd) {
+        sprintf(buffer, "CANCEL %d", parsed->order_id);
+    } else if (AMENDED == parsed->cmd) {
+        sprintf(buffer, "AMEND %d %d %d", parsed->order_id, parsed->quantity,
+                parsed->price);
+    } else if (ACCEPTED_BUY == parsed->cmd || ACCEPTED_SELL == parsed->cmd) {
+        char *name = get_product_name(parsed->product_id);
+        char *type = (ACCEPTED_BUY == parsed->cmd) ? "BUY" : "SELL";
+        if (NULL != name) {
+            sprintf(buffer, "%s %d %s %d %d", type, parsed->order_id, name,
+                    parsed->quantity, parsed->price);
         } else {
-            offset += result;
+            sprintf(buffer, "%s %d #%d %d %d", type, parsed->order_id,
+                    parsed->product_id, parsed->quantity, parsed->price);
         }
-
     } else {
-        return false;
+        sprintf(buffer, "INVALID");
     }
-
-    return true;
 }
 
-bool is_semicolon_delimitted(char buffer[BUFFER_SIZE]) {
-    return (';' == buffer[strlen(buffer)-1]);
-}
+// Switch the trader's commands to binary_command messages
+// Replies with the product ids to use in them
+// Returns 0 on success, -1 if the reply could not be queued
+int negotiate_binary(trader *current_trader, int num_products) {
+    current_trader->input.width = sizeof(binary_command);
 
-bool is_valid_command(char buffer[BUFFER_SIZE], trader *current_trader,
-                        product_order **orderbook, int num_products) {
-    if (!is_semicolon_delimitted(buffer)) {
-        // Command is not ";" delimitted
-        return false;
-    } else if (!is_valid_command_name(buffer)) {
-        // Invalid command name
-        return false;
-    } else if (!is_valid_command_format(buffer)) {
-        // Invalid command format
-        return false;
-    } else if (!is_valid_value(buffer)) {
-        // Invalid value (order id, quantity, price)
-        return false;
-    } else if (!is_valid_product(buffer, orderbook, num_products)) {
-        // Product does not exist
-        return false;
-    } else if (!is_valid_order_id(buffer, current_trader)) {
-        // Invalid order id
-        return false;
-    } else if (!is_valid_order(buffer, current_trader, orderbook, num_products)) {
-        // Order does not exist (cannot amend or cancel)
-        return false;
+    if (-1 == append_frame(&current_trader->output, "PROTOCOL BINARY %d;",
+                            num_products)) {
+        return -1;
     }
-    return true;
-}
-
-void replace_semicolon_with_null(char buffer[BUFFER_SIZE]) {
-    int i = 0;
-    while ('\0' != buffer[i]) {
-        if (';' == buffer[i]) {
-            buffer[i] = '\0';
+    for (int i = 0; i < num_products; i++) {
+        if (-1 == append_frame(&current_trader->output, "PRODUCT %d %s;", i,
+                                get_product_name(i))) {
+            return -1;
         }
-        i++;
-    }
-}
-
-// Get the command from the buffer and return a corresponding enum
-enum order_state get_command(char buffer[BUFFER_SIZE], trader *current_trader,
-                                product_order **orderbook, int num_products) {
-    char tmp[BUFFER_SIZE] = {0};
-    strcpy(tmp, buffer);
-    bool is_invalid = false;
-    if (!is_valid_command(tmp, current_trader, orderbook, num_products)) {
-        is_invalid = true;
-    }
-
-    buffer[strlen(buffer)-1] = '\0';
-    replace_semicolon_with_null(buffer);
-
-    printf("%s [T%d] Parsing command: <%s>\n", LOG_PREFIX,
-            current_trader->trader_id, buffer);
-
-    if (is_invalid) {
-        return INVALID;
-    }
-
-    if (0 == strncmp("AMEND", buffer, STRLEN_AMEND)) {
-        return AMENDED;
-    } else if (0 == (strncmp("CANCEL", buffer, STRLEN_CANCEL))) {
-        return CANCELLED;
-    } else if (0 == strncmp("BUY", buffer, STRLEN_BUY)) {
-        return ACCEPTED_BUY;
-    } else if (0 == strncmp("SELL", buffer, STRLEN_SELL)) {
-        return ACCEPTED_SELL;
-    } else {
-        return INVALID;
     }
+    return 0;
 }
 
-// Check whether there is an order match
-int64_t check_order_match(enum order_state cmd, char buffer[BUFFER_SIZE],
-                            trader *current_trader, product_order **orderbook,
-                            int num_products) {
+// Match the order of the (processed) command against its book
+// Only updates the orderbook, the fills are left in trades
+// Returns the number of trades
+int match_command(command *parsed, trader *current_trader,
+                    product_order **orderbook, int num_products) {
+    enum order_state cmd = parsed->cmd;
 
-    // Update the order id counter if the BUY/SELL order is valid
     if (AMENDED == cmd) {
-        int64_t fee = process_amend(buffer, current_trader,
-                                    orderbook, num_products);
-        return fee;
+        return process_amend(parsed, current_trader, orderbook, num_products);
     } else if (CANCELLED == cmd) {
-        process_cancel(buffer, current_trader, orderbook, num_products);
+        process_cancel(parsed, current_trader, orderbook, num_products);
         return 0;
     } else if (ACCEPTED_BUY == cmd) {
-        int64_t fee = process_buy(buffer, current_trader, orderbook,
-                                    num_products);
-        current_trader->current_order_id += 1;
-        return fee;
+        return process_buy(parsed, current_trader, orderbook, num_products);
     } else if (ACCEPTED_SELL == cmd) {
-        int64_t fee = process_sell(buffer, current_trader, orderbook,
-                                    num_products);
-        current_trader->current_order_id += 1;
-        return fee;
+        return process_sell(parsed, current_trader, orderbook, num_products);
     } else {
         #ifdef DEBUG
-            printf("Error in check_order_match\n");
+            printf("Error in match_command\n");
         #endif
         return 0;
     }
 }
 
+// Check whether there is an order match
+// Returns the fees of the fills
+int64_t check_order_match(command *parsed, trader *current_trader,
+                            product_order **orderbook, int num_products) {
+    match_command(parsed, current_trader, orderbook, num_products);
+
+    // Update the order id counter if the BUY/SELL order is valid
+    if (ACCEPTED_BUY == parsed->cmd || ACCEPTED_SELL == parsed->cmd) {
+        current_trader->current_order_id += 1;
+    }
+    return apply_trades(&trades);
+}
+
 // Respond to the trader with the appropriate message
 void respond_to_trader(int order_id, trader *current_trader,
                         enum order_state cmd) {
@@ -1481,15 +2346,15 @@ void respond_to_trader(int order_id, trader *current_trader,
         return;
     }
 
-    char response[BUFFER_SIZE] = {0};
+    char *response = NULL;
     if (ACCEPTED_BUY == cmd) {
-        sprintf(response, "ACCEPTED %d;", order_id);
+        response = "ACCEPTED";
     } else if (ACCEPTED_SELL == cmd) {
-        sprintf(response, "ACCEPTED %d;", order_id);
+        response = "ACCEPTED";
     } else if (AMENDED == cmd) {
-        sprintf(response, "AMENDED %d;", order_id);
+        response = "AMENDED";
     } else if (CANCELLED == cmd) {
-        sprintf(response, "CANCELLED %d;", order_id);
+        response = "CANCELLED";
     } else {
         #ifdef DEBUG
             printf("Error in respond_to_trader(): incorrect cmd enum\n");
@@ -1497,72 +2362,146 @@ void respond_to_trader(int order_id, trader *current_trader,
         return;
     }
 
-    // Write response
-    if (-1 == write(current_trader->e2t_fd_wronly, response, strlen(response))) {
+    // Queue the response, it is sent when the event is flushed
+    if (-1 == queue_message(current_trader, "%s %d;", response, order_id)) {
         #ifdef DEBUG
-            printf("Error: write returned -1, errno: %s (%d)\n",
+            printf("Error: append_frame returned -1, errno: %s (%d)\n",
                     strerror(errno), errno);
         #endif
     }
+}
 
-    // Send SIGUSR1
-    if (0 != kill(current_trader->pid, SIGUSR1)) {
-        #ifdef DEBUG
-            printf("Error: kill returned -1, errno: %s (%d)\n",
-                    strerror(errno), errno);
-        #endif
+#ifdef IO_URING
+// Queue a writev for every trader with messages and submit them in one
+// io_uring_enter, then reap their completions
+// Read completions reaped on the way are kept for the event loop
+static void submit_outbound(uring_loop *loop, trader **traders,
+                            int num_traders) {
+    int num_writes = 0;
+    for (int i = 0; i < num_traders; i++) {
+        trader *current_trader = traders[i];
+        if (!current_trader->is_connected || NULL != current_trader->channel
+            || !has_frames(&current_trader->output)
+            || has_backlog(&current_trader->output)
+            || current_trader->backlog.is_overflowed) {
+            continue;
+        }
+
+        // Traders left out of the batch are written by write_outbound
+        // A trader with a backlog has its messages queued behind it
+        if (NULL == prep_writev(&loop->ring, current_trader->e2t_fd_wronly,
+                                current_trader->output.segments,
+                                current_trader->output.num_segments,
+                                URING_WRITE_FLAG | i)) {
+            break;
+        }
+        num_writes++;
+    }
+
+    if (0 == num_writes || -1 == submit_uring(&loop->ring, num_writes)) {
+        return;
+    }
+
+    int num_done = 0;
+    while (num_done < num_writes) {
+        struct io_uring_cqe *cqe = peek_cqe(&loop->ring);
+        if (NULL == cqe) {
+            if (-1 == submit_uring(&loop->ring, 1)) {
+                return;
+            }
+            continue;
+        }
+
+        if (URING_SIGNAL_DATA != cqe->user_data
+            && (cqe->user_data & URING_WRITE_FLAG)) {
+            uring_slot *slot = &loop->slots[cqe->user_data & ~URING_WRITE_FLAG];
+            slot->num_written = cqe->res;
+            slot->is_written = true;
+            num_done++;
+        } else {
+            loop->deferred[loop->num_deferred++] = *cqe;
+        }
+        cqe_seen(&loop->ring);
     }
 }
 
-// Notify all the traders of MARKET events
-void notify_all_traders(enum order_state cmd, order *new_order,
-                        trader *skip_trader, trader **traders,
-                        product_order **orderbook, int num_products,
-                         int num_traders) {
+// Wait for room in the pipe of a trader with a backlog
+static void poll_backlog(uring_loop *loop, trader *current_trader) {
+    uring_slot *slot = &loop->slots[current_trader->trader_id];
+    if (slot->is_polling || !current_trader->is_connected
+        || !has_backlog(&current_trader->output)) {
+        return;
+    }
 
-    char response[BUFFER_SIZE] = "";
-    if (ACCEPTED_BUY == cmd) {
-        sprintf(response, "MARKET BUY %s %d %d;", new_order->product_name,
-                new_order->quantity, new_order->price);
-    } else if (ACCEPTED_SELL == cmd) {
-        sprintf(response, "MARKET SELL %s %d %d;", new_order->product_name,
-                new_order->quantity, new_order->price);
-    } else if (CANCELLED == cmd) {
-        order *old_order = search_orderbook(new_order->owner,
-                                            new_order->order_id, orderbook,
-                                            num_products);
-        sprintf(response, "MARKET %s %s 0 0;",
-                (BUY == old_order->type) ? "BUY" : "SELL",
-                old_order->product_name);
-    } else if (AMENDED == cmd) {
-        sprintf(response, "MARKET %s %s %d %d;",
-                (BUY == new_order->type) ? "BUY" : "SELL",
-                new_order->product_name, new_order->quantity, new_order->price);
+    struct pollfd backlog_fd = get_backlog_pollfd(current_trader);
+    if (NULL != prep_poll(&loop->ring, backlog_fd.fd, backlog_fd.events,
+                            URING_POLL_FLAG | current_trader->trader_id)) {
+        slot->is_polling = true;
     }
+}
+#endif
+
+// Write the trader's queued messages
+// With io_uring the event's writes have already gone out as one batch, only
+// the rest of a partial write is written here
+static int write_outbound(trader *current_trader) {
+    #ifdef IO_URING
+        uring_slot *slot = (NULL != uring_state) ?
+                            &uring_state->slots[current_trader->trader_id] : NULL;
+        if (NULL != slot && slot->is_written) {
+            slot->is_written = false;
+            ssize_t num_written = slot->num_written;
+            if (-EAGAIN == num_written) {
+                num_written = 0;
+            } else if (num_written < 0) {
+                discard_frames(&current_trader->output);
+                return -1;
+            }
+            int status = complete_frames(&current_trader->output, num_written);
+            poll_backlog(uring_state, current_trader);
+            return status;
+        }
+    #endif
 
-    // Write to all the traders (excluding the trader that made the order)
-    for (int i = 0; i < num_traders; i++) {
-        trader *current_trader = traders[i];
-        if (current_trader->trader_id == skip_trader->trader_id) {
+    int status = flush_frames(&current_trader->output);
+    #ifdef IO_URING
+        if (NULL != uring_state) {
+            poll_backlog(uring_state, current_trader);
+        }
+    #endif
+    return status;
+}
+
+// Write each trader's queued messages with one writev, then wake it once
+// first_trader (the trader that sent the command) is flushed first
+int flush_outbound(trader *first_trader, trader **traders, int num_traders) {
+    // The fan-out workers write the staged event
+    if (NULL != staged_event) {
+        return publish_event();
+    }
+
+    #ifdef IO_URING
+        if (NULL != uring_state) {
+            submit_outbound(uring_state, traders, num_traders);
+        }
+    #endif
+
+    int status = 0;
+    for (int i = -1; i < num_traders; i++) {
+        trader *current_trader = (-1 == i) ? first_trader : traders[i];
+        if (NULL == current_trader || (i >= 0 && current_trader == first_trader)
+            || !has_frames(&current_trader->output)) {
             continue;
         } else if (!current_trader->is_connected) {
+            discard_frames(&current_trader->output);
             continue;
         }
-        if (-1 == write(current_trader->e2t_fd_wronly, response,
-                        strlen(response))) {
-            #ifdef DEBUG
-                printf("Error: write returned -1, errno: %s (%d)\n",
-                        strerror(errno), errno);
-            #endif
-        }
-    }
 
-    // Send a signal to all the traders (excluding the trader that made the order)
-    for (int i = 0; i < num_traders; i++) {
-        trader *current_trader = traders[i];
-        if (current_trader->trader_id == skip_trader->trader_id) {
+        if (-1 == write_outbound(current_trader)) {
+            status = -1;
             continue;
-        } else if (!current_trader->is_connected) {
+        } else if (current_trader->backlog.is_overflowed) {
+            cut_off_trader(current_trader);
             continue;
         }
 
@@ -1570,202 +2509,376 @@ void notify_all_traders(enum order_state cmd, order *new_order,
             nanosleep((const struct timespec[]){{0, TIME_100MS}}, NULL);
         #endif
 
-        if (0 != kill(current_trader->pid, SIGUSR1)) {
+        if (0 != wake_trader(current_trader)) {
             #ifdef DEBUG
-                printf("Error: kill returned -1, errno: %s (%d)\n",
+                printf("Error: wake_trader returned -1, errno: %s (%d)\n",
                         strerror(errno), errno);
             #endif
+            status = -1;
         }
     }
-}
 
-// Cleanup all memory and file descriptors
-void free_all(char **e2t_pipenames, char **t2e_pipenames, char **products,
-                int num_products, trader **traders,int num_traders) {
-    unlink_pipes(e2t_pipenames, num_traders);
-    unlink_pipes(t2e_pipenames, num_traders);
-    free_pipenames(e2t_pipenames, t2e_pipenames, num_traders);
-    free_2d_char_array(products, num_products);
-    free_traders(traders, num_traders);
+    // The MARKET message shared by the writers has been sent
+    market_data_len = 0;
+    return status;
 }
 
-// Free the memory on the heap associated with the linked list
-void free_linked_list(order *head) {
-    while (NULL != head) {
-        order *tmp = head;
-        head = head->next;
-        free_order(tmp);
-    }
+// Write the MARKET message of the command's order into response
+// Must be called before a cancelled order is removed
+void format_market_update(enum order_state cmd, order *new_order,
+                            char response[BUFFER_SIZE]) {
+    response[0] = '\0';
+    if (ACCEPTED_BUY == cmd) {
+        sprintf(response, "MARKET BUY %s %d %d;",
+                get_product_name(new_order->product_id),
+                new_order->quantity, new_order->price);
+    } else if (ACCEPTED_SELL == cmd) {
+        sprintf(response, "MARKET SELL %s %d %d;",
+                get_product_name(new_order->product_id),
+                new_order->quantity, new_order->price);
+    } else if (CANCELLED == cmd) {
+        sprintf(response, "MARKET %s %s 0 0;",
+                (BUY == new_order->type) ? "BUY" : "SELL",
+                get_product_name(new_order->product_id));
+    } else if (AMENDED == cmd) {
+        sprintf(response, "MARKET %s %s %d %d;",
+                (BUY == new_order->type) ? "BUY" : "SELL",
+                get_product_name(new_order->product_id), new_order->quantity,
+                new_order->price);
+    }
+}
+
+// Queue the MARKET message for all the traders except skip_trader
+void publish_market_update(char *response, trader *skip_trader,
+                            trader **traders, int num_traders) {
+    // The fan-out workers queue it for their traders
+    if (NULL != staged_event) {
+        staged_event->has_market = true;
+        staged_event->market_index = staged_event->num_messages;
+        snprintf(staged_event->market, BUFFER_SIZE, "%s", response);
+        return;
+    }
+
+    // The message is stored once and shared by every trader's writer until
+    // the event is flushed
+    int length = strlen(response);
+    if (market_data_len + length > BUFFER_SIZE) {
+        #ifdef DEBUG
+            printf("Error in notify_all_traders(): market data is full\n");
+        #endif
+        return;
+    }
+    char *shared = memcpy(market_data + market_data_len, response, length);
+    market_data_len += length;
+
+    // Queue for all the traders (excluding the trader that made the order)
+    for (int i = 0; i < num_traders; i++) {
+        trader *current_trader = traders[i];
+        if (current_trader->trader_id == skip_trader->trader_id) {
+            continue;
+        } else if (!current_trader->is_connected) {
+            continue;
+        }
+        if (-1 == append_shared_frame(&current_trader->output, shared,
+                                        length)) {
+            #ifdef DEBUG
+                printf("Error: append_shared_frame returned -1, \
+                        errno: %s (%d)\n", strerror(errno), errno);
+            #endif
+        }
+    }
+}
+
+// Notify all the traders of MARKET events
+void notify_all_traders(enum order_state cmd, order *new_order,
+                        trader *skip_trader, trader **traders,
+                        product_order **orderbook, int num_products,
+                         int num_traders) {
+    char response[BUFFER_SIZE] = "";
+    format_market_update(cmd, new_order, response);
+    publish_market_update(response, skip_trader, traders, num_traders);
+}
+
+// Cleanup all memory and file descriptors
+void free_all(char **e2t_pipenames, char **t2e_pipenames, char **products,
+                int num_products, trader **traders,int num_traders) {
+    unlink_pipes(e2t_pipenames, num_traders);
+    unlink_pipes(t2e_pipenames, num_traders);
+    free_pipenames(e2t_pipenames, t2e_pipenames, num_traders);
+    free_2d_char_array(products, num_products);
+    free_traders(traders, num_traders);
+}
+
+// Free the orders of a level and the level itself
+static void free_level_orders(price_level *level) {
+    order *head = level->head;
+    while (NULL != head) {
+        order *tmp = head;
+        head = head->next;
+        free_order(tmp);
+    }
+    free_level(level);
+}
+
+// Free the memory on the heap associated with the levels of a side
+void free_book_side(book_side *side) {
+    if (LADDER_BOOK == side->mode) {
+        price_level *level = ladder_next_level(&side->ladder, NULL);
+        while (NULL != level) {
+            price_level *next = ladder_next_level(&side->ladder, level);
+            free_level_orders(level);
+            level = next;
+        }
+        my_free(side->ladder.slots);
+        my_free(side->ladder.bitmap);
+    }
+
+    for (int i = 0; i < side->num_levels; i++) {
+        free_level_orders(side->levels[i]);
+    }
+    my_free(side->levels);
 }
 
 // Free the orderbook heap memory
 void free_orderbook(product_order **orderbook, int num_products) {
     for (int i = 0; i < num_products; i++) {
-        if (NULL != orderbook[i]->buy_orders) {
-            free_linked_list(orderbook[i]->buy_orders);
-        }
-        if (NULL != orderbook[i]->sell_orders) {
-            free_linked_list(orderbook[i]->sell_orders);
+        // With matcher threads the objects go back to the pools of the
+        // product's matcher
+        if (NULL != engine) {
+            matcher *current_matcher = &engine->matchers[i
+                                                % engine->num_matchers];
+            thread_order_pool = &current_matcher->order_pool;
+            thread_level_pool = &current_matcher->level_pool;
         }
+        free_book_side(&orderbook[i]->buy_side);
+        free_book_side(&orderbook[i]->sell_side);
         my_free(orderbook[i]);
     }
     my_free(orderbook);
+
+    thread_order_pool = &order_pool;
+    thread_level_pool = &level_pool;
 }
 
 // Initialise a new orderbook
 void init_orderbook(product_order **orderbook, char **products,
-                        int num_products) {
+                        enum book_mode *modes, int num_products) {
     for (int i = 0; i < num_products; i++) {
         char *current_product = products[i];
 
         product_order *new_product_order = my_calloc(1, sizeof(product_order));
         new_product_order->product_name = current_product;
-        new_product_order->sell_orders = NULL;
+        init_book_side(&new_product_order->sell_side, SELL, modes[i]);
         new_product_order->sell_size = 0;
-        new_product_order->buy_orders = NULL;
+        init_book_side(&new_product_order->buy_side, BUY, modes[i]);
         new_product_order->buy_size = 0;
 
         orderbook[i] = new_product_order;
     }
 }
 
-// Get the total quantity of orders at the current price
-order *get_total_quantity(order *list, int *quantity_ptr, int *num_orders_ptr,
-                            enum order_type type) {
-
-    int current_price = list->price;
+// Get the number of BUY/SELL levels
+int get_num_levels(book_side *side) {
+    if (LADDER_BOOK == side->mode) {
+        return side->num_levels + side->ladder.num_levels;
+    }
+    return side->num_levels;
+}
 
-    order *cursor = list;
-    while (NULL != cursor) {
-        if (current_price != cursor->price) {
-            break;
-        }
+// Print the total quantity and number of orders at a level
+// To out, or to the log when out is NULL
+void print_level(FILE *out, price_level *level, enum order_type type) {
+    long long args[] = {BUY == type, level->total_quantity, level->price,
+                        level->num_orders};
+    if (NULL == out) {
+        log_record(LOG_LEVEL, args, 4, NULL, 0);
+    } else {
+        format_record(out, LOG_LEVEL, args, NULL, 0);
+    }
+}
 
-        *quantity_ptr += cursor->quantity;
-        *num_orders_ptr += 1;
+// Get the next BUY/SELL level, from highest to lowest price
+// Returns NULL after the last level
+price_level *next_level(book_side *side, level_cursor *cursor) {
+    // The sorted levels are kept from worst to best price
+    price_level *level = NULL;
+    if (cursor->index < side->num_levels) {
+        level = side->levels[(BUY == side->type) ?
+                                side->num_levels - 1 - cursor->index
+                                : cursor->index];
+    }
+    if (LADDER_BOOK != side->mode) {
+        cursor->index += 1;
+        return level;
+    }
 
-        if (BUY == type) {
-            cursor = cursor->next;
-        } else {
-            cursor = cursor->prev;
+    // Merge the ladder with the levels outside its window
+    if (!cursor->is_started) {
+        cursor->rung = ladder_next_level(&side->ladder, NULL);
+        cursor->is_started = true;
+    }
+    if (NULL == level
+        || (NULL != cursor->rung && cursor->rung->price > level->price)) {
+        level = cursor->rung;
+        if (NULL != level) {
+            cursor->rung = ladder_next_level(&side->ladder, level);
         }
+        return level;
     }
-
-    return cursor;
+    cursor->index += 1;
+    return level;
 }
 
-// Get the number of BUY/SELL levels
-int get_num_levels(order *head) {
-    if (NULL == head) {
-        return 0;
+// Print the orders at each BUY/SELL level, from highest to lowest price
+void print_orders(FILE *out, book_side *side) {
+    level_cursor cursor = {0};
+    price_level *level = NULL;
+    while (NULL != (level = next_level(side, &cursor))) {
+        print_level(out, level, side->type);
     }
+}
 
-    int counter = 1;
-    int tmp_price = head->price;
-
-    // Increment the counter when there is a new price level
-    order *cursor = head->next;
-    while (NULL != cursor) {
-        if (tmp_price != cursor->price) {
-            tmp_price = cursor->price;
-            counter++;
-        }
-        cursor = cursor->next;
+// Print out one product of the orderbook
+// To out, or to the log when out is NULL
+void print_product(FILE *out, product_order *current_product) {
+    long long levels[] = {get_num_levels(&current_product->buy_side),
+                            get_num_levels(&current_product->sell_side)};
+    char *name = current_product->product_name;
+    if (NULL == out) {
+        log_record(LOG_PRODUCT, levels, 2, name, strlen(name));
+    } else {
+        format_record(out, LOG_PRODUCT, levels, name, strlen(name));
     }
-    return counter;
+
+    // Print out the SELL orders, then the BUY orders
+    print_orders(out, &current_product->sell_side);
+    print_orders(out, &current_product->buy_side);
 }
 
-// Print the orders at each BUY/SELL level
-void print_orders(order *head, enum order_type type) {
-    if (NULL == head) {
-        return;
+// Copy the levels of one product of the orderbook into section, growing it
+// if needed
+// Returns 0 on success, -1 on error
+int copy_book_section(book_section *section, product_order *current_product) {
+    int num_sell_levels = get_num_levels(&current_product->sell_side);
+    int num_buy_levels = get_num_levels(&current_product->buy_side);
+    int num_levels = num_sell_levels + num_buy_levels;
+    if (num_levels > section->capacity) {
+        int capacity = (0 == section->capacity) ?
+                        INITIAL_LEVEL_CAPACITY : section->capacity;
+        while (capacity < num_levels) {
+            capacity *= 2;
+        }
+        level_record *levels = my_realloc(section->levels,
+                                            capacity * sizeof(level_record));
+        if (NULL == levels) {
+            return -1;
+        }
+        section->levels = levels;
+        section->capacity = capacity;
     }
-
-    if (SELL == type) {
-        while (NULL != head->next) {
-            head = head->next;
+    section->num_sell_levels = num_sell_levels;
+    section->num_buy_levels = num_buy_levels;
+
+    // SELL levels first, then BUY levels, as they are printed
+    level_record *record = section->levels;
+    book_side *sides[] = {&current_product->sell_side,
+                            &current_product->buy_side};
+    for (int i = 0; i < 2; i++) {
+        level_cursor cursor = {0};
+        price_level *level = NULL;
+        while (NULL != (level = next_level(sides[i], &cursor))) {
+            record->quantity = level->total_quantity;
+            record->price = level->price;
+            record->num_orders = level->num_orders;
+            record++;
         }
     }
+    return 0;
+}
 
-    order *cursor = head;
-    while (NULL != cursor) {
-        int total_quantity = 0;
-        int price = cursor->price;
-        int num_orders = 0;
-        char *order_type = (BUY == type) ? "BUY" : "SELL";
-        order *new_cursor = get_total_quantity(cursor, &total_quantity,
-                                                &num_orders, type);
-
-        printf("%s\t\t%s %d @ $%d (%d order%s)\n", LOG_PREFIX, order_type,
-                total_quantity, price, num_orders, (1 == num_orders) ? "" : "s");
-        cursor = new_cursor;
+// Print out one product of the orderbook from its copied section
+void print_book_section(book_section *section, char *product_name) {
+    long long levels[] = {section->num_buy_levels, section->num_sell_levels};
+    log_record(LOG_PRODUCT, levels, 2, product_name, strlen(product_name));
+
+    int num_levels = section->num_sell_levels + section->num_buy_levels;
+    for (int i = 0; i < num_levels; i++) {
+        level_record *record = &section->levels[i];
+        long long args[] = {i >= section->num_sell_levels, record->quantity,
+                            record->price, record->num_orders};
+        log_record(LOG_LEVEL, args, 4, NULL, 0);
     }
 }
 
+// Free the records of the section
+void free_book_section(book_section *section) {
+    my_free(section->levels);
+    section->levels = NULL;
+    section->capacity = 0;
+}
+
 // Print out the orderbook
 void print_orderbook(product_order **orderbook, int num_products) {
-    printf("%s\t--ORDERBOOK--\n", LOG_PREFIX);
+    log_record(LOG_BOOK_TITLE, NULL, 0, NULL, 0);
 
     // Iterate through all the products
     for (int i = 0; i < num_products; i++) {
-        product_order *current_product = orderbook[i];
-        int buy_levels = get_num_levels(current_product->buy_orders);
-        int sell_levels = get_num_levels(current_product->sell_orders);
-
-        printf("%s\tProduct: %s; Buy levels: %d; Sell levels: %d\n", LOG_PREFIX,
-                current_product->product_name, buy_levels, sell_levels);
-
-        // Print out the SELL orders, then the BUY orders
-        print_orders(current_product->sell_orders, SELL);
-        print_orders(current_product->buy_orders, BUY);
+        print_product(NULL, orderbook[i]);
     }
 }
 
-// Initialise a new position
-position *init_new_position(char *product_name) {
-    position *new_position = my_calloc(1, sizeof(position));
-    new_position->product_name = product_name;
-    new_position->quantity = 0;
-    new_position->value = 0;
-    return new_position;
-}
-
-// Initialise all new positions
-position *init_positions(char **products, int num_products) {
-    if (0 == num_products) {
-        return NULL;
+// Initialise the (zeroed) positions of all the traders
+int init_positions(int num_traders, int num_products) {
+    positions = my_calloc(1, sizeof(position_matrix));
+    positions->num_traders = num_traders;
+    positions->num_products = num_products;
+    positions->cells = my_calloc((size_t) num_traders * num_products,
+                                    sizeof(position));
+    positions->row_args = my_calloc(2 + 2 * num_products, sizeof(long long));
+    if (NULL == positions->cells || NULL == positions->row_args) {
+        return -1;
     }
 
-    position *tmp = init_new_position(products[0]);
-
-    position *head = tmp;
-
-    for (int i = 1; i < num_products; i++) {
-        position *new_position = init_new_position(products[i]);
-        new_position->prev = tmp;
-        tmp->next = new_position;
-
-        tmp = new_position;
+    // Each trader's positions are logged with the names, separated by spaces
+    int len = 0;
+    for (int j = 0; j < num_products; j++) {
+        char *name = get_product_name(j);
+        len += ((NULL == name) ? 0 : strlen(name)) + 1;
     }
-
-    return head;
+    positions->product_names = my_calloc(len + 1, sizeof(char));
+    if (NULL == positions->product_names) {
+        return -1;
+    }
+    for (int j = 0; j < num_products; j++) {
+        char *name = get_product_name(j);
+        if (j > 0) {
+            strcat(positions->product_names, " ");
+        }
+        strcat(positions->product_names, (NULL == name) ? "" : name);
+    }
+    positions->product_names_len = strlen(positions->product_names);
+    return 0;
 }
 
-void load_positions(trader **traders, int num_traders, char **products,
-                    int num_products) {
-    for (int i = 0; i < num_traders; i++) {
-        trader *current_trader = traders[i];
-        current_trader->positions = init_positions(products, num_products);
+// Free the memory associated with the positions
+void free_positions() {
+    if (NULL == positions) {
+        return;
     }
+    my_free(positions->cells);
+    my_free(positions->row_args);
+    my_free(positions->product_names);
+    my_free(positions);
+    positions = NULL;
 }
 
 // Launch the trader binaries
-trader **launch_traders(char *trader_filenames[BUFFER_SIZE], char **e2t_pipenames,
+trader **launch_traders(char **trader_filenames, char **e2t_pipenames,
                         char **t2e_pipenames, int num_traders, char **products,
                         int num_products, char *testing_filename) {
 
     // Store the traders in an array of traders
-    trader **traders = my_calloc(num_traders, sizeof(trader));
+    trader **traders = my_calloc(num_traders, sizeof(trader *));
 
     for (int i = 0; i < num_traders; i++) {
         trader *new_trader = launch_trader(trader_filenames[i], e2t_pipenames[i],
@@ -1780,33 +2893,107 @@ trader **launch_traders(char *trader_filenames[BUFFER_SIZE], char **e2t_pipename
     }
 
     // Load the positions of all the traders
-    load_positions(traders, num_traders, products, num_products);
+    if (-1 == init_positions(num_traders, num_products)) {
+        #ifdef DEBUG
+            printf("Error: could not allocate positions\n");
+        #endif
+    }
+
+    // Signals are matched to the traders by pid
+    if (-1 == init_trader_registry(traders, num_traders)) {
+        #ifdef DEBUG
+            printf("Error: could not allocate the trader registry\n");
+        #endif
+    }
 
     return traders;
 }
 
 // Print out the positions of each trader
 void print_positions(trader **traders, int num_traders) {
-    printf("%s\t--POSITIONS--\n", LOG_PREFIX);
+    log_record(LOG_POSITIONS_TITLE, NULL, 0, NULL, 0);
 
+    // Rows of the matrix are in trader id order, one record each
+    int num_products = positions->num_products;
+    long long *args = positions->row_args;
+    position *cell = positions->cells;
     for (int i = 0; i < num_traders; i++) {
-        printf("%s\tTrader %d: ", LOG_PREFIX, traders[i]->trader_id);
-        position *head = traders[i]->positions;
-
-        while (NULL != head->next) {
-            printf("%s %lld ($%lld), ", head->product_name,
-                    head->quantity, head->value);
-            head = head->next;
+        args[0] = traders[i]->trader_id;
+        args[1] = num_products;
+        for (int j = 0; j < num_products; j++, cell++) {
+            args[2 + 2 * j] = cell->quantity;
+            args[3 + 2 * j] = cell->value;
         }
-
-        printf("%s %lld ($%lld)\n", head->product_name,
-                head->quantity, head->value);
+        log_record(LOG_TRADER, args, 2 + 2 * num_products,
+                    positions->product_names, positions->product_names_len);
     }
 }
 
 // Disconnect the trader
 void disconnect_trader(trader *current_trader) {
     current_trader->is_connected = false;
+
+    // Nobody is left to read the messages still waiting
+    free_backlog(&current_trader->backlog);
+
+    // A trader cut off for falling behind may still be running, closing its
+    // pipes lets it see the end of file
+    if (atomic_load(&current_trader->is_cut_off)) {
+        close(current_trader->e2t_fd_wronly);
+        close(current_trader->t2e_fd_rdonly);
+        current_trader->e2t_fd_wronly = -1;
+        current_trader->t2e_fd_rdonly = -1;
+    }
+}
+
+
+// Get the poll of room for the trader's backlog: its pipe becoming
+// writable, or the eventfd its ring's reader posts once it has read
+struct pollfd get_backlog_pollfd(trader *current_trader) {
+    struct pollfd backlog_fd = {0};
+    if (NULL != current_trader->channel) {
+        backlog_fd.fd = current_trader->eventfds.e2t_room;
+        backlog_fd.events = POLLIN;
+    } else {
+        backlog_fd.fd = current_trader->e2t_fd_wronly;
+        backlog_fd.events = POLLOUT;
+    }
+    return backlog_fd;
+}
+
+// Write what the trader's pipe (or ring) takes of its backlog, and wake it
+// if anything was written
+// Returns 0 on success, -1 on error
+int drain_backlog(trader *current_trader) {
+    if (!current_trader->is_connected) {
+        return 0;
+    }
+
+    // Consume the ring's wakeups first, a later read posts a new one
+    if (NULL != current_trader->channel) {
+        wait_for_peer(current_trader->eventfds.e2t_room);
+    }
+
+    ssize_t num_written = drain_frames(&current_trader->output);
+    if (num_written > 0) {
+        return wake_trader(current_trader);
+    }
+    return (-1 == num_written) ? -1 : 0;
+}
+
+// Report the traders whose pipe filled up at some point
+void print_slow_traders(trader **traders, int num_traders) {
+    for (int i = 0; i < num_traders; i++) {
+        frame_backlog *backlog = &traders[i]->backlog;
+        if (0 == backlog->num_stalls) {
+            continue;
+        }
+        log_printf("%s Slow trader %d: stalled %d times, backlog up to %d bytes, "
+                "%d MARKET conflated, %d dropped%s\n", LOG_PREFIX,
+                traders[i]->trader_id, backlog->num_stalls, backlog->max_len,
+                backlog->num_conflated, backlog->num_dropped,
+                atomic_load(&traders[i]->is_cut_off) ? ", disconnected" : "");
+    }
 }
 
 // Write to the trader that their command is invalid
@@ -1815,28 +3002,14 @@ void respond_invalid(trader *current_trader) {
         return;
     }
 
-    char *response = "INVALID;";
-    if (-1 == write(current_trader->e2t_fd_wronly, response, strlen(response))) {
-        #ifdef DEBUG
-            printf("Error in fill_notify_trader(): write returned -1, \
-                    errno: %s (%d)\n", strerror(errno), errno);
-        #endif
-    }
-
-    if (0 != kill(current_trader->pid, SIGUSR1)) {
+    if (-1 == queue_message(current_trader, "INVALID;")) {
         #ifdef DEBUG
-            printf("Error in fill_notify_trader(): kill returned -1, \
+            printf("Error in respond_invalid(): queue_message returned -1, \
                     errno: %s (%d)\n", strerror(errno), errno);
         #endif
     }
 }
 
-void init_queue() {
-    my_queue = my_calloc(1, sizeof(queue));
-    my_queue->head = NULL;
-    my_queue->size = 0;
-}
-
 int send_sigusr2_to_all_traders(trader **traders, int num_traders, int signal) {
     for (int i = 0; i < num_traders; i++) {
         trader *current_trader = traders[i];
@@ -1852,180 +3025,1658 @@ int send_sigusr2_to_all_traders(trader **traders, int num_traders, int signal) {
     return 0;
 }
 
-#ifndef UNIT_TEST
-int main(int argc, char **argv) {
-    char product_filename[BUFFER_SIZE] = {0};
-    char testing_filename[BUFFER_SIZE] = {0};
-    char *trader_filenames[BUFFER_SIZE] = {0};
+// Run a job on its matcher's thread
+// The same steps as handle_command, but only the book is changed here, the
+// rest waits for the job to retire on the main thread
+void match_job_command(match_job *job, product_order **orderbook,
+                        int num_products) {
+    command *parsed = &job->parsed;
+    trader *owner = job->owner;
+
+    // The order may have been filled or cancelled since the command was
+    // routed
+    job->is_valid = (ACCEPTED_BUY == parsed->cmd
+                        || ACCEPTED_SELL == parsed->cmd
+                        || NULL != get_order(owner, parsed->order_id));
+    if (!job->is_valid) {
+        return;
+    }
 
-    // Pass in the arguments to spx_exchange
-    int num_traders = exchange_parse_args(argc, argv, product_filename,
-                                            trader_filenames, testing_filename);
-    if (-1 == num_traders) {
-        return -1;
+    order *new_order = process_command(parsed, owner, orderbook, num_products);
+    if (NULL == new_order) {
+        job->is_valid = false;
+        return;
     }
+    // Matching may free the order
+    job->market_order = *new_order;
+
+    // Hand the fills over to the job, its old buffer takes the next ones
+    match_command(parsed, owner, orderbook, num_products);
+    trade_batch batch = job->trades;
+    job->trades = trades;
+    trades = batch;
+    trades.size = 0;
+
+    // Only the levels are copied here, they are formatted by the log
+    job->has_book = (0 == copy_book_section(&job->book,
+                                            orderbook[job->product_id]));
+}
 
-    printf("%s Starting\n", LOG_PREFIX);
+// Match the jobs submitted to the matcher until it is stopped
+static void *run_matcher(void *arg) {
+    matcher *current_matcher = arg;
+    thread_order_pool = &current_matcher->order_pool;
+    thread_level_pool = &current_matcher->level_pool;
+
+    while (true) {
+        unsigned int done = atomic_load_explicit(&current_matcher->done,
+                                                    memory_order_relaxed);
+        if (done == atomic_load(&current_matcher->head)) {
+            if (atomic_load(&current_matcher->is_stopping)) {
+                break;
+            }
+            wait_for_peer(current_matcher->job_eventfd);
+            continue;
+        }
 
-    // Register sighandler for SIGUSR1
-    struct sigaction sigusr1;
-    memset(&sigusr1, 0, sizeof(struct sigaction));
-    sigusr1.sa_sigaction = sigusr1_handler;
-    sigusr1.sa_flags = SA_SIGINFO | SA_RESTART;
-    sigaction(SIGUSR1, &sigusr1, NULL);
+        match_job_command(&current_matcher->jobs[done & (MATCH_RING_CAPACITY - 1)],
+                            current_matcher->orderbook,
+                            current_matcher->num_products);
 
-    // Register sighandler for SIGCHLD
-    struct sigaction sigchild;
-    memset(&sigchild, 0, sizeof(struct sigaction));
-    sigchild.sa_sigaction = sigchild_handler;
-    sigchild.sa_flags = SA_SIGINFO | SA_RESTART;
-    sigaction(SIGCHLD, &sigchild, NULL);
+        // The main thread checks done after announcing that it waits, so
+        // one of the two sees the other
+        atomic_store(&current_matcher->done, done + 1);
+        if (atomic_load(&current_matcher->is_waiting)) {
+            wake_peer(current_matcher->done_eventfd);
+        }
+    }
 
-    // Get the products from the products file
-    int num_products = -1;
-    char **products = get_products(product_filename, &num_products);
+    free_trade_batch(&trades);
+    return NULL;
+}
 
-    if (-1 == num_products) {
-        return -1;
+// Start the matcher threads, product i is matched by matcher
+// i % num_matchers
+// Returns 0 on success, -1 on error
+int start_matchers(int num_matchers, int pool_capacity,
+                    product_order **orderbook, int num_products) {
+    if (num_matchers > num_products) {
+        num_matchers = num_products;
     }
 
-    // Print out the products from the products file
-    print_products(products, num_products);
-
-    // Get the names of the named pipes for the traders
-    char **e2t_pipenames = my_calloc(num_traders, sizeof(char *));
-    char **t2e_pipenames = my_calloc(num_traders, sizeof(char *));
-    if (-1 == get_pipes(e2t_pipenames, t2e_pipenames, num_traders)) {
+    engine = my_calloc(1, sizeof(match_engine));
+    if (NULL == engine) {
+        return -1;
+    }
+    engine->num_matchers = num_matchers;
+    engine->matchers = my_calloc(num_matchers, sizeof(matcher));
+    engine->num_routes = num_matchers * MATCH_RING_CAPACITY;
+    engine->routes = my_calloc(engine->num_routes, sizeof(int));
+    engine->num_products = num_products;
+    engine->books = my_calloc(num_products, sizeof(book_section));
+    if (NULL == engine->matchers || NULL == engine->routes
+        || NULL == engine->books) {
         return -1;
     }
 
-    unlink_pipes(e2t_pipenames, num_traders);
-    unlink_pipes(t2e_pipenames, num_traders);
+    // Each section is replaced by the one of the product's last retired job
+    for (int i = 0; i < num_products; i++) {
+        if (-1 == copy_book_section(&engine->books[i], orderbook[i])) {
+            return -1;
+        }
+    }
 
-    // Initialise the orderbook
-    product_order **orderbook = my_calloc(num_products, sizeof(product_order *));
-    init_orderbook(orderbook, products, num_products);
+    // Signals are left to the main thread, their handlers assume a single
+    // producer
+    sigset_t all_signals;
+    sigset_t old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+
+    int status = 0;
+    for (int i = 0; i < num_matchers && 0 == status; i++) {
+        matcher *current_matcher = &engine->matchers[i];
+        current_matcher->index = i;
+        current_matcher->orderbook = orderbook;
+        current_matcher->num_products = num_products;
+        current_matcher->jobs = my_calloc(MATCH_RING_CAPACITY,
+                                            sizeof(match_job));
+        current_matcher->job_eventfd = eventfd(0, 0);
+        current_matcher->done_eventfd = eventfd(0, 0);
+
+        if (NULL == current_matcher->jobs
+            || -1 == current_matcher->job_eventfd
+            || -1 == current_matcher->done_eventfd
+            || -1 == init_pool(&current_matcher->order_pool, sizeof(order),
+                                pool_capacity, true)
+            || -1 == init_pool(&current_matcher->level_pool,
+                                sizeof(price_level), pool_capacity, true)
+            || 0 != pthread_create(&current_matcher->thread, NULL,
+                                    run_matcher, current_matcher)) {
+            #ifdef DEBUG
+                printf("Error in start_matchers(): errno: %s (%d)\n",
+                        strerror(errno), errno);
+            #endif
+            status = -1;
+        }
+    }
 
-    init_queue();
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return status;
+}
 
-    int64_t exchange_fees_collected = 0;
+// Returns whether the main thread writes the traders' messages, which is up
+// to the publisher thread in pipeline mode
+bool owns_output() {
+    return NULL == engine || !engine->is_pipelined;
+}
 
-    // Launch the traders
-    trader **traders = launch_traders(trader_filenames, e2t_pipenames,
-                                        t2e_pipenames, num_traders, products,
-                                        num_products, testing_filename);
+// Wake the main thread if it waits for the publisher
+static void wake_main() {
+    if (atomic_load(&engine->is_main_waiting)) {
+        wake_peer(engine->retired_eventfd);
+    }
+}
 
-    sleep(1);
+// Returns whether count jobs have retired
+static bool is_retired(uint64_t count) {
+    return atomic_load(&engine->retired_sequence) >= count;
+}
 
-    char buffer[BUFFER_SIZE] = {0};
-    num_current_traders = num_traders;
+// Returns whether the publisher and the fan-out workers have parked
+static bool is_parked(uint64_t unused) {
+    return atomic_load(&engine->is_paused)
+            && engine->num_workers == atomic_load(&engine->num_parked_workers);
+}
 
-    // Open the market
-    open_market(traders, num_traders);
+// Returns whether the publisher and the fan-out workers are back from a
+// pause, so the next one cannot see them parked from this one
+static bool is_resumed(uint64_t unused) {
+    return !atomic_load(&engine->is_paused)
+            && 0 == atomic_load(&engine->num_parked_workers);
+}
 
-    // MAIN PROGRAM LOOP
-    while (num_current_traders > 0) {
-        // Wait for SIGUSR1
-        if (0 == my_queue->size) {
-            pause();
+// Wait for the publisher and the fan-out workers until is_done(arg)
+static void wait_for_publisher(bool (*is_done)(uint64_t), uint64_t arg) {
+    while (!is_done(arg)) {
+        atomic_store(&engine->is_main_waiting, true);
+        if (!is_done(arg)) {
+            wait_for_peer(engine->retired_eventfd);
         }
+        atomic_store(&engine->is_main_waiting, false);
+    }
+}
 
-        node *new_signal = dequeue(my_queue);
-        if (NULL == new_signal) {
-            #ifdef DEBUG
-                printf("Error: new_signal is NULL\n");
-            #endif
-            continue;
+// Wake the fan-out workers, only the idle ones unless is_forced
+static void wake_workers(bool is_forced) {
+    for (int i = 0; i < engine->num_workers; i++) {
+        if (is_forced || atomic_load(&engine->workers[i].is_waiting)) {
+            wake_peer(engine->workers[i].event_eventfd);
         }
+    }
+}
 
-        // Trader disconnection
-        if (SIGCHLD == new_signal->signal) {
-            trader *tmp = get_trader_id(traders, num_traders, new_signal->pid);
-            printf("%s Trader %d disconnected\n", LOG_PREFIX, tmp->trader_id);
-            disconnect_trader(tmp);
-            num_current_traders--;
-            my_free(new_signal);
-
-            #ifdef TESTING
-                nanosleep((const struct timespec[]){{0, TIME_500MS}}, NULL);
-                send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
-            #endif
-            continue;
+// Wait until every fan-out worker has written count events
+static void wait_for_fanout(uint64_t count) {
+    for (int i = 0; i < engine->num_workers; i++) {
+        atomic_ullong *cursor = &engine->workers[i].cursor;
+        while (atomic_load(cursor) < count) {
+            atomic_store(&engine->is_fanout_waiting, true);
+            if (atomic_load(cursor) < count) {
+                wait_for_peer(engine->fanout_eventfd);
+            }
+            atomic_store(&engine->is_fanout_waiting, false);
         }
+    }
+}
 
-        // Trader wrote to the pipe (send SIGUSR1)
-        trader *current_trader = get_trader_id(traders, num_traders,
-                                                new_signal->pid);
-        if (NULL == current_trader) {
-            #ifdef DEBUG
-                printf("Error: trader is NULL\n");
-            #endif
-            return -1;
+// Start an event for the messages of the owner's job, once its slot has
+// been written by every worker
+// Nothing is staged without fan-out workers
+void stage_event(trader *owner) {
+    if (0 == engine->num_workers) {
+        return;
+    }
+
+    uint64_t num_events = atomic_load(&engine->num_events);
+    if (num_events >= FANOUT_RING_CAPACITY) {
+        wait_for_fanout(num_events - FANOUT_RING_CAPACITY + 1);
+    }
+
+    staged_event = &engine->events[num_events % FANOUT_RING_CAPACITY];
+    staged_event->sender = owner;
+    staged_event->has_market = false;
+    staged_event->num_messages = 0;
+}
+
+// Hand the staged event to the fan-out workers
+// Returns 0
+int publish_event() {
+    staged_event = NULL;
+    uint64_t num_events = atomic_load(&engine->num_events) + 1;
+    atomic_store(&engine->num_events, num_events);
+    wake_workers(false);
+
+    // The tests signal the traders once the messages are written
+    #ifdef TESTING
+        wait_for_fanout(num_events);
+    #endif
+    return 0;
+}
+
+// Queue an event's messages for the worker's traders, in the order the
+// publisher queued them, then write them
+static void write_event(fanout_worker *worker, market_event *event) {
+    for (int i = 0; i <= event->num_messages; i++) {
+        if (event->has_market && i == event->market_index) {
+            publish_market_update(event->market, event->sender,
+                                    worker->traders, worker->num_traders);
+        }
+        if (i == event->num_messages) {
+            break;
+        }
+
+        direct_message *message = &event->messages[i];
+        if (worker->index != message->target->trader_id % engine->num_workers) {
+            continue;
+        }
+        if (-1 == append_frame(&message->target->output, "%s",
+                                message->text)) {
+            #ifdef DEBUG
+                printf("Error in write_event(): append_frame returned -1\n");
+            #endif
         }
+    }
 
-        my_free(new_signal);
+    bool is_sender_owned = (worker->index
+                            == event->sender->trader_id % engine->num_workers);
+    flush_outbound(is_sender_owned ? event->sender : NULL, worker->traders,
+                    worker->num_traders);
+}
 
-        // Read from the pipe to ;
-        for (int i = 0; i < BUFFER_SIZE; i++) {
-            read(current_trader->t2e_fd_rdonly, buffer + i, sizeof(char));
-            if (';' == buffer[i]) {
-                break;
+// Write the published events to the worker's traders, and their backlogs
+// when their pipes have room, until stopped
+static void *run_fanout_worker(void *arg) {
+    fanout_worker *worker = arg;
+    struct pollfd *fds = my_calloc(worker->num_traders + 1,
+                                    sizeof(struct pollfd));
+    trader **backlog_traders = my_calloc(worker->num_traders,
+                                            sizeof(trader *));
+
+    while (true) {
+        uint64_t cursor = atomic_load(&worker->cursor);
+        if (cursor < atomic_load(&engine->num_events)) {
+            write_event(worker,
+                        &engine->events[cursor % FANOUT_RING_CAPACITY]);
+            atomic_store(&worker->cursor, cursor + 1);
+            if (atomic_load(&engine->is_fanout_waiting)) {
+                wake_peer(engine->fanout_eventfd);
+            }
+            continue;
+        } else if (atomic_load(&engine->is_pausing)
+                    && atomic_load(&engine->is_paused)) {
+            // The publisher has parked, nothing comes until it resumes
+            atomic_fetch_add(&engine->num_parked_workers, 1);
+            wake_main();
+            while (atomic_load(&engine->is_pausing)) {
+                wait_for_peer(worker->event_eventfd);
+            }
+            atomic_fetch_sub(&engine->num_parked_workers, 1);
+            wake_main();
+            continue;
+        } else if (atomic_load(&worker->is_stopping)) {
+            break;
+        }
+
+        // Wait for an event, or for room in a pipe with a backlog
+        atomic_store(&worker->is_waiting, true);
+        if (cursor == atomic_load(&engine->num_events)) {
+            int num_fds = 1;
+            fds[0].fd = worker->event_eventfd;
+            fds[0].events = POLLIN;
+            for (int i = 0; i < worker->num_traders; i++) {
+                trader *current_trader = worker->traders[i];
+                if (current_trader->is_connected
+                    && has_backlog(&current_trader->output)) {
+                    fds[num_fds] = get_backlog_pollfd(current_trader);
+                    backlog_traders[num_fds - 1] = current_trader;
+                    num_fds++;
+                }
+            }
+
+            if (poll(fds, num_fds, -1) > 0) {
+                if (0 != fds[0].revents) {
+                    wait_for_peer(worker->event_eventfd);
+                }
+                for (int i = 1; i < num_fds; i++) {
+                    if (0 != fds[i].revents) {
+                        drain_backlog(backlog_traders[i - 1]);
+                    }
+                }
+            }
+        }
+        atomic_store(&worker->is_waiting, false);
+    }
+
+    my_free(fds);
+    my_free(backlog_traders);
+    return NULL;
+}
+
+// Print the orderbook from the sections of the retired jobs
+static void print_book_sections() {
+    log_record(LOG_BOOK_TITLE, NULL, 0, NULL, 0);
+    for (int i = 0; i < engine->num_products; i++) {
+        print_book_section(&engine->books[i], get_product_name(i));
+    }
+}
+
+// Get the matcher of the oldest job in flight
+static matcher *get_oldest_matcher() {
+    int index = engine->routes[atomic_load(&engine->retired_sequence)
+                                % engine->num_routes];
+    return &engine->matchers[index];
+}
+
+// Returns whether the matcher has matched a job not retired yet
+static bool has_matched_job(matcher *current_matcher) {
+    return atomic_load(&current_matcher->tail)
+            != atomic_load(&current_matcher->done);
+}
+
+// Apply the results of the oldest job in flight, waiting for its matcher if
+// needed: the log, the messages and the positions, the way handle_command
+// does after a command
+// Returns the fees of the job
+static int64_t retire_job(trader **traders, int num_traders) {
+    matcher *current_matcher = get_oldest_matcher();
+    unsigned int tail = atomic_load_explicit(&current_matcher->tail,
+                                                memory_order_relaxed);
+    while (tail == atomic_load(&current_matcher->done)) {
+        atomic_store(&current_matcher->is_waiting, true);
+        if (tail == atomic_load(&current_matcher->done)) {
+            wait_for_peer(current_matcher->done_eventfd);
+        }
+        atomic_store(&current_matcher->is_waiting, false);
+    }
+
+    match_job *job = &current_matcher->jobs[tail & (MATCH_RING_CAPACITY - 1)];
+    #ifdef DEBUG
+        if (job->sequence != atomic_load(&engine->retired_sequence)) {
+            printf("Error in retire_job(): job %llu retired as %llu\n",
+                    (unsigned long long) job->sequence,
+                    (unsigned long long) atomic_load(&engine->retired_sequence));
+        }
+    #endif
+
+    trader *owner = job->owner;
+    int64_t fees = 0;
+    if (job->text_len > 0) {
+        log_parsing(owner, job->text, job->text_len);
+    } else {
+        char text[BUFFER_SIZE] = {0};
+        format_command(&job->parsed, text);
+        log_parsing(owner, text, strlen(text));
+    }
+    // With fan-out workers the messages go out as one event
+    stage_event(owner);
+    if (!job->is_valid) {
+        respond_invalid(owner);
+        flush_outbound(owner, traders, num_traders);
+        #ifdef TESTING
+            send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
+        #endif
+    } else {
+        char market[BUFFER_SIZE] = {0};
+        format_market_update(job->parsed.cmd, &job->market_order, market);
+        respond_to_trader(job->parsed.order_id, owner, job->parsed.cmd);
+        publish_market_update(market, owner, traders, num_traders);
+        fees = apply_trades(&job->trades);
+        flush_outbound(owner, traders, num_traders);
+
+        // The job's slot keeps the old section's records for its next job
+        if (job->has_book) {
+            book_section section = engine->books[job->product_id];
+            engine->books[job->product_id] = job->book;
+            job->book = section;
+        }
+        print_book_sections();
+        print_positions(traders, num_traders);
+
+        flush_log();
+
+        #ifdef TESTING
+            nanosleep((const struct timespec[]){{0, TIME_250MS}}, NULL);
+            send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
+        #endif
+    }
+
+    // The slot can take a new job
+    atomic_store(&current_matcher->tail, tail + 1);
+    atomic_fetch_add(&engine->retired_sequence, 1);
+    wake_main();
+    return fees;
+}
+
+// Retire the jobs in flight in sequence order, all of them, or only until
+// one has not been matched yet
+// The publisher thread retires them by itself in pipeline mode
+void retire_commands(trader **traders, int num_traders, bool wait) {
+    if (NULL == engine || engine->is_pipelined) {
+        return;
+    }
+
+    while (atomic_load(&engine->retired_sequence)
+            < atomic_load(&engine->next_sequence)) {
+        if (!wait && !has_matched_job(get_oldest_matcher())) {
+            break;
+        }
+        engine->fees += retire_job(traders, num_traders);
+    }
+}
+
+// Retire the jobs in flight, then keep the publisher thread off the
+// traders' messages so the main thread can write them, until
+// resume_pipeline
+void pause_pipeline(trader **traders, int num_traders) {
+    if (NULL == engine) {
+        return;
+    } else if (!engine->is_pipelined) {
+        retire_commands(traders, num_traders, true);
+        return;
+    }
+
+    atomic_store(&engine->is_pausing, true);
+    wake_peer(engine->publish_eventfd);
+    wait_for_publisher(is_parked, 0);
+}
+
+// Let the publisher thread go on after pause_pipeline
+void resume_pipeline() {
+    if (NULL == engine || !engine->is_pipelined) {
+        return;
+    }
+
+    atomic_store(&engine->is_pausing, false);
+    wake_peer(engine->publish_eventfd);
+    wake_workers(true);
+    wait_for_publisher(is_resumed, 0);
+}
+
+// Retire the jobs as they are matched, and write the backlogs of the
+// traders whose pipes have room, until stopped
+static void *run_publisher(void *arg) {
+    trader **traders = engine->traders;
+    int num_traders = engine->num_traders;
+    struct pollfd *fds = my_calloc(num_traders + 1, sizeof(struct pollfd));
+    trader **backlog_traders = my_calloc(num_traders, sizeof(trader *));
+
+    while (true) {
+        bool has_jobs = (atomic_load(&engine->retired_sequence)
+                            < atomic_load(&engine->next_sequence));
+        matcher *oldest_matcher = has_jobs ? get_oldest_matcher() : NULL;
+        if (has_jobs && has_matched_job(oldest_matcher)) {
+            engine->fees += retire_job(traders, num_traders);
+            continue;
+        } else if (!has_jobs && atomic_load(&engine->is_pausing)) {
+            // Nothing is touched until the main thread resumes, the workers
+            // park once they have written every event
+            atomic_store(&engine->is_paused, true);
+            wake_workers(true);
+            wake_main();
+            while (atomic_load(&engine->is_pausing)) {
+                wait_for_peer(engine->publish_eventfd);
             }
+            atomic_store(&engine->is_paused, false);
+            wake_main();
+            continue;
+        } else if (!has_jobs && atomic_load(&engine->is_stopping)) {
+            break;
+        }
+
+        // Wait for the oldest job to be matched (or for a new one), or for
+        // room in a pipe with a backlog (the workers' traders' otherwise)
+        int num_polled = (0 == engine->num_workers) ? num_traders : 0;
+        atomic_bool *flag = has_jobs ? &oldest_matcher->is_waiting
+                                        : &engine->is_publisher_idle;
+        int event_fd = has_jobs ? oldest_matcher->done_eventfd
+                                : engine->publish_eventfd;
+        atomic_store(flag, true);
+        bool is_ready = has_jobs ? has_matched_job(oldest_matcher)
+                        : (atomic_load(&engine->retired_sequence)
+                            < atomic_load(&engine->next_sequence));
+        if (!is_ready) {
+            int num_fds = 1;
+            fds[0].fd = event_fd;
+            fds[0].events = POLLIN;
+            for (int i = 0; i < num_polled; i++) {
+                if (traders[i]->is_connected
+                    && has_backlog(&traders[i]->output)) {
+                    fds[num_fds] = get_backlog_pollfd(traders[i]);
+                    backlog_traders[num_fds - 1] = traders[i];
+                    num_fds++;
+                }
+            }
+
+            if (poll(fds, num_fds, -1) > 0) {
+                if (0 != fds[0].revents) {
+                    wait_for_peer(event_fd);
+                }
+                for (int i = 1; i < num_fds; i++) {
+                    if (0 != fds[i].revents) {
+                        drain_backlog(backlog_traders[i - 1]);
+                    }
+                }
+            }
+        }
+        atomic_store(flag, false);
+    }
+
+    my_free(fds);
+    my_free(backlog_traders);
+    return NULL;
+}
+
+// Set up the fan-out workers, each with its partition of the traders
+// Returns 0 on success, -1 on error
+static int init_fanout(trader **traders, int num_traders, int num_workers) {
+    engine->fanout_eventfd = eventfd(0, 0);
+    engine->workers = my_calloc(num_workers, sizeof(fanout_worker));
+    engine->events = my_calloc(FANOUT_RING_CAPACITY, sizeof(market_event));
+    if (-1 == engine->fanout_eventfd || NULL == engine->workers
+        || NULL == engine->events) {
+        return -1;
+    }
+    engine->num_workers = num_workers;
+
+    for (int i = 0; i < num_workers; i++) {
+        fanout_worker *worker = &engine->workers[i];
+        worker->index = i;
+        worker->event_eventfd = eventfd(0, 0);
+        worker->traders = my_calloc(num_traders / num_workers + 1,
+                                    sizeof(trader *));
+        if (-1 == worker->event_eventfd || NULL == worker->traders) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < num_traders; i++) {
+        fanout_worker *worker =
+            &engine->workers[traders[i]->trader_id % num_workers];
+        worker->traders[worker->num_traders++] = traders[i];
+    }
+    return 0;
+}
+
+// Start the publisher thread, the last stage of the pipeline, and the
+// fan-out workers writing its messages (none for num_workers 0)
+// Returns 0 on success, -1 on error
+int start_publisher(trader **traders, int num_traders, int num_workers) {
+    engine->traders = traders;
+    engine->num_traders = num_traders;
+    engine->publish_eventfd = eventfd(0, 0);
+    engine->retired_eventfd = eventfd(0, 0);
+    if (-1 == engine->publish_eventfd || -1 == engine->retired_eventfd) {
+        return -1;
+    }
+
+    // A worker without a trader would have nothing to write
+    if (num_workers > num_traders) {
+        num_workers = num_traders;
+    }
+    if (num_workers > 0
+        && -1 == init_fanout(traders, num_traders, num_workers)) {
+        return -1;
+    }
+    engine->is_pipelined = true;
+
+    sigset_t all_signals;
+    sigset_t old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    int status = 0;
+    for (int i = 0; i < num_workers && 0 == status; i++) {
+        status = pthread_create(&engine->workers[i].thread, NULL,
+                                run_fanout_worker, &engine->workers[i]);
+    }
+    if (0 == status) {
+        status = pthread_create(&engine->publisher, NULL, run_publisher,
+                                NULL);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (0 != status) {
+        #ifdef DEBUG
+            printf("Error in start_publisher(): pthread_create returned %d\n",
+                    status);
+        #endif
+        engine->is_pipelined = false;
+        return -1;
+    }
+    return 0;
+}
+
+// Check a command the way is_valid_decoded_command does, except that an
+// AMEND/CANCEL is only checked against the order ids the trader has used:
+// whether the order is still live is up to its matcher
+static bool is_routable_command(command *parsed, trader *current_trader,
+                                int num_products) {
+    if (AMENDED != parsed->cmd && CANCELLED != parsed->cmd) {
+        return is_valid_decoded_command(parsed, current_trader, num_products);
+    }
+
+    if (parsed->order_id < 0
+        || parsed->order_id >= current_trader->current_order_id) {
+        return false;
+    }
+    return (CANCELLED == parsed->cmd
+            || (parsed->quantity > 0 && parsed->quantity <= MAX_VALUE
+                && parsed->price > 0 && parsed->price <= MAX_VALUE));
+}
+
+// Route the command to the matcher of its product as the next job
+// A command that cannot be routed (an invalid one, PROTOCOL BINARY) is left
+// to handle_command once the jobs in flight have retired
+// Returns whether the command was submitted
+bool submit_command(char buffer[BUFFER_SIZE], trader *current_trader,
+                    trader **traders, int num_traders, int num_products) {
+    // A binary command is formatted for the log when the job retires
+    command parsed;
+    int text_len = 0;
+    if (current_trader->input.width > 0) {
+        decode_binary_command(buffer, &parsed);
+    } else if (0 == strcmp(buffer, PROTOCOL_BINARY)
+                || 1 != parse_text_command(buffer, &parsed)) {
+        parsed.cmd = INVALID;
+    } else {
+        text_len = strcspn(buffer, ";");
+    }
+
+    bool is_new_order = (ACCEPTED_BUY == parsed.cmd
+                            || ACCEPTED_SELL == parsed.cmd);
+    if (!is_routable_command(&parsed, current_trader, num_products)
+        || text_len > JOB_TEXT_SIZE) {
+        return false;
+    } else if (is_new_order
+                && parsed.order_id >= current_trader->orders_capacity) {
+        // The matchers write to the order index, it only moves while they
+        // are idle
+        pause_pipeline(traders, num_traders);
+        int status = reserve_order_index(current_trader, parsed.order_id);
+        resume_pipeline();
+        if (-1 == status) {
+            return false;
+        }
+    }
+
+    int product_id = parsed.product_id;
+    if (is_new_order) {
+        current_trader->order_products[parsed.order_id] = product_id;
+        current_trader->current_order_id += 1;
+    } else {
+        product_id = current_trader->order_products[parsed.order_id];
+    }
+
+    // Wait for room in the matcher's ring, for the job in the slot to retire
+    matcher *current_matcher = &engine->matchers[product_id
+                                                    % engine->num_matchers];
+    unsigned int head = atomic_load_explicit(&current_matcher->head,
+                                                memory_order_relaxed);
+    match_job *job = &current_matcher->jobs[head & (MATCH_RING_CAPACITY - 1)];
+    while (head - atomic_load(&current_matcher->tail) == MATCH_RING_CAPACITY) {
+        if (engine->is_pipelined) {
+            wait_for_publisher(is_retired, job->sequence + 1);
+        } else {
+            engine->fees += retire_job(traders, num_traders);
         }
+    }
 
+    job->sequence = atomic_load(&engine->next_sequence);
+    job->parsed = parsed;
+    job->owner = current_trader;
+    job->product_id = product_id;
+    memcpy(job->text, buffer, text_len);
+    job->text_len = text_len;
+
+    engine->routes[job->sequence % engine->num_routes] =
+        current_matcher->index;
+    atomic_store(&engine->next_sequence, job->sequence + 1);
+
+    // The matcher checks head after publishing done, so it is only asleep
+    // if it had matched every job before this one
+    atomic_store(&current_matcher->head, head + 1);
+    if (head == atomic_load(&current_matcher->done)) {
+        wake_peer(current_matcher->job_eventfd);
+    }
+    if (engine->is_pipelined && atomic_load(&engine->is_publisher_idle)) {
+        wake_peer(engine->publish_eventfd);
+    }
+
+    retire_commands(traders, num_traders, false);
+    return true;
+}
+
+// Retire the jobs in flight and stop the matcher threads
+// Returns the fees of all the jobs retired
+int64_t stop_matchers(trader **traders, int num_traders) {
+    if (NULL == engine) {
+        return 0;
+    }
+
+    retire_commands(traders, num_traders, true);
+    if (engine->is_pipelined) {
+        atomic_store(&engine->is_stopping, true);
+        wake_peer(engine->publish_eventfd);
+        pthread_join(engine->publisher, NULL);
+    }
+
+    // Every event has been published once the publisher is done
+    for (int i = 0; i < engine->num_workers; i++) {
+        atomic_store(&engine->workers[i].is_stopping, true);
+        wake_peer(engine->workers[i].event_eventfd);
+    }
+    for (int i = 0; i < engine->num_workers; i++) {
+        pthread_join(engine->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < engine->num_matchers; i++) {
+        atomic_store(&engine->matchers[i].is_stopping, true);
+        wake_peer(engine->matchers[i].job_eventfd);
+    }
+    for (int i = 0; i < engine->num_matchers; i++) {
+        pthread_join(engine->matchers[i].thread, NULL);
+    }
+    return engine->fees;
+}
+
+// Free the matchers' jobs and pools, once the orderbook has been freed
+// into them
+void free_matchers() {
+    if (NULL == engine) {
+        return;
+    }
+
+    for (int i = 0; i < engine->num_matchers; i++) {
+        matcher *current_matcher = &engine->matchers[i];
+        for (int j = 0; NULL != current_matcher->jobs
+                        && j < MATCH_RING_CAPACITY; j++) {
+            free_trade_batch(&current_matcher->jobs[j].trades);
+            free_book_section(&current_matcher->jobs[j].book);
+        }
+        my_free(current_matcher->jobs);
+        close(current_matcher->job_eventfd);
+        close(current_matcher->done_eventfd);
+        free_pool(&current_matcher->order_pool);
+        free_pool(&current_matcher->level_pool);
+    }
+
+    for (int i = 0; NULL != engine->books && i < engine->num_products; i++) {
+        free_book_section(&engine->books[i]);
+    }
+    my_free(engine->books);
+    my_free(engine->routes);
+    if (engine->is_pipelined) {
+        close(engine->publish_eventfd);
+        close(engine->retired_eventfd);
+    }
+
+    for (int i = 0; i < engine->num_workers; i++) {
+        close(engine->workers[i].event_eventfd);
+        my_free(engine->workers[i].traders);
+    }
+    for (int i = 0; NULL != engine->events && i < FANOUT_RING_CAPACITY; i++) {
+        my_free(engine->events[i].messages);
+    }
+    if (engine->num_workers > 0) {
+        close(engine->fanout_eventfd);
+    }
+    my_free(engine->workers);
+    my_free(engine->events);
+    my_free(engine->matchers);
+    my_free(engine);
+    engine = NULL;
+}
+
+// Process one command on the calling thread and print the market
+// Returns the fees collected by the exchange
+static int64_t process_inline_command(char buffer[BUFFER_SIZE],
+                                        trader *current_trader,
+                                        trader **traders, int num_traders,
+                                        product_order **orderbook,
+                                        int num_products) {
+    command parsed;
+    if (current_trader->input.width > 0) {
+        // Binary commands are logged the way they are written as text
+        decode_binary_command(buffer, &parsed);
+        char text[BUFFER_SIZE] = {0};
+        format_command(&parsed, text);
+        log_parsing(current_trader, text, strlen(text));
+        if (!is_valid_decoded_command(&parsed, current_trader, num_products)) {
+            parsed.cmd = INVALID;
+        }
+    } else if (0 == strcmp(buffer, PROTOCOL_BINARY)
+                && 0 == current_trader->current_order_id) {
+        // The trader switches to binary commands before its first order
+        log_parsing(current_trader, buffer, strcspn(buffer, ";"));
+        if (-1 == negotiate_binary(current_trader, num_products)) {
+            #ifdef DEBUG
+                printf("Error in handle_command(): negotiate_binary returned -1\n");
+            #endif
+        }
+        flush_outbound(current_trader, traders, num_traders);
+        #ifdef TESTING
+            send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
+        #endif
+        return 0;
+    } else {
         // Determine whether the command is valid or not
-        enum order_state cmd = get_command(buffer, current_trader, orderbook,
+        get_command(buffer, &parsed, current_trader, orderbook, num_products);
+    }
+
+    enum order_state cmd = parsed.cmd;
+    if (INVALID == cmd) {
+        respond_invalid(current_trader);
+        flush_outbound(current_trader, traders, num_traders);
+        #ifdef TESTING
+            send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
+        #endif
+        return 0;
+    }
+
+    // Process the (valid) command
+    // A command that could not be applied (eg. the pools are exhausted) is
+    // rejected
+    order *new_order = process_command(&parsed, current_trader, orderbook,
+                                        num_products);
+    if (NULL == new_order) {
+        respond_invalid(current_trader);
+        flush_outbound(current_trader, traders, num_traders);
+        #ifdef TESTING
+            send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
+        #endif
+        return 0;
+    }
+
+    // Respond to trader
+    respond_to_trader(new_order->order_id, current_trader, cmd);
+
+    // Write market response to all pipes
+    notify_all_traders(cmd, new_order, current_trader, traders,
+                        orderbook, num_products, num_traders);
+
+    // Check whether there is an order match, collect fees
+    int64_t fees = check_order_match(&parsed, current_trader, orderbook,
+                                        num_products);
+
+    // Send the responses, MARKET and FILL messages of the event
+    flush_outbound(current_trader, traders, num_traders);
+
+    print_orderbook(orderbook, num_products);
+    print_positions(traders, num_traders);
+
+    flush_log();
+
+    #ifdef TESTING
+        nanosleep((const struct timespec[]){{0, TIME_250MS}}, NULL);
+        send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
+    #endif
+
+    return fees;
+}
+
+// Process one command read from the trader and print the market
+// Returns the fees collected by the exchange
+int64_t handle_command(char buffer[BUFFER_SIZE], trader *current_trader,
+                        trader **traders, int num_traders,
+                        product_order **orderbook, int num_products) {
+    // With matcher threads the command is matched on its product's thread,
+    // the fees are collected when it retires
+    if (NULL != engine && submit_command(buffer, current_trader, traders,
+                                            num_traders, num_products)) {
+        return 0;
+    }
+
+    // Anything else runs here once the commands in flight have retired
+    pause_pipeline(traders, num_traders);
+    int64_t fees = process_inline_command(buffer, current_trader, traders,
+                                            num_traders, orderbook,
                                             num_products);
-        if (INVALID == cmd) {
-            respond_invalid(current_trader);
-            #ifdef TESTING
-                send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
+    resume_pipeline();
+    return fees;
+}
+
+// Disconnect a trader whose process has exited
+void handle_disconnect(trader *current_trader, trader **traders,
+                        int num_traders) {
+    // The trader's commands in flight come first
+    pause_pipeline(traders, num_traders);
+
+    log_printf("%s Trader %d disconnected\n", LOG_PREFIX,
+            current_trader->trader_id);
+    disconnect_trader(current_trader);
+    num_current_traders--;
+
+    #ifdef TESTING
+        nanosleep((const struct timespec[]){{0, TIME_500MS}}, NULL);
+        send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
+    #endif
+    resume_pipeline();
+}
+
+// Disconnect the traders cut off since the last call, at the top of each
+// turn of the loops
+void disconnect_cut_off_traders(trader **traders, int num_traders) {
+    if (!atomic_exchange(&has_cut_off_traders, false)) {
+        return;
+    }
+
+    for (int i = 0; i < num_traders; i++) {
+        if (traders[i]->is_connected && atomic_load(&traders[i]->is_cut_off)) {
+            handle_disconnect(traders[i], traders, num_traders);
+        }
+    }
+}
+
+// Run the market, reading one command per SIGUSR1
+// Returns the fees collected by the exchange
+int64_t run_signal_loop(sigset_t *queue_mask, trader **traders,
+                        int num_traders, product_order **orderbook,
+                        int num_products) {
+    int64_t fees = 0;
+    char buffer[BUFFER_SIZE] = {0};
+
+    // A SIGUSR1 whose command came in with an earlier chunk, or one the
+    // auto-trader re-sent after its timeout, has nothing left to read
+    for (int i = 0; i < num_traders; i++) {
+        int fd = traders[i]->t2e_fd_rdonly;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    // Pipes of the traders with a backlog, waited on for room
+    struct pollfd *backlog_fds = my_calloc(num_traders, sizeof(struct pollfd));
+    trader **backlog_traders = my_calloc(num_traders, sizeof(trader *));
+
+    while (num_current_traders > 0) {
+        // Nothing is left in flight while waiting for the next signal
+        if (is_queue_empty(&my_queue)) {
+            retire_commands(traders, num_traders, true);
+        }
+        disconnect_cut_off_traders(traders, num_traders);
+        if (0 == num_current_traders) {
+            break;
+        }
+
+        // The publisher thread drains the backlogs in pipeline mode
+        int num_backlogs = 0;
+        for (int i = 0; i < num_traders && owns_output(); i++) {
+            if (traders[i]->is_connected && has_backlog(&traders[i]->output)) {
+                backlog_fds[num_backlogs] = get_backlog_pollfd(traders[i]);
+                backlog_traders[num_backlogs] = traders[i];
+                num_backlogs++;
+            }
+        }
+
+        // Wait for SIGUSR1/SIGCHLD, or room in a pipe with a backlog
+        // Check the queue with the handlers blocked so a signal cannot
+        // arrive between the check and the wait
+        sigset_t wait_mask;
+        sigprocmask(SIG_BLOCK, queue_mask, &wait_mask);
+        int num_ready = 0;
+        if (is_queue_empty(&my_queue)) {
+            num_ready = ppoll(backlog_fds, num_backlogs, NULL, &wait_mask);
+        }
+        sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+
+        for (int i = 0; i < num_backlogs && num_ready > 0; i++) {
+            if (0 != backlog_fds[i].revents) {
+                drain_backlog(backlog_traders[i]);
+            }
+        }
+
+        signal_record current_signal = {0};
+        if (!dequeue(&my_queue, &current_signal)) {
+            continue;
+        }
+
+        trader *current_trader = get_trader_id(current_signal.pid);
+        if (NULL == current_trader) {
+            #ifdef DEBUG
+                printf("Error: trader is NULL\n");
             #endif
-            memset(buffer, 0, BUFFER_SIZE);
+            return -1;
+        }
+
+        // A trader cut off earlier is already disconnected
+        if (!current_trader->is_connected) {
+            continue;
+        }
+
+        // Trader disconnection
+        if (SIGCHLD == current_signal.signal) {
+            handle_disconnect(current_trader, traders, num_traders);
+            continue;
+        }
+
+        // Trader wrote to the pipe (send SIGUSR1)
+        if (1 != read_command(current_trader, buffer)) {
             continue;
         }
+        fees += handle_command(buffer, current_trader, traders, num_traders,
+                                orderbook, num_products);
+    }
+
+    my_free(backlog_fds);
+    my_free(backlog_traders);
+    return fees;
+}
 
-        // Process the (valid) command
-        order *new_order = process_command(cmd, buffer, current_trader,
-                                            orderbook, num_products);
+// Process every complete command waiting in the trader's pipe
+// Returns -1 once the trader has closed the pipe
+static int drain_trader(trader *current_trader, trader **traders,
+                        int num_traders, product_order **orderbook,
+                        int num_products, int64_t *fees) {
+    char buffer[BUFFER_SIZE] = {0};
+    int status = 0;
 
-        // Respond to trader
-        respond_to_trader(new_order->order_id, current_trader, cmd);
+    // Consume the wakeups first, a later write posts a new one
+    if (NULL != current_trader->channel) {
+        wait_for_peer(current_trader->eventfds.t2e);
+    }
 
-        // Write market response to all pipes
-        notify_all_traders(cmd, new_order, current_trader, traders,
-                            orderbook, num_products, num_traders);
+    while (1 == (status = read_command(current_trader, buffer))) {
+        *fees += handle_command(buffer, current_trader, traders, num_traders,
+                                orderbook, num_products);
+    }
+    return status;
+}
 
-        if (CANCEL == new_order->type) {
-            my_free(new_order);
+// Reap exited traders, processing what is left in their pipes first
+// wait_pid is a pid from SIGCHLD, or -1 for any trader that has exited
+static void reap_traders(pid_t wait_pid, int epoll_fd, trader **traders,
+                            int num_traders, product_order **orderbook,
+                            int num_products, int64_t *fees) {
+    pid_t pid = 0;
+    while ((pid = waitpid(wait_pid, NULL, WNOHANG)) > 0) {
+        trader *current_trader = get_trader_id(pid);
+        if (NULL == current_trader || !current_trader->is_connected) {
+            continue;
         }
 
-        // Check whether there is an order match, collect fees
-        exchange_fees_collected += check_order_match(cmd, buffer, current_trader,
-                                                        orderbook, num_products);
+        if (-1 == drain_trader(current_trader, traders, num_traders,
+                                orderbook, num_products, fees)) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, current_trader->t2e_fd_rdonly,
+                        NULL);
+        }
+        handle_disconnect(current_trader, traders, num_traders);
+    }
+}
 
-        print_orderbook(orderbook, num_products);
-        print_positions(traders, num_traders);
+// Run the market from readiness of the trader pipes
+// Pipes are read non-blocking and drained on every wakeup, so commands are
+// not lost when SIGUSR1s coalesce. Exits come from a signalfd for SIGCHLD
+// Returns the fees collected by the exchange
+int64_t run_event_loop(sigset_t *queue_mask, trader **traders,
+                        int num_traders, product_order **orderbook,
+                        int num_products) {
+    int64_t fees = 0;
 
-        fflush(stdout);
+    // SIGUSR1 is left pending and SIGCHLD is read from the signalfd
+    sigprocmask(SIG_BLOCK, queue_mask, NULL);
 
-        memset(buffer, 0, BUFFER_SIZE);
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+    int signal_fd = signalfd(-1, &child_mask, SFD_NONBLOCK);
+    int epoll_fd = epoll_create1(0);
+    if (-1 == signal_fd || -1 == epoll_fd) {
+        #ifdef DEBUG
+            printf("Error in run_event_loop(): errno: %s (%d)\n",
+                    strerror(errno), errno);
+        #endif
+        return -1;
+    }
 
-        #ifdef TESTING
-            nanosleep((const struct timespec[]){{0, TIME_250MS}}, NULL);
-            send_sigusr2_to_all_traders(traders, num_traders, SIGUSR2);
+    // The signalfd is registered as EPOLL_SIGNAL_DATA, traders with their
+    // index
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = EPOLL_SIGNAL_DATA;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+
+    // With the shared-memory transport the trader's eventfd is watched
+    for (int i = 0; i < num_traders; i++) {
+        int fd = traders[i]->t2e_fd_rdonly;
+        if (NULL != traders[i]->channel) {
+            fd = traders[i]->eventfds.t2e;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+        // A full pipe (or ring) reports when the trader has read from it
+        struct pollfd backlog_fd = get_backlog_pollfd(traders[i]);
+        event.events = ((POLLOUT == backlog_fd.events) ? EPOLLOUT : EPOLLIN)
+                        | EPOLLET;
+        event.data.u64 = EPOLL_WRITE_FLAG | i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, backlog_fd.fd, &event);
+    }
+
+    // Traders may have exited before SIGCHLD was blocked
+    reap_traders(-1, epoll_fd, traders, num_traders, orderbook, num_products,
+                    &fees);
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (num_current_traders > 0) {
+        retire_commands(traders, num_traders, true);
+        disconnect_cut_off_traders(traders, num_traders);
+        if (0 == num_current_traders) {
+            break;
+        }
+        int num_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (-1 == num_events) {
+            if (EINTR == errno) {
+                continue;
+            }
+            #ifdef DEBUG
+                printf("Error in run_event_loop(): epoll_wait returned -1, \
+                        errno: %s (%d)\n", strerror(errno), errno);
+            #endif
+            break;
+        }
+
+        // Commands are processed before exits seen in the same wakeup
+        bool is_child_exit = false;
+        for (int i = 0; i < num_events; i++) {
+            uint64_t data = events[i].data.u64;
+            if (EPOLL_SIGNAL_DATA == data) {
+                is_child_exit = true;
+                continue;
+            } else if (data & EPOLL_WRITE_FLAG) {
+                if (owns_output()) {
+                    drain_backlog(traders[data & ~EPOLL_WRITE_FLAG]);
+                }
+                continue;
+            }
+
+            // A cut off trader's eventfd is still watched, its pipe was
+            // closed
+            trader *current_trader = traders[data];
+            if (!current_trader->is_connected) {
+                if (NULL != current_trader->channel) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL,
+                                current_trader->eventfds.t2e, NULL);
+                }
+                continue;
+            }
+            if (-1 == drain_trader(current_trader, traders, num_traders,
+                                    orderbook, num_products, &fees)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL,
+                            current_trader->t2e_fd_rdonly, NULL);
+            }
+        }
+
+        if (is_child_exit) {
+            // Disconnect in the order the exits were signalled, then sweep
+            // for exits whose SIGCHLD coalesced with another
+            struct signalfd_siginfo info;
+            while (sizeof(info) == read(signal_fd, &info, sizeof(info))) {
+                reap_traders(info.ssi_pid, epoll_fd, traders, num_traders,
+                                orderbook, num_products, &fees);
+            }
+            reap_traders(-1, epoll_fd, traders, num_traders, orderbook,
+                            num_products, &fees);
+        }
+    }
+
+    close(epoll_fd);
+    close(signal_fd);
+    return fees;
+}
+
+#ifdef IO_URING
+// Queue the next read of the trader's pipe into its input buffer, or a poll
+// of its eventfd with shared memory
+static void arm_trader_read(uring_loop *loop, trader *current_trader) {
+    uint64_t user_data = current_trader->trader_id;
+    if (NULL != current_trader->channel) {
+        prep_poll(&loop->ring, current_trader->eventfds.t2e, POLLIN,
+                    user_data);
+        return;
+    }
+
+    frame_reader *reader = &current_trader->input;
+    int room = compact_frames(reader);
+    prep_read(&loop->ring, current_trader->t2e_fd_rdonly,
+                reader->buffer + reader->len, room, user_data);
+}
+
+static void handle_completion(uring_loop *loop, struct io_uring_cqe *cqe,
+                                trader **traders, int num_traders,
+                                product_order **orderbook, int num_products,
+                                int64_t *fees);
+
+// Take the first deferred completion with the given user_data
+static bool take_deferred(uring_loop *loop, uint64_t user_data,
+                            struct io_uring_cqe *cqe) {
+    for (int i = 0; i < loop->num_deferred; i++) {
+        if (user_data != loop->deferred[i].user_data) {
+            continue;
+        }
+        *cqe = loop->deferred[i];
+        loop->num_deferred -= 1;
+        memmove(loop->deferred + i, loop->deferred + i + 1,
+                (loop->num_deferred - i) * sizeof(struct io_uring_cqe));
+        return true;
+    }
+    return false;
+}
+
+// Handle the reads of an exited trader until its pipe reaches end of file
+// Other traders' completions are deferred
+static void finish_trader_reads(uring_loop *loop, trader *current_trader,
+                                trader **traders, int num_traders,
+                                product_order **orderbook, int num_products,
+                                int64_t *fees) {
+    uint64_t user_data = current_trader->trader_id;
+    struct io_uring_cqe cqe;
+    while (current_trader->is_connected) {
+        if (!take_deferred(loop, user_data, &cqe)) {
+            struct io_uring_cqe *next = peek_cqe(&loop->ring);
+            if (NULL == next) {
+                if (-1 == submit_uring(&loop->ring, 1)) {
+                    return;
+                }
+                continue;
+            }
+            cqe = *next;
+            cqe_seen(&loop->ring);
+            if (user_data != cqe.user_data) {
+                loop->deferred[loop->num_deferred++] = cqe;
+                continue;
+            }
+        }
+        handle_completion(loop, &cqe, traders, num_traders, orderbook,
+                            num_products, fees);
+    }
+}
+
+// Disconnect reaped traders
+// A trader on the pipes has its remaining commands read first, so nothing
+// is sent to it after it has been reaped
+static void reap_uring_traders(pid_t wait_pid, uring_loop *loop,
+                                trader **traders, int num_traders,
+                                product_order **orderbook, int num_products,
+                                int64_t *fees) {
+    pid_t pid = 0;
+    while ((pid = waitpid(wait_pid, NULL, WNOHANG)) > 0) {
+        trader *current_trader = get_trader_id(pid);
+        if (NULL == current_trader || !current_trader->is_connected) {
+            continue;
+        }
+
+        uring_slot *slot = &loop->slots[current_trader->trader_id];
+        slot->has_exited = true;
+        if (NULL != current_trader->channel) {
+            drain_trader(current_trader, traders, num_traders, orderbook,
+                            num_products, fees);
+            handle_disconnect(current_trader, traders, num_traders);
+        } else if (slot->is_closed) {
+            handle_disconnect(current_trader, traders, num_traders);
+        } else {
+            finish_trader_reads(loop, current_trader, traders, num_traders,
+                                orderbook, num_products, fees);
+        }
+    }
+}
+
+// Get the next completion, deferred ones first
+static bool next_completion(uring_loop *loop, struct io_uring_cqe *cqe) {
+    if (loop->num_deferred > 0) {
+        return take_deferred(loop, loop->deferred[0].user_data, cqe);
+    }
+
+    struct io_uring_cqe *next = peek_cqe(&loop->ring);
+    if (NULL == next) {
+        return false;
+    }
+    *cqe = *next;
+    cqe_seen(&loop->ring);
+    return true;
+}
+
+// Handle a completed read of a trader pipe or of the signalfd
+static void handle_completion(uring_loop *loop, struct io_uring_cqe *cqe,
+                                trader **traders, int num_traders,
+                                product_order **orderbook, int num_products,
+                                int64_t *fees) {
+    // Disconnect in the order the exits were signalled, then sweep for exits
+    // whose SIGCHLD coalesced with another
+    if (URING_SIGNAL_DATA == cqe->user_data) {
+        if (cqe->res > 0) {
+            reap_uring_traders(loop->child_info.ssi_pid, loop, traders,
+                                num_traders, orderbook, num_products, fees);
+        }
+        reap_uring_traders(-1, loop, traders, num_traders, orderbook,
+                            num_products, fees);
+        prep_read(&loop->ring, loop->signal_fd, &loop->child_info,
+                    sizeof(loop->child_info), URING_SIGNAL_DATA);
+        return;
+    } else if (cqe->user_data & URING_POLL_FLAG) {
+        // The pipe has room for more of the backlog
+        trader *current_trader = traders[cqe->user_data & ~URING_POLL_FLAG];
+        loop->slots[current_trader->trader_id].is_polling = false;
+        if (owns_output()) {
+            drain_backlog(current_trader);
+            poll_backlog(loop, current_trader);
+        }
+        return;
+    }
+
+    trader *current_trader = traders[cqe->user_data];
+    uring_slot *slot = &loop->slots[cqe->user_data];
+    if (!current_trader->is_connected) {
+        return;
+    }
+
+    // The eventfd is readable, the commands are in the ring
+    if (NULL != current_trader->channel) {
+        drain_trader(current_trader, traders, num_traders, orderbook,
+                        num_products, fees);
+        arm_trader_read(loop, current_trader);
+        return;
+    }
+
+    if (cqe->res > 0) {
+        // The chunk was read straight into the input buffer
+        current_trader->input.len += cqe->res;
+        char buffer[BUFFER_SIZE] = {0};
+        while (1 == take_frame(&current_trader->input, buffer)) {
+            *fees += handle_command(buffer, current_trader, traders,
+                                    num_traders, orderbook, num_products);
+        }
+        arm_trader_read(loop, current_trader);
+    } else if (-EINTR == cqe->res || -EAGAIN == cqe->res) {
+        arm_trader_read(loop, current_trader);
+    } else {
+        // End of file, the trader has closed its end
+        slot->is_closed = true;
+        if (slot->has_exited) {
+            handle_disconnect(current_trader, traders, num_traders);
+        }
+    }
+}
+
+// Run the market on io_uring
+// Reads stay outstanding on every trader pipe and complete straight into
+// the input buffers, each event's writes go out as one batch. A wakeup is
+// one io_uring_enter rather than an epoll_wait plus a read per pipe
+// Returns the fees collected by the exchange
+int64_t run_uring_loop(sigset_t *queue_mask, trader **traders,
+                        int num_traders, product_order **orderbook,
+                        int num_products) {
+    int64_t fees = 0;
+
+    // SIGUSR1 is left pending and SIGCHLD is read from the signalfd
+    sigprocmask(SIG_BLOCK, queue_mask, NULL);
+
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+
+    uring_loop loop = {0};
+    loop.signal_fd = signalfd(-1, &child_mask, 0);
+    loop.slots = my_calloc(num_traders, sizeof(uring_slot));
+    loop.deferred = my_calloc(2 * num_traders + 1,
+                                sizeof(struct io_uring_cqe));
+
+    // Room for a read, a write and a poll per trader, and the signalfd read
+    if (-1 == loop.signal_fd || NULL == loop.slots || NULL == loop.deferred
+        || -1 == init_uring(&loop.ring, 3 * num_traders + 1)) {
+        #ifdef DEBUG
+            printf("Error in run_uring_loop(): errno: %s (%d)\n",
+                    strerror(errno), errno);
         #endif
+        my_free(loop.slots);
+        my_free(loop.deferred);
+        return -1;
+    }
+    uring_state = &loop;
+
+    for (int i = 0; i < num_traders; i++) {
+        arm_trader_read(&loop, traders[i]);
+    }
+    prep_read(&loop.ring, loop.signal_fd, &loop.child_info,
+                sizeof(loop.child_info), URING_SIGNAL_DATA);
+
+    // Traders may have exited before SIGCHLD was blocked
+    reap_uring_traders(-1, &loop, traders, num_traders, orderbook,
+                        num_products, &fees);
+
+    while (num_current_traders > 0) {
+        // Submit the new reads and wait for a completion
+        retire_commands(traders, num_traders, true);
+        disconnect_cut_off_traders(traders, num_traders);
+        if (0 == num_current_traders) {
+            break;
+        }
+        if (0 == loop.num_deferred && -1 == submit_uring(&loop.ring, 1)) {
+            break;
+        }
+
+        struct io_uring_cqe cqe;
+        while (num_current_traders > 0 && next_completion(&loop, &cqe)) {
+            handle_completion(&loop, &cqe, traders, num_traders, orderbook,
+                                num_products, &fees);
+        }
+    }
+
+    uring_state = NULL;
+    free_uring(&loop.ring);
+    close(loop.signal_fd);
+    my_free(loop.slots);
+    my_free(loop.deferred);
+    return fees;
+}
+#endif
+
+#ifndef UNIT_TEST
+int main(int argc, char **argv) {
+    char product_filename[BUFFER_SIZE] = {0};
+    char testing_filename[BUFFER_SIZE] = {0};
+
+    // Select the transport, the loop and the threads
+    exchange_options options;
+    if (-1 == parse_options(&argc, &argv, &options)) {
+        return -1;
+    }
+    bool is_shm = options.is_shm;
+    bool is_event_loop = options.is_event_loop;
+    bool is_log_thread = options.is_log_thread;
+    bool is_pipelined = options.is_pipelined;
+    int num_workers = options.num_workers;
+    int num_matchers = options.num_matchers;
+    int pool_capacity = options.pool_capacity;
+
+    // The shared-memory transport is announced to the traders through the
+    // environment
+    if (is_shm) {
+        setenv(TRANSPORT_ENV, TRANSPORT_SHM, 1);
+    } else {
+        unsetenv(TRANSPORT_ENV);
     }
 
-    printf("%s Trading completed\n", LOG_PREFIX); //
-    printf("%s Exchange fees collected: $%lld\n", LOG_PREFIX,
-            exchange_fees_collected);
+    // Size the object pools
+    if (-1 == init_pools(pool_capacity)) {
+        return -1;
+    }
+
+    // Read the traders from a file, ./spx_exchange -t traders <products> ...
+    char *trader_file = options.trader_file;
+    char **loaded_argv = NULL;
+    char *trader_file_contents = NULL;
+    if (NULL != trader_file) {
+        loaded_argv = load_trader_file(trader_file, &argc, argv,
+                                        &trader_file_contents);
+        if (NULL == loaded_argv) {
+            return -1;
+        }
+        argv = loaded_argv;
+    }
+
+    // Pass in the arguments to spx_exchange
+    char **trader_filenames = my_calloc(argc, sizeof(char *));
+    if (NULL == trader_filenames) {
+        return -1;
+    }
+    int num_traders = exchange_parse_args(argc, argv, product_filename,
+                                            trader_filenames, testing_filename);
+    if (-1 == num_traders) {
+        return -1;
+    }
+
+    // Every trader holds two pipes open
+    raise_fd_limit(num_traders);
+
+    printf("%s Starting\n", LOG_PREFIX);
+
+    // Mask of the signals whose handlers write to the signal queue
+    // The handlers block each other so there is only ever one producer
+    sigset_t queue_mask;
+    sigemptyset(&queue_mask);
+    sigaddset(&queue_mask, SIGUSR1);
+    sigaddset(&queue_mask, SIGCHLD);
+
+    // Register sighandler for SIGUSR1
+    struct sigaction sigusr1;
+    memset(&sigusr1, 0, sizeof(struct sigaction));
+    sigusr1.sa_sigaction = sigusr1_handler;
+    sigusr1.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigusr1.sa_mask = queue_mask;
+    sigaction(SIGUSR1, &sigusr1, NULL);
+
+    // Register sighandler for SIGCHLD
+    struct sigaction sigchild;
+    memset(&sigchild, 0, sizeof(struct sigaction));
+    sigchild.sa_sigaction = sigchild_handler;
+    sigchild.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigchild.sa_mask = queue_mask;
+    sigaction(SIGCHLD, &sigchild, NULL);
+
+    // A trader that has closed its pipe fails the write with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    // Get the products from the products file
+    int num_products = -1;
+    enum book_mode *modes = NULL;
+    char **products = get_products(product_filename, &num_products, &modes);
+
+    if (-1 == num_products) {
+        return -1;
+    }
+
+    // Print out the products from the products file
+    print_products(products, num_products);
+
+    // Intern the product names
+    if (-1 == init_symbol_table(products, num_products)) {
+        return -1;
+    }
+
+    // Get the names of the named pipes for the traders
+    char **e2t_pipenames = my_calloc(num_traders, sizeof(char *));
+    char **t2e_pipenames = my_calloc(num_traders, sizeof(char *));
+    if (-1 == get_pipes(e2t_pipenames, t2e_pipenames, num_traders)) {
+        return -1;
+    }
+
+    unlink_pipes(e2t_pipenames, num_traders);
+    unlink_pipes(t2e_pipenames, num_traders);
+
+    // Initialise the orderbook
+    product_order **orderbook = my_calloc(num_products, sizeof(product_order *));
+    init_orderbook(orderbook, products, modes, num_products);
+    my_free(modes);
+
+    // Launch the traders
+    trader **traders = launch_traders(trader_filenames, e2t_pipenames,
+                                        t2e_pipenames, num_traders, products,
+                                        num_products, testing_filename);
+
+    sleep(1);
+
+    // The log is formatted on a thread of its own, ./spx_exchange [-l] <...>
+    // It is started after the fork()s, the lines before are printed as is
+    if (is_log_thread && -1 == start_log(stdout)) {
+        return -1;
+    }
+
+    // From here on every exit goes through stop_exchange, which stops the
+    // log so its lines are written
+    int status = -1;
+    int64_t exchange_fees_collected = 0;
+
+    // The matchers are started after the fork()s
+    if (num_matchers > 0 && -1 == start_matchers(num_matchers, pool_capacity,
+                                                    orderbook, num_products)) {
+        goto stop_exchange;
+    }
+
+    num_current_traders = num_traders;
+
+    // Open the market
+    open_market(traders, num_traders);
+
+    // The publisher writes to the traders from here on
+    if (is_pipelined
+        && -1 == start_publisher(traders, num_traders, num_workers)) {
+        goto stop_exchange;
+    }
+
+    // MAIN PROGRAM LOOP
+    if (is_event_loop) {
+        #ifdef IO_URING
+            exchange_fees_collected = run_uring_loop(&queue_mask, traders,
+                                                        num_traders, orderbook,
+                                                        num_products);
+        #else
+            exchange_fees_collected = run_event_loop(&queue_mask, traders,
+                                                        num_traders, orderbook,
+                                                        num_products);
+        #endif
+    } else {
+        exchange_fees_collected = run_signal_loop(&queue_mask, traders,
+                                                    num_traders, orderbook,
+                                                    num_products);
+    }
+    if (-1 == exchange_fees_collected) {
+        goto stop_exchange;
+    }
+    exchange_fees_collected += stop_matchers(traders, num_traders);
+
+    print_slow_traders(traders, num_traders);
+    log_printf("%s Trading completed\n", LOG_PREFIX); //
+    log_printf("%s Exchange fees collected: $%lld\n", LOG_PREFIX,
+                exchange_fees_collected);
+    status = 0;
+
+stop_exchange:
+    stop_log();
+    if (-1 == status) {
+        return -1;
+    }
 
     // Clean up memory, close pipes
     free_all(e2t_pipenames, t2e_pipenames, products, num_products,
                 traders, num_traders);
     free_orderbook(orderbook, num_products);
-    my_free(my_queue);
+    free_matchers();
+    free_symbol_table();
+    free_positions();
+    free_trade_batch(&trades);
+    free_pools();
+    my_free(trader_filenames);
+    my_free(loaded_argv);
+    my_free(trader_file_contents);
 
     sleep(1);
 
@@ -2,11 +2,24 @@
 #define SPX_EXCHANGE_H
 
 #include "spx_common.h"
+#include "spx_log.h"
 #include <inttypes.h>
 #include <errno.h>
 #include <math.h>
 #include <limits.h>
 #include <ctype.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#ifdef IO_URING
+    #include "spx_uring.h"
+#endif
 
 #define STRLEN_AMEND (5)
 #define STRLEN_CANCEL (6)
@@ -16,23 +29,448 @@
 #define int64_t long long int
 
 enum order_state {INVALID, AMENDED, CANCELLED, ACCEPTED_BUY, ACCEPTED_SELL};
+enum book_mode {SORTED_BOOK, LADDER_BOOK};
 
+#define INITIAL_LEVEL_CAPACITY (16)
+#define INITIAL_ORDER_CAPACITY (64)
+#define LADDER_WINDOW (1024)
+#define LADDER_MAX_WINDOW (1 << 14)
+#define LADDER_KEYWORD "ladder"
+#define BITS_PER_WORD (64)
+#define TRADE_BATCH_CAPACITY (256)
+#define SIGNAL_RING_CAPACITY (1 << 14)
+#define DEFAULT_POOL_CAPACITY (1024)
+#define EXCHANGE_OPTIONS "+selpf:m:c:t:"
+#define SHM_TRANSPORT_FLAG 's'
+#define EVENT_LOOP_FLAG 'e'
+#define LOG_THREAD_FLAG 'l'
+#define PIPELINE_FLAG 'p'
+#define FANOUT_THREADS_FLAG 'f'
+#define MATCHER_THREADS_FLAG 'm'
+#define POOL_CAPACITY_FLAG 'c'
+#define TRADER_FILE_FLAG 't'
+#define TRADER_FILE_COMMENT '#'
+#define FDS_PER_TRADER (4)
+#define MATCH_RING_CAPACITY (64)
+#define JOB_TEXT_SIZE (64)
+#define FANOUT_RING_CAPACITY (64)
+#define FANOUT_MESSAGE_SIZE (64)
+#define MAX_EPOLL_EVENTS (64)
+#define MAX_VALUE (999999)
+#define EPOLL_SIGNAL_DATA (UINT64_MAX)
+#define EPOLL_WRITE_FLAG (1ULL << 32)
+#define URING_SIGNAL_DATA (UINT64_MAX)
+#define URING_WRITE_FLAG (1ULL << 32)
+#define URING_POLL_FLAG (1ULL << 33)
+
+typedef struct exchange_options exchange_options;
+typedef struct signal_record signal_record;
+typedef struct signal_ring signal_ring;
+typedef struct object_pool object_pool;
+typedef struct symbol_table symbol_table;
+typedef struct trader_registry trader_registry;
+typedef struct position_matrix position_matrix;
+typedef struct price_level price_level;
+typedef struct price_ladder price_ladder;
+typedef struct book_side book_side;
+typedef struct level_cursor level_cursor;
+typedef struct level_record level_record;
+typedef struct book_section book_section;
 typedef struct product_order product_order;
+typedef struct trade trade;
+typedef struct trade_batch trade_batch;
+typedef struct command command;
+typedef struct match_job match_job;
+typedef struct matcher matcher;
+typedef struct direct_message direct_message;
+typedef struct market_event market_event;
+typedef struct fanout_worker fanout_worker;
+typedef struct match_engine match_engine;
+typedef struct uring_slot uring_slot;
+typedef struct uring_loop uring_loop;
+
+// The command line options, given before the products file
+struct exchange_options {
+    bool is_shm;
+    bool is_event_loop;
+    bool is_log_thread;
+    bool is_pipelined;
+    int num_workers;
+    int num_matchers;
+    int pool_capacity;
+    // File listing the traders to launch, NULL if not given
+    char *trader_file;
+};
+
+// The fields of a command, decoded from either protocol
+// product_id is -1 for AMEND/CANCEL
+struct command {
+    enum order_state cmd;
+    int order_id;
+    int product_id;
+    int quantity;
+    int price;
+};
+
+// A signal received by the exchange and the pid of its sender
+struct signal_record {
+    pid_t pid;
+    int signal;
+};
+
+// Single-producer/single-consumer ring of received signals
+// The signal handlers produce, the main loop consumes
+// head and tail count records ever written/read, the capacity is a power of 2
+struct signal_ring {
+    signal_record records[SIGNAL_RING_CAPACITY];
+    atomic_uint head;
+    atomic_uint tail;
+};
+
+// Fixed-size objects handed out from a free list
+// Objects are carved out of chunks of `chunk_size` objects
+struct object_pool {
+    size_t object_size;
+    int chunk_size;
+    bool growable;
+
+    void *free_list;
+    int num_free;
+
+    void **chunks;
+    int num_chunks;
+};
+
+// Interns each product name to a dense product id
+// Open addressing hash table with linear probing
+struct symbol_table {
+    char **names;
+    int num_symbols;
+
+    int *slots;
+    int capacity;
+};
+
+// Finds the trader that sent a signal by its pid
+// Open addressing hash table with linear probing, slots hold indices into
+// traders
+struct trader_registry {
+    trader **traders;
+    int num_traders;
+
+    int *slots;
+    int capacity;
+};
+
+// The positions of every trader on every product
+// Stored row-major as [trader][product] in one contiguous array
+struct position_matrix {
+    int num_traders;
+    int num_products;
+
+    position *cells;
+
+    // The product names and the arguments of a trader's LOG_TRADER record
+    char *product_names;
+    int product_names_len;
+    long long *row_args;
+};
+
+// All the resting orders at one price, in time priority
+struct price_level {
+    int price;
+    int64_t total_quantity;
+    int num_orders;
+
+    order *head;
+    order *tail;
+};
+
+// Levels indexed directly by price over a window of prices
+// The bitmap marks the non-empty slots, best is the slot of the best level
+// (-1 when empty). base_price is -1 until the first price positions it
+struct price_ladder {
+    int base_price;
+    int window;
+    int best;
+    int num_levels;
+
+    price_level **slots;
+    uint64_t *bitmap;
+};
+
+// The BUY or SELL levels of a product
+// SORTED_BOOK: levels are sorted from worst to best price (best level last)
+// LADDER_BOOK: levels are stored in a price ladder, whose window grows up to
+// LADDER_MAX_WINDOW; the levels outside the window are kept sorted in levels
+// best_price (0 when empty), num_levels and total_quantity are kept up to
+// date on every insert, fill and delete
+struct book_side {
+    enum order_type type;
+    enum book_mode mode;
+
+    int best_price;
+    int64_t total_quantity;
+
+    price_level **levels;
+    int num_levels;
+    int capacity;
+
+    price_ladder ladder;
+};
+
+// One fill between a resting order and the new (aggressing) order
+// Copies what is needed after matching, as the orders may have been freed
+struct trade {
+    enum order_type new_type;
+    int product_id;
+
+    trader *resting_owner;
+    int resting_order_id;
+
+    trader *new_owner;
+    int new_order_id;
+
+    int quantity;
+    int price;
+};
+
+// Trades produced by matching one order, in the order they happened
+struct trade_batch {
+    trade *trades;
+    int size;
+    int capacity;
+};
+
+// Position in a walk over a side's levels, from highest to lowest price
+// A walk starts from a zeroed cursor
+struct level_cursor {
+    bool is_started;
+    price_level *rung;
+    int index;
+};
+
+// A level as it is printed in the orderbook
+struct level_record {
+    int64_t quantity;
+    int price;
+    int num_orders;
+};
+
+// A product's section of the orderbook, copied as records by its matcher
+// and logged when the job retires
+// The SELL levels come first, then the BUY levels, each from highest to
+// lowest price
+struct book_section {
+    int num_sell_levels;
+    int num_buy_levels;
+    level_record *levels;
+    int capacity;
+};
 
 struct product_order {
     char *product_name;
 
-    order *sell_orders;
+    book_side sell_side;
     int sell_size;
 
-
-    order *buy_orders;
+    book_side buy_side;
     int buy_size;
 };
 
+// A command routed to a matcher thread, and what the matcher made of it
+// The main thread fills in the command, the matcher the results, which the
+// main thread applies when the job retires
+struct match_job {
+    uint64_t sequence;
+    command parsed;
+    trader *owner;
+    int product_id;
+
+    // The command as written, logged when the job retires
+    // Empty for a binary command, which is formatted from parsed then
+    char text[JOB_TEXT_SIZE];
+    int text_len;
+
+    // false if the order to AMEND/CANCEL was no longer live
+    bool is_valid;
+    // The order after the command, its MARKET message is formatted from it
+    // when the job retires
+    order market_order;
+    trade_batch trades;
+    // The product's section of the orderbook after the command, unless it
+    // could not be copied
+    book_section book;
+    bool has_book;
+};
+
+// A matcher thread, owning the books of the products with
+// product_id % num_matchers == index
+// jobs is a single-producer/single-consumer ring in both directions: the
+// matcher takes the jobs in [done, head) and the main thread retires the
+// ones in [tail, done). The counters count jobs ever submitted/matched/
+// retired, the capacity is a power of 2
+struct matcher {
+    int index;
+    pthread_t thread;
+    product_order **orderbook;
+    int num_products;
+
+    match_job *jobs;
+    atomic_uint head;
+    atomic_uint done;
+    atomic_uint tail;
+
+    // Wakeups for a new job, and for a matched job while the thread
+    // retiring the jobs waits for one
+    int job_eventfd;
+    int done_eventfd;
+    atomic_bool is_waiting;
+    atomic_bool is_stopping;
+
+    // The orders and levels of the matcher's books
+    object_pool order_pool;
+    object_pool level_pool;
+};
+
+// A message to one trader (a response or a fill)
+struct direct_message {
+    trader *target;
+    char text[FANOUT_MESSAGE_SIZE];
+};
+
+// The messages of one retired job, written by the fan-out workers
+// Immutable once published, until every worker has written it
+struct market_event {
+    trader *sender;
+    // The MARKET message for every trader but the sender, the first
+    // market_index direct messages are written before it
+    bool has_market;
+    char market[BUFFER_SIZE];
+    int market_index;
+
+    direct_message *messages;
+    int num_messages;
+    int messages_capacity;
+};
+
+// A fan-out thread, owning the messages and backlogs of the traders with
+// trader_id % num_workers == index
+// cursor counts the events it has written, the publisher reuses an event's
+// slot once every worker is past it
+struct fanout_worker {
+    int index;
+    pthread_t thread;
+    trader **traders;
+    int num_traders;
+
+    atomic_ullong cursor;
+    // Wakeup for a new event (or a pause or a stop) while it is idle
+    int event_eventfd;
+    atomic_bool is_waiting;
+    atomic_bool is_stopping;
+};
+
+// The matcher threads, and the jobs in flight in sequence order
+// Jobs retire in the order they were submitted, so the log and the
+// messages come out the same as with a single thread
+// In pipeline mode the jobs retire on a publisher thread, which also owns
+// the traders' messages: the main thread only reads and parses
+// With fan-out workers the publisher hands each job's messages to the
+// workers as an event instead of writing them
+struct match_engine {
+    matcher *matchers;
+    int num_matchers;
+
+    // Matcher of each job in flight, a ring indexed by sequence number
+    int *routes;
+    int num_routes;
+    atomic_ullong next_sequence;
+    atomic_ullong retired_sequence;
+
+    // Last retired section of the orderbook of each product
+    book_section *books;
+    int num_products;
+
+    // Fees of the retired jobs
+    int64_t fees;
+
+    // Publisher thread (pipeline mode)
+    bool is_pipelined;
+    pthread_t publisher;
+    trader **traders;
+    int num_traders;
+    // Wakeups for the publisher (a new job while it is idle, a pause or a
+    // stop), and for the main thread waiting for a retired job or a pause
+    int publish_eventfd;
+    int retired_eventfd;
+    atomic_bool is_publisher_idle;
+    atomic_bool is_main_waiting;
+    atomic_bool is_pausing;
+    atomic_bool is_paused;
+    atomic_bool is_stopping;
+
+    // Fan-out workers, and the ring of events they write
+    fanout_worker *workers;
+    int num_workers;
+    market_event *events;
+    atomic_ullong num_events;
+    // Wakeup for the publisher waiting for the workers
+    int fanout_eventfd;
+    atomic_bool is_fanout_waiting;
+    atomic_int num_parked_workers;
+};
+
+#ifdef IO_URING
+// io_uring state of one trader
+struct uring_slot {
+    // Result of the trader's writev in the current event's batch
+    ssize_t num_written;
+    bool is_written;
+
+    // The pipe read returned end of file / the process has been reaped
+    // A trader is disconnected once both have happened
+    bool is_closed;
+    bool has_exited;
+
+    // A POLLOUT poll waits for room in the pipe for the backlog
+    bool is_polling;
+};
+
+// State of the io_uring event loop
+// Every trader has one read (or poll with shared memory) outstanding, and
+// the signalfd one read. A trader with a backlog also has a POLLOUT poll
+struct uring_loop {
+    uring ring;
+    uring_slot *slots;
+    int signal_fd;
+    struct signalfd_siginfo child_info;
+
+    // Completions of reads reaped while waiting for an event's writes
+    struct io_uring_cqe *deferred;
+    int num_deferred;
+};
+#endif
+
 void *my_calloc(size_t count, size_t size);
+void *my_realloc(void *ptr, size_t size);
 void my_free(void *ptr);
+int init_pool(object_pool *pool, size_t object_size, int capacity,
+                bool growable);
+int grow_pool(object_pool *pool);
+void *pool_alloc(object_pool *pool);
+void pool_free(object_pool *pool, void *ptr);
+void free_pool(object_pool *pool);
+int init_pools(int capacity);
+void free_pools();
+int parse_options(int *argc_ptr, char ***argv_ptr, exchange_options *options);
+char **load_trader_file(char *filename, int *argc_ptr, char **argv,
+                        char **contents_ptr);
+int raise_fd_limit(int num_traders);
+order *alloc_order();
 void free_order(order *current_order);
+price_level *alloc_level();
+void free_level(price_level *level);
 int free_pipenames(char **e2t_pipenames, char **t2e_pipenames, int size);
 int exchange_parse_args(int argc, char **argv, char *product_filename,
                             char **trader_filenames, char *testing_filename);
@@ -42,107 +480,178 @@ trader *launch_trader(char *trader_filename, char *e2t_pipename,
                         char *testing_filename);
 void unlink_pipes(char **e2t_pipenames, int size);
 int open_market(trader **traders, int num_traders);
-order *search_orders(trader *current_trader, int order_id, order *orders);
-order *search_orderbook(trader *current_trader, int order_id,
-                        product_order **orderbook, int num_products);
-void enqueue(queue *my_queue, int pid, int signal_type);
-node *dequeue(queue *my_queue);
+order *get_order(trader *current_trader, int order_id);
+int reserve_order_index(trader *current_trader, int order_id);
+int index_order(order *current_order);
+void unindex_order(order *current_order);
+bool enqueue(signal_ring *ring, pid_t pid, int signal_type);
+bool dequeue(signal_ring *ring, signal_record *record);
+bool is_queue_empty(signal_ring *ring);
 void sigusr1_handler(int signo, siginfo_t* sinfo, void* context);
 void sigchild_handler(int signo, siginfo_t* sinfo, void* context);
-char **get_products(char *product_filename, int *num_products_ptr);
+char **get_products(char *product_filename, int *num_products_ptr,
+                    enum book_mode **modes_ptr);
+int init_symbol_table(char **products, int num_products);
+void free_symbol_table();
+int get_product_id(char *product_name);
+char *get_product_name(int product_id);
 void free_2d_char_array(char **array, int size);
 void print_products(char **products, int num_products);
 void free_trader(trader *current_trader);
 void free_traders(trader **traders, int size);
-trader *get_trader_id(trader **traders, int num_traders, int pid);
-order *init_amended_order(char buffer[BUFFER_SIZE],
-                            trader *current_trader, order *old_order);
+int init_trader_registry(trader **traders, int num_traders);
+void free_trader_registry();
+trader *get_trader_id(int pid);
+int read_command(trader *current_trader, char buffer[BUFFER_SIZE]);
 order *init_new_order(enum order_state cmd, char buffer[BUFFER_SIZE],
                         trader *current_trader, enum order_type type);
-order *insert_linked_list(order *head, order *cursor, order *new_order);
-order *insert_order(order *head, order *new_order, enum order_type cmd);
-product_order *get_product_from_orderbook(product_order **orderbook,
-                                            char *product_name, int num_products);
-order *delete_order(order *current_order, order *head);
-position *get_position(trader *current_trader, char *product_name);
-void update_position(trader *current_trader, char *product_name, int quantity,
-                        int value, enum order_type type);
-void fill_notify_trader(order *current_order, int quantity);
-void fill_notify_traders(order *buy_order, order *sell_order, int quantity);
+order *init_order(command *parsed, trader *current_trader,
+                    enum order_type type);
+void init_book_side(book_side *side, enum order_type type,
+                    enum book_mode mode);
+void init_ladder(price_ladder *ladder);
+int ladder_highest_below(price_ladder *ladder, int slot);
+int ladder_lowest_above(price_ladder *ladder, int slot);
+int recentre_ladder(price_ladder *ladder, int price);
+price_level *ladder_get_level(price_ladder *ladder, int price);
+void ladder_link_level(book_side *side, price_level *level);
+void ladder_adopt_levels(book_side *side);
+bool ladder_fit_price(book_side *side, int price);
+price_level *ladder_insert_level(book_side *side, int price);
+void ladder_remove_level(book_side *side, price_level *level);
+price_level *ladder_next_level(price_ladder *ladder, price_level *level);
+int search_levels(book_side *side, int price, bool *found);
+price_level *get_level(book_side *side, int price);
+price_level *insert_level(book_side *side, int price);
+void remove_level(book_side *side, price_level *level);
+price_level *get_best_level(book_side *side);
+order *get_best_order(book_side *side);
+book_side *get_book_side(product_order *product, enum order_type type);
+int insert_order(book_side *side, order *new_order);
+void reduce_order(book_side *side, order *current_order, int quantity);
+void update_best_price(book_side *side);
+int get_best_bid(product_order *product);
+int get_best_ask(product_order *product);
+int64_t get_depth(book_side *side);
+void unlink_order(book_side *side, order *current_order);
+int delete_order(book_side *side, order *current_order);
+int amend_order(book_side *side, order *current_order, int quantity,
+                int price);
+position *get_position(trader *current_trader, int product_id);
+void fill_notify_trader(trader *current_trader, int order_id, int quantity);
+void fill_notify_traders(trade *current_trade);
+int64_t calculate_fee(int64_t value);
 int64_t calculate_value(int64_t quantity, int64_t price);
-void update_trader_position(order *current_order, int64_t final_value,
-                            int64_t final_quantity);
-void update_trader_positions(order *matched_order, order *new_order,
-                                int64_t total_value, int64_t fee, int quantity);
+void update_trader_position(trader *current_trader, int product_id,
+                            int64_t final_value, int64_t final_quantity);
+void update_trader_positions(trade *current_trade, int64_t total_value,
+                                int64_t fee);
 void remove_order_from_orderbook(order *current_order,
                                 product_order **orderbook, int num_products);
-int64_t fill_buy_order(order *buy_order, product_order *product);
-int64_t fill_sell_order(order *sell_order, product_order *product);
+int append_trade(trade_batch *batch, order *resting_order, order *new_order,
+                    int quantity);
+void free_trade_batch(trade_batch *batch);
+int match_order(order *new_order, product_order *product, trade_batch *batch);
+int64_t apply_trades(trade_batch *batch);
+int fill_order(order *new_order, product_order *product);
 bool is_order_match(product_order *product);
-order *process_command(enum order_state cmd, char buffer[BUFFER_SIZE],
-                        trader *current_trader, product_order **orderbook,
-                        int num_products);
-int64_t process_amend(char buffer[BUFFER_SIZE], trader *current_trader,
-                        product_order **orderbook, int num_products);
-int64_t process_sell(char buffer[BUFFER_SIZE], trader *current_trader,
+order *process_command(command *parsed, trader *current_trader,
                         product_order **orderbook, int num_products);
-int64_t process_buy(char buffer[BUFFER_SIZE], trader *current_trader,
+int process_amend(command *parsed, trader *current_trader,
                     product_order **orderbook, int num_products);
-order *get_head(order *cursor);
-int process_cancel(char buffer[BUFFER_SIZE], trader *current_trader,
+int process_sell(command *parsed, trader *current_trader,
                     product_order **orderbook, int num_products);
-bool is_valid_command_name(char buffer[BUFFER_SIZE]);
-bool is_valid_product(char buffer[BUFFER_SIZE], product_order **orderbook,
-                        int num_products);
-bool is_valid_order_id(char buffer[BUFFER_SIZE], trader *current_trader);
-bool is_valid_order(char buffer[BUFFER_SIZE], trader *current_trader,
+int process_buy(command *parsed, trader *current_trader,
+                product_order **orderbook, int num_products);
+int process_cancel(command *parsed, trader *current_trader,
                     product_order **orderbook, int num_products);
-bool is_valid_value(char buffer[BUFFER_SIZE]);
-int check_product_name(char *buffer, enum order_state cmd);
-int check_price(char *buffer, enum order_state cmd);
-int check_quantity(char *buffer, enum order_state cmd);
-int check_order_id(char *buffer, enum order_state cmd);
-bool is_valid_command_format(char buffer[BUFFER_SIZE]);
-bool is_semicolon_delimitted(char buffer[BUFFER_SIZE]);
-bool is_valid_command(char buffer[BUFFER_SIZE], trader *current_trader,
-                        product_order **orderbook, int num_products);
-void replace_semicolon_with_null(char buffer[BUFFER_SIZE]);
-enum order_state get_command(char buffer[BUFFER_SIZE], trader *current_trader,
+int parse_text_command(char buffer[BUFFER_SIZE], command *parsed);
+void log_parsing(trader *current_trader, const char *text, int len);
+enum order_state get_command(char buffer[BUFFER_SIZE], command *parsed,
+                                trader *current_trader,
                                 product_order **orderbook, int num_products);
-int64_t check_order_match(enum order_state cmd, char buffer[BUFFER_SIZE],
-                            trader *current_trader, product_order **orderbook,
-                            int num_products);
+void decode_binary_command(const char *buffer, command *parsed);
+bool is_valid_decoded_command(command *parsed, trader *current_trader,
+                                int num_products);
+void format_command(command *parsed, char buffer[BUFFER_SIZE]);
+int negotiate_binary(trader *current_trader, int num_products);
+int match_command(command *parsed, trader *current_trader,
+                    product_order **orderbook, int num_products);
+int64_t check_order_match(command *parsed, trader *current_trader,
+                            product_order **orderbook, int num_products);
 void respond_to_trader(int order_id, trader *current_trader, enum order_state cmd);
+int wake_trader(trader *current_trader);
+int flush_outbound(trader *first_trader, trader **traders, int num_traders);
+void format_market_update(enum order_state cmd, order *new_order,
+                            char response[BUFFER_SIZE]);
+void publish_market_update(char *response, trader *skip_trader,
+                            trader **traders, int num_traders);
 void notify_all_traders(enum order_state cmd, order *new_order,
                         trader *skip_trader, trader **traders,
                         product_order **orderbook, int num_products,
                         int num_traders);
 void free_all(char **e2t_pipenames, char **t2e_pipenames, char **products,
                 int num_products, trader **traders,int num_traders);
-void free_linked_list(order *head);
+void free_book_side(book_side *side);
 void free_orderbook(product_order **orderbook, int num_products);
 void init_orderbook(product_order **orderbook, char **products,
-                        int num_products);
-order *get_total_quantity(order *list, int *quantity_ptr,
-                            int *num_orders_ptr, enum order_type type);
-int get_num_levels(order *head);
-void test_print_orders(order *head, enum order_type type);
-void print_orders(order *head, enum order_type type);
+                        enum book_mode *modes, int num_products);
+int get_num_levels(book_side *side);
+void print_level(FILE *out, price_level *level, enum order_type type);
+price_level *next_level(book_side *side, level_cursor *cursor);
+void print_orders(FILE *out, book_side *side);
+void print_product(FILE *out, product_order *current_product);
+int copy_book_section(book_section *section, product_order *current_product);
+void print_book_section(book_section *section, char *product_name);
+void free_book_section(book_section *section);
 void print_orderbook(product_order **orderbook, int num_products);
-position *init_new_position(char *product_name);
-position *get_positions(char **products, int num_products);
-void load_positions(trader **traders, int num_traders,
-                    char **products, int num_products);
-trader **launch_traders(char *trader_filenames[BUFFER_SIZE],
+int init_positions(int num_traders, int num_products);
+void free_positions();
+trader **launch_traders(char **trader_filenames,
                         char **e2t_pipenames, char **t2e_pipenames,
                         int num_traders, char **products, int num_products,
                         char *testing_filename);
 void print_positions(trader **traders, int num_traders);
 void disconnect_trader(trader *current_trader);
 void respond_invalid(trader *current_trader);
-void init_queue();
+struct pollfd get_backlog_pollfd(trader *current_trader);
+int drain_backlog(trader *current_trader);
+void print_slow_traders(trader **traders, int num_traders);
+int start_matchers(int num_matchers, int pool_capacity,
+                    product_order **orderbook, int num_products);
+void stage_event(trader *owner);
+int publish_event();
+int start_publisher(trader **traders, int num_traders, int num_workers);
+bool owns_output();
+void pause_pipeline(trader **traders, int num_traders);
+void resume_pipeline();
+int64_t stop_matchers(trader **traders, int num_traders);
+void free_matchers();
+void match_job_command(match_job *job, product_order **orderbook,
+                        int num_products);
+bool submit_command(char buffer[BUFFER_SIZE], trader *current_trader,
+                    trader **traders, int num_traders, int num_products);
+void retire_commands(trader **traders, int num_traders, bool wait);
 void print_trader(int trader_id);
 void print_trader_files(int num_traders);
 void send_traders_all_pids(trader **traders, int num_traders);
 int send_signal_to_all_traders(trader **traders, int num_traders, int signal);
+int send_sigusr2_to_all_traders(trader **traders, int num_traders, int signal);
+int64_t handle_command(char buffer[BUFFER_SIZE], trader *current_trader,
+                        trader **traders, int num_traders,
+                        product_order **orderbook, int num_products);
+void handle_disconnect(trader *current_trader, trader **traders,
+                        int num_traders);
+void disconnect_cut_off_traders(trader **traders, int num_traders);
+int64_t run_signal_loop(sigset_t *queue_mask, trader **traders,
+                        int num_traders, product_order **orderbook,
+                        int num_products);
+int64_t run_event_loop(sigset_t *queue_mask, trader **traders,
+                        int num_traders, product_order **orderbook,
+                        int num_products);
+#ifdef IO_URING
+int64_t run_uring_loop(sigset_t *queue_mask, trader **traders,
+                        int num_traders, product_order **orderbook,
+                        int num_products);
+#endif
 #endif
@@ -0,0 +1,509 @@
+#include "spx_common.h"
+
+// Initialise a reader of the messages written to fd
+void init_frame_reader(frame_reader *reader, int fd) {
+    reader->fd = fd;
+    reader->ring = NULL;
+    reader->room_eventfd = -1;
+    reader->start = 0;
+    reader->len = 0;
+    reader->width = 0;
+}
+
+// Take the next message out of the bytes already in the buffer
+// A message without ';' in FRAME_SIZE bytes is returned as is
+// Returns 1 with the message (including the ';') in message, 0 if the
+// buffer holds no complete message
+int take_frame(frame_reader *reader, char message[FRAME_SIZE]) {
+    char *start = reader->buffer + reader->start;
+
+    // Binary messages are the next width bytes
+    if (reader->width > 0) {
+        if (reader->len < reader->width) {
+            return 0;
+        }
+        memcpy(message, start, reader->width);
+        reader->start += reader->width;
+        reader->len -= reader->width;
+        return 1;
+    }
+    char *end = memchr(start, FRAME_DELIMITER, reader->len);
+    if (NULL == end && FRAME_SIZE - 1 != reader->len) {
+        return 0;
+    }
+
+    int length = (NULL != end) ? end - start + 1 : reader->len;
+    memcpy(message, start, length);
+    message[length] = '\0';
+    reader->start += length;
+    reader->len -= length;
+    return 1;
+}
+
+// Move the partial message to the front of the buffer
+// Returns the room left after it for the next chunk
+int compact_frames(frame_reader *reader) {
+    memmove(reader->buffer, reader->buffer + reader->start, reader->len);
+    reader->start = 0;
+    return FRAME_SIZE - 1 - reader->len;
+}
+
+// Get the next message, reading the pipe in chunks when the buffer holds no
+// complete message
+// Returns 1 with the message (including the ';') in message, 0 if a
+// non-blocking pipe has no complete message yet, -1 on end of file or error
+int read_frame(frame_reader *reader, char message[FRAME_SIZE]) {
+    while (true) {
+        if (1 == take_frame(reader, message)) {
+            return 1;
+        }
+
+        int room = compact_frames(reader);
+        char *chunk = reader->buffer + reader->len;
+        if (NULL != reader->ring) {
+            int num_read = shm_ring_read(reader->ring, chunk, room,
+                                            reader->room_eventfd);
+            if (0 == num_read) {
+                return 0;
+            }
+            reader->len += num_read;
+            continue;
+        }
+
+        ssize_t num_read = read(reader->fd, chunk, room);
+        if (-1 == num_read && EINTR == errno) {
+            continue;
+        } else if (-1 == num_read && EAGAIN == errno) {
+            return 0;
+        } else if (num_read <= 0) {
+            return -1;
+        }
+        reader->len += num_read;
+    }
+}
+
+// Initialise a builder of messages to be written to fd
+void init_frame_writer(frame_writer *writer, int fd) {
+    writer->fd = fd;
+    writer->ring = NULL;
+    writer->room_eventfd = -1;
+    writer->backlog = NULL;
+    discard_frames(writer);
+}
+
+// Append a printf formatted message to the writer
+// The buffered messages are flushed first if there is no room for it
+// Returns -1 if the message does not fit in an empty buffer or a flush fails
+int append_frame(frame_writer *writer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int status = vappend_frame(writer, format, args);
+    va_end(args);
+    return status;
+}
+
+// append_frame with the arguments of a variadic caller
+int vappend_frame(frame_writer *writer, const char *format, va_list args) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int room = FRAME_SIZE - writer->len;
+        char *start = writer->buffer + writer->len;
+
+        va_list attempt_args;
+        va_copy(attempt_args, args);
+        int length = vsnprintf(start, room, format, attempt_args);
+        va_end(attempt_args);
+
+        if (length < 0) {
+            return -1;
+        }
+
+        // Extend the last segment if it ends where the message starts
+        struct iovec *last = (writer->num_segments > 0) ?
+                            &writer->segments[writer->num_segments - 1] : NULL;
+        bool is_contiguous = (NULL != last) &&
+                                ((char *) last->iov_base + last->iov_len == start);
+
+        if (length < room && is_contiguous) {
+            last->iov_len += length;
+            writer->len += length;
+            return 0;
+        } else if (length < room && writer->num_segments < FRAME_SEGMENTS) {
+            writer->segments[writer->num_segments].iov_base = start;
+            writer->segments[writer->num_segments].iov_len = length;
+            writer->num_segments += 1;
+            writer->len += length;
+            return 0;
+        } else if (!has_frames(writer) || -1 == flush_frames(writer)) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Append a message the writer does not own
+// data must stay valid until the writer is flushed
+int append_shared_frame(frame_writer *writer, const char *data, int len) {
+    if (FRAME_SEGMENTS == writer->num_segments
+        && -1 == flush_frames(writer)) {
+        return -1;
+    }
+
+    writer->segments[writer->num_segments].iov_base = (char *) data;
+    writer->segments[writer->num_segments].iov_len = len;
+    writer->num_segments += 1;
+    return 0;
+}
+
+// Returns whether the writer has messages waiting to be flushed
+bool has_frames(frame_writer *writer) {
+    return writer->num_segments > 0;
+}
+
+// Copy the buffered messages to the ring, one copy per segment
+// With a backlog what the ring cannot take is queued in it, without one the
+// writer waits for the reader to make room
+static int flush_ring(frame_writer *writer) {
+    frame_backlog *backlog = writer->backlog;
+    if (NULL != backlog && (backlog->len > 0 || backlog->is_overflowed)) {
+        return complete_frames(writer, 0);
+    }
+
+    ssize_t total = 0;
+    for (int i = 0; i < writer->num_segments; i++) {
+        char *data = writer->segments[i].iov_base;
+        int len = writer->segments[i].iov_len;
+        while (len > 0) {
+            int num_written = shm_ring_write(writer->ring, data, len);
+            if (-1 == num_written && EAGAIN == errno && NULL == backlog) {
+                wait_for_peer(writer->room_eventfd);
+                continue;
+            } else if (-1 == num_written && EAGAIN == errno) {
+                return complete_frames(writer, total);
+            } else if (-1 == num_written) {
+                #ifdef DEBUG
+                    printf("Error in flush_ring(): shm_ring_write returned -1, \
+                            errno: %s (%d)\n", strerror(errno), errno);
+                #endif
+                discard_frames(writer);
+                return -1;
+            }
+            data += num_written;
+            len -= num_written;
+            total += num_written;
+        }
+    }
+
+    discard_frames(writer);
+    return 0;
+}
+
+// Write the buffered messages to the pipe with one writev, or to the ring
+// With a backlog the writev does not wait, see complete_frames
+int flush_frames(frame_writer *writer) {
+    if (NULL != writer->ring) {
+        return flush_ring(writer);
+    }
+
+    if (NULL == writer->backlog || 0 == writer->num_segments) {
+        return complete_frames(writer, 0);
+    }
+
+    // Messages go behind the ones already waiting, or are dropped once the
+    // reader has been cut off
+    if (writer->backlog->len > 0 || writer->backlog->is_overflowed) {
+        return complete_frames(writer, 0);
+    }
+
+    ssize_t num_written = 0;
+    do {
+        num_written = writev(writer->fd, writer->segments,
+                                writer->num_segments);
+    } while (-1 == num_written && EINTR == errno);
+
+    if (-1 == num_written && EAGAIN != errno) {
+        #ifdef DEBUG
+            printf("Error in flush_frames(): writev returned -1, \
+                    errno: %s (%d)\n", strerror(errno), errno);
+        #endif
+        discard_frames(writer);
+        return -1;
+    }
+    return complete_frames(writer, (-1 == num_written) ? 0 : num_written);
+}
+
+// Get the length of the key that conflates the message, 0 if it is not an
+// update (the key is "MARKET <side> <product> ")
+static int conflation_key(const char *message, int len) {
+    int prefix = strlen(FRAME_CONFLATED_PREFIX);
+    if (len < prefix || 0 != memcmp(message, FRAME_CONFLATED_PREFIX, prefix)) {
+        return 0;
+    }
+
+    int num_spaces = 0;
+    for (int i = 0; i < len; i++) {
+        if (' ' == message[i] && 3 == ++num_spaces) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Copy bytes to the end of the backlog, growing it if needed
+static int append_backlog(frame_backlog *backlog, const char *data, int len) {
+    if (backlog->len + len > backlog->capacity) {
+        int capacity = (0 == backlog->capacity) ? FRAME_SIZE : backlog->capacity;
+        while (capacity < backlog->len + len) {
+            capacity *= 2;
+        }
+        char *new_data = realloc(backlog->data, capacity);
+        if (NULL == new_data) {
+            return -1;
+        }
+        backlog->data = new_data;
+        backlog->capacity = capacity;
+    }
+
+    memcpy(backlog->data + backlog->len, data, len);
+    backlog->len += len;
+    if (backlog->len > backlog->max_len) {
+        backlog->max_len = backlog->len;
+    }
+    return 0;
+}
+
+// Cut the reader off, keeping only the rest of a partly written message
+static void overflow_backlog(frame_backlog *backlog) {
+    backlog->is_overflowed = true;
+    backlog->len = backlog->pinned;
+    backlog->barrier = backlog->pinned;
+}
+
+// Queue one message in the backlog, conflating updates
+// Returns 0 on success (including a dropped message), -1 on error
+int push_backlog(frame_backlog *backlog, const char *message, int len) {
+    if (!backlog->is_overflowed && backlog->len + len > FRAME_BACKLOG_LIMIT) {
+        overflow_backlog(backlog);
+    }
+    if (backlog->is_overflowed) {
+        backlog->num_dropped += 1;
+        return 0;
+    }
+
+    int key = conflation_key(message, len);
+    if (0 == key) {
+        int status = append_backlog(backlog, message, len);
+        backlog->barrier = backlog->len;
+        return status;
+    }
+
+    // The newest update is always queued. It replaces the earlier update of
+    // the same product and side after the last response or fill. Over
+    // FRAME_BACKLOG_CAPACITY the earlier one is dropped even before a fill
+    bool is_over = backlog->len + len > FRAME_BACKLOG_CAPACITY;
+    int start = (backlog->barrier > backlog->pinned && !is_over)
+                    ? backlog->barrier : backlog->pinned;
+    char *cursor = backlog->data + start;
+    char *end = backlog->data + backlog->len;
+    while (cursor < end) {
+        char *next = memchr(cursor, FRAME_DELIMITER, end - cursor);
+        next = (NULL == next) ? end : next + 1;
+        if (next - cursor >= key && 0 == memcmp(cursor, message, key)) {
+            int removed = next - cursor;
+            memmove(cursor, next, end - next);
+            backlog->len -= removed;
+            if (cursor - backlog->data < backlog->barrier) {
+                backlog->barrier -= removed;
+                backlog->num_dropped += 1;
+            } else {
+                backlog->num_conflated += 1;
+            }
+            break;
+        }
+        cursor = next;
+    }
+    return append_backlog(backlog, message, len);
+}
+
+// Move the messages after the first num_written bytes to the backlog
+// Messages never span segments, the rest of a partly written one is pinned
+static int queue_frames(frame_writer *writer, ssize_t num_written) {
+    frame_backlog *backlog = writer->backlog;
+    int status = 0;
+
+    for (int i = 0; i < writer->num_segments; i++) {
+        char *data = writer->segments[i].iov_base;
+        int len = writer->segments[i].iov_len;
+        if (num_written >= len) {
+            num_written -= len;
+            continue;
+        }
+
+        if (num_written > 0 && FRAME_DELIMITER != data[num_written - 1]) {
+            char *rest = data + num_written;
+            char *end = memchr(rest, FRAME_DELIMITER, len - num_written);
+            int rest_len = (NULL == end) ? len - num_written : end - rest + 1;
+            status |= append_backlog(backlog, rest, rest_len);
+            backlog->pinned += rest_len;
+            backlog->barrier = backlog->len;
+            num_written += rest_len;
+        }
+        data += num_written;
+        len -= num_written;
+        num_written = 0;
+
+        while (len > 0) {
+            char *end = memchr(data, FRAME_DELIMITER, len);
+            int message_len = (NULL == end) ? len : end - data + 1;
+            status |= push_backlog(backlog, data, message_len);
+            data += message_len;
+            len -= message_len;
+        }
+    }
+
+    discard_frames(writer);
+    return status;
+}
+
+// Write the buffered messages after the first num_written bytes, which were
+// written by someone else (eg. an io_uring writev), then discard them
+// Partial writes continue from the first unwritten byte, or with a backlog
+// the rest is queued in it
+int complete_frames(frame_writer *writer, ssize_t num_written) {
+    if (NULL != writer->backlog) {
+        ssize_t total = 0;
+        for (int i = 0; i < writer->num_segments; i++) {
+            total += writer->segments[i].iov_len;
+        }
+        if (num_written >= total) {
+            discard_frames(writer);
+            return 0;
+        }
+
+        // The reader fell behind
+        if (0 == writer->backlog->len) {
+            writer->backlog->num_stalls += 1;
+        }
+        return queue_frames(writer, num_written);
+    }
+
+    struct iovec *segment = writer->segments;
+    int num_segments = writer->num_segments;
+    int status = 0;
+
+    while (true) {
+        // Skip the segments that were written in full
+        while (num_segments > 0 && (size_t) num_written >= segment->iov_len) {
+            num_written -= segment->iov_len;
+            segment++;
+            num_segments--;
+        }
+        if (0 == num_segments) {
+            break;
+        }
+        segment->iov_base = (char *) segment->iov_base + num_written;
+        segment->iov_len -= num_written;
+
+        num_written = writev(writer->fd, segment, num_segments);
+        if (-1 == num_written && EINTR == errno) {
+            num_written = 0;
+        } else if (-1 == num_written) {
+            #ifdef DEBUG
+                printf("Error in complete_frames(): writev returned -1, \
+                        errno: %s (%d)\n", strerror(errno), errno);
+            #endif
+            status = -1;
+            break;
+        }
+    }
+
+    discard_frames(writer);
+    return status;
+}
+
+// Drop the messages waiting in the writer
+void discard_frames(frame_writer *writer) {
+    writer->len = 0;
+    writer->num_segments = 0;
+}
+
+// Returns whether messages are waiting for the pipe to drain
+bool has_backlog(frame_writer *writer) {
+    return NULL != writer->backlog && writer->backlog->len > 0;
+}
+
+// Write as much of the backlog as the pipe (or the ring) takes
+// Returns the number of bytes written, -1 on error
+ssize_t drain_frames(frame_writer *writer) {
+    frame_backlog *backlog = writer->backlog;
+    if (!has_backlog(writer)) {
+        return 0;
+    }
+
+    ssize_t num_written = 0;
+    if (NULL != writer->ring) {
+        num_written = shm_ring_write(writer->ring, backlog->data, backlog->len);
+    } else {
+        do {
+            num_written = write(writer->fd, backlog->data, backlog->len);
+        } while (-1 == num_written && EINTR == errno);
+    }
+
+    if (-1 == num_written) {
+        if (EAGAIN == errno) {
+            return 0;
+        }
+        #ifdef DEBUG
+            printf("Error in drain_frames(): write returned -1, \
+                    errno: %s (%d)\n", strerror(errno), errno);
+        #endif
+        return -1;
+    }
+
+    // Keep the rest of a message cut by the write in front
+    if (num_written > 0) {
+        if (FRAME_DELIMITER == backlog->data[num_written - 1]) {
+            backlog->pinned = 0;
+        } else {
+            char *rest = backlog->data + num_written;
+            char *end = memchr(rest, FRAME_DELIMITER,
+                                backlog->len - num_written);
+            backlog->pinned = (NULL == end) ? backlog->len - num_written
+                                            : end - rest + 1;
+        }
+    }
+    memmove(backlog->data, backlog->data + num_written,
+            backlog->len - num_written);
+    backlog->len -= num_written;
+    backlog->barrier = (backlog->barrier > num_written) ?
+                        backlog->barrier - num_written : 0;
+    return num_written;
+}
+
+// Free the backlog's messages
+void free_backlog(frame_backlog *backlog) {
+    free(backlog->data);
+    backlog->data = NULL;
+    backlog->len = 0;
+    backlog->capacity = 0;
+    backlog->pinned = 0;
+    backlog->barrier = 0;
+}
+
+// Write len bytes, retrying after partial writes and interrupts
+int write_all(int fd, const char *data, int len) {
+    while (len > 0) {
+        ssize_t num_written = write(fd, data, len);
+        if (-1 == num_written && EINTR == errno) {
+            continue;
+        } else if (-1 == num_written) {
+            #ifdef DEBUG
+                printf("Error in write_all(): write returned -1, \
+                        errno: %s (%d)\n", strerror(errno), errno);
+            #endif
+            return -1;
+        }
+        data += num_written;
+        len -= num_written;
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef SPX_FRAMING_H
+#define SPX_FRAMING_H
+
+// Framing of the ';'-terminated messages sent over the named pipes
+// Shared by the exchange and the traders
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "spx_shm.h"
+
+#define FRAME_SIZE (1024)
+#define FRAME_SEGMENTS (16)
+#define FRAME_DELIMITER ';'
+#define FRAME_BACKLOG_CAPACITY (1 << 16)
+#define FRAME_BACKLOG_LIMIT (1 << 20)
+#define FRAME_CONFLATED_PREFIX "MARKET "
+
+typedef struct frame_reader frame_reader;
+typedef struct frame_writer frame_writer;
+typedef struct frame_backlog frame_backlog;
+
+// Buffered reader of messages from a pipe, or from a shared-memory ring
+// when ring is set (room_eventfd is then posted when a full ring is read)
+// The pipe is read in chunks, bytes after the message returned stay in the
+// buffer for the next call
+struct frame_reader {
+    int fd;
+    shm_ring *ring;
+    int room_eventfd;
+    char buffer[FRAME_SIZE];
+    int start;
+    int len;
+    // Size of each message once the trader has switched to fixed-width
+    // binary messages, 0 for ';'-terminated text
+    int width;
+};
+
+// Messages a non-blocking pipe could not take yet, in order
+// An update (MARKET <side> <product>) replaces the previous one for the same
+// product and side still waiting, if no other message was queued since.
+// Over FRAME_BACKLOG_CAPACITY the waiting update is dropped even if a
+// response or fill was queued since. The newest update is always queued.
+// Past FRAME_BACKLOG_LIMIT the reader is cut off: the backlog overflows and
+// every later message is dropped
+struct frame_backlog {
+    char *data;
+    int len;
+    int capacity;
+    // Bytes at the front left of a partly written message
+    int pinned;
+    // End of the last message that is not an update, updates before it
+    // are kept so nothing moves past a response or fill
+    int barrier;
+    bool is_overflowed;
+
+    // How far behind the reader has been
+    int num_stalls;
+    int num_conflated;
+    int num_dropped;
+    int max_len;
+};
+
+// Builder of outgoing messages, written to the pipe in one writev on flush
+// (or copied to the shared-memory ring when ring is set)
+// Messages are either copied into the buffer or reference bytes shared with
+// other writers, each segment is one iovec
+// With a backlog the pipe is non-blocking, what it (or the ring) cannot take
+// is queued in the backlog and written by drain_frames
+struct frame_writer {
+    int fd;
+    shm_ring *ring;
+    int room_eventfd;
+    frame_backlog *backlog;
+    char buffer[FRAME_SIZE];
+    int len;
+    struct iovec segments[FRAME_SEGMENTS];
+    int num_segments;
+};
+
+void init_frame_reader(frame_reader *reader, int fd);
+int take_frame(frame_reader *reader, char message[FRAME_SIZE]);
+int compact_frames(frame_reader *reader);
+int read_frame(frame_reader *reader, char message[FRAME_SIZE]);
+void init_frame_writer(frame_writer *writer, int fd);
+int append_frame(frame_writer *writer, const char *format, ...);
+int vappend_frame(frame_writer *writer, const char *format, va_list args);
+int append_shared_frame(frame_writer *writer, const char *data, int len);
+bool has_frames(frame_writer *writer);
+int flush_frames(frame_writer *writer);
+int complete_frames(frame_writer *writer, ssize_t num_written);
+void discard_frames(frame_writer *writer);
+int push_backlog(frame_backlog *backlog, const char *message, int len);
+bool has_backlog(frame_writer *writer);
+ssize_t drain_frames(frame_writer *writer);
+void free_backlog(frame_backlog *backlog);
+int write_all(int fd, const char *data, int len);
+
+#endif
@@ -0,0 +1,267 @@
+#include "spx_common.h"
+#include "spx_log.h"
+#include <sys/eventfd.h>
+
+// The ring of the logging thread, NULL while the callers write the lines
+static log_ring *logger = NULL;
+
+// Size of a record in the ring
+static size_t get_record_size(int num_args, int text_len) {
+    size_t size = sizeof(log_header) + num_args * sizeof(long long) + text_len;
+    return (size + 7) & ~(size_t) 7;
+}
+
+// Write the line of a record
+void format_record(FILE *out, enum log_format format, const long long *args,
+                    const char *text, int text_len) {
+    switch (format) {
+        case LOG_TEXT:
+            fwrite(text, 1, text_len, out);
+            break;
+        case LOG_PARSING:
+            fprintf(out, "%s [T%lld] Parsing command: <%.*s>\n", LOG_PREFIX,
+                    args[0], text_len, text);
+            break;
+        case LOG_MATCH:
+            fprintf(out, "%s Match: Order %lld [T%lld], New Order %lld [T%lld], value: $%lld, fee: $%lld.\n",
+                    LOG_PREFIX, args[0], args[1], args[2], args[3], args[4],
+                    args[5]);
+            break;
+        case LOG_BOOK_TITLE:
+            fprintf(out, "%s\t--ORDERBOOK--\n", LOG_PREFIX);
+            break;
+        case LOG_PRODUCT:
+            fprintf(out, "%s\tProduct: %.*s; Buy levels: %lld; Sell levels: %lld\n",
+                    LOG_PREFIX, text_len, text, args[0], args[1]);
+            break;
+        case LOG_LEVEL:
+            fprintf(out, "%s\t\t%s %lld @ $%lld (%lld order%s)\n", LOG_PREFIX,
+                    args[0] ? "BUY" : "SELL", args[1], args[2], args[3],
+                    (1 == args[3]) ? "" : "s");
+            break;
+        case LOG_POSITIONS_TITLE:
+            fprintf(out, "%s\t--POSITIONS--\n", LOG_PREFIX);
+            break;
+        case LOG_TRADER:
+            fprintf(out, "%s\tTrader %lld: ", LOG_PREFIX, args[0]);
+            for (long long i = 0; i < args[1]; i++) {
+                const char *end = memchr(text, ' ', text_len);
+                int name_len = (NULL == end) ? text_len : end - text;
+                fprintf(out, "%.*s %lld ($%lld)%s", name_len, text,
+                        args[2 + 2 * i], args[3 + 2 * i],
+                        (args[1] - 1 == i) ? "\n" : ", ");
+                text += name_len + 1;
+                text_len -= name_len + 1;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Wait until the ring has size bytes free after head
+static void wait_for_room(unsigned long long head, size_t size) {
+    while (LOG_RING_CAPACITY - (head - atomic_load(&logger->tail)) < size) {
+        atomic_store(&logger->is_writer_waiting, true);
+        if (LOG_RING_CAPACITY - (head - atomic_load(&logger->tail)) < size) {
+            wait_for_peer(logger->room_eventfd);
+        }
+        atomic_store(&logger->is_writer_waiting, false);
+    }
+}
+
+// Log a line, as a record for the logging thread, or by writing it to
+// stdout if it has not been started
+void log_record(enum log_format format, const long long *args, int num_args,
+                const char *text, int text_len) {
+    if (NULL == logger) {
+        format_record(stdout, format, args, text, text_len);
+        return;
+    }
+
+    size_t size = get_record_size(num_args, text_len);
+    unsigned long long head = atomic_load_explicit(&logger->head,
+                                                    memory_order_relaxed);
+    size_t offset = head % LOG_RING_CAPACITY;
+
+    // Records do not wrap, skip to the start of the ring
+    if (offset + size > LOG_RING_CAPACITY) {
+        size_t pad = LOG_RING_CAPACITY - offset;
+        wait_for_room(head, pad);
+        log_header *header = (log_header *) (logger->data + offset);
+        header->format = LOG_PAD;
+        head += pad;
+        offset = 0;
+    }
+
+    wait_for_room(head, size);
+    log_header *header = (log_header *) (logger->data + offset);
+    header->format = format;
+    header->num_args = num_args;
+    header->text_len = text_len;
+    char *payload = (char *) (header + 1);
+    if (num_args > 0) {
+        memcpy(payload, args, num_args * sizeof(long long));
+    }
+    if (text_len > 0) {
+        memcpy(payload + num_args * sizeof(long long), text, text_len);
+    }
+
+    atomic_store(&logger->head, head + size);
+    if (atomic_load(&logger->is_logger_waiting)) {
+        wake_peer(logger->record_eventfd);
+    }
+}
+
+// Log text as it is, in chunks the ring can take
+void log_text(const char *text) {
+    int len = strlen(text);
+    for (int start = 0; start < len; start += LOG_TEXT_CHUNK) {
+        int chunk = (len - start < LOG_TEXT_CHUNK) ? len - start
+                                                    : LOG_TEXT_CHUNK;
+        log_record(LOG_TEXT, NULL, 0, text + start, chunk);
+    }
+}
+
+// Log a printf formatted line, formatted by the caller
+// For the lines off the matching path
+void log_printf(const char *format, ...) {
+    char line[LOG_TEXT_CHUNK] = "";
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len >= (int) sizeof(line)) {
+        char *long_line = malloc(len + 1);
+        if (NULL == long_line) {
+            return;
+        }
+        va_start(args, format);
+        vsnprintf(long_line, len + 1, format, args);
+        va_end(args);
+        log_text(long_line);
+        free(long_line);
+    } else if (len > 0) {
+        log_record(LOG_TEXT, NULL, 0, line, len);
+    }
+}
+
+// Make the lines logged so far visible
+// The logging thread flushes by itself whenever it runs out of records
+void flush_log() {
+    if (NULL == logger) {
+        fflush(stdout);
+    }
+}
+
+// Write the records as they come in, until stopped with none left
+static void *run_logger(void *arg) {
+    unsigned long long tail = 0;
+    while (true) {
+        unsigned long long head = atomic_load(&logger->head);
+        if (tail == head) {
+            if (atomic_load(&logger->is_stopping)) {
+                break;
+            }
+
+            // Nothing else to write for now
+            fflush(logger->out);
+            atomic_store(&logger->is_logger_waiting, true);
+            if (tail == atomic_load(&logger->head)
+                && !atomic_load(&logger->is_stopping)) {
+                wait_for_peer(logger->record_eventfd);
+            }
+            atomic_store(&logger->is_logger_waiting, false);
+            continue;
+        }
+
+        while (tail != head) {
+            size_t offset = tail % LOG_RING_CAPACITY;
+            log_header *header = (log_header *) (logger->data + offset);
+            if (LOG_PAD == header->format) {
+                tail += LOG_RING_CAPACITY - offset;
+                continue;
+            }
+
+            long long *args = (long long *) (header + 1);
+            format_record(logger->out, header->format, args,
+                            (char *) (args + header->num_args),
+                            header->text_len);
+            tail += get_record_size(header->num_args, header->text_len);
+        }
+
+        atomic_store(&logger->tail, tail);
+        if (atomic_load(&logger->is_writer_waiting)) {
+            wake_peer(logger->room_eventfd);
+        }
+    }
+
+    fflush(logger->out);
+    return NULL;
+}
+
+// Free the ring and close its eventfds
+static void free_logger() {
+    if (-1 != logger->record_eventfd) {
+        close(logger->record_eventfd);
+    }
+    if (-1 != logger->room_eventfd) {
+        close(logger->room_eventfd);
+    }
+    free(logger->data);
+    free(logger);
+    logger = NULL;
+}
+
+// Start the logging thread, writing to out from here on
+// The lines logged before are flushed first, so they are not written twice
+// by a child process
+// Returns 0 on success, -1 on error
+int start_log(FILE *out) {
+    fflush(out);
+
+    logger = calloc(1, sizeof(log_ring));
+    if (NULL == logger) {
+        return -1;
+    }
+    logger->out = out;
+    logger->data = malloc(LOG_RING_CAPACITY);
+    logger->record_eventfd = eventfd(0, 0);
+    logger->room_eventfd = eventfd(0, 0);
+    if (NULL == logger->data || -1 == logger->record_eventfd
+        || -1 == logger->room_eventfd) {
+        free_logger();
+        return -1;
+    }
+
+    // Signals are left to the main thread
+    sigset_t all_signals;
+    sigset_t old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    int status = pthread_create(&logger->thread, NULL, run_logger, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (0 != status) {
+        #ifdef DEBUG
+            printf("Error in start_log(): pthread_create returned %d\n",
+                    status);
+        #endif
+        free_logger();
+        return -1;
+    }
+    return 0;
+}
+
+// Write the records left and stop the logging thread
+void stop_log() {
+    if (NULL == logger) {
+        return;
+    }
+
+    atomic_store(&logger->is_stopping, true);
+    wake_peer(logger->record_eventfd);
+    pthread_join(logger->thread, NULL);
+    free_logger();
+}
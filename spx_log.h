@@ -0,0 +1,77 @@
+#ifndef SPX_LOG_H
+#define SPX_LOG_H
+
+// The exchange's [SPX] log
+// Lines are logged as records, a format id with its arguments, and
+// formatted by a background thread once start_log has been called (before
+// that, or without it, they are formatted and written by the caller)
+// One thread logs at a time, the pipeline hands the log over with the rest
+// of the output
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define LOG_RING_CAPACITY (1 << 20)
+#define LOG_TEXT_CHUNK (4096)
+#define LOG_MAX_ARGS (6)
+
+typedef struct log_header log_header;
+typedef struct log_ring log_ring;
+
+// The lines of the log
+// The arguments of each format are listed next to it
+enum log_format {
+    LOG_PAD,             // Rest of the ring up to its end, skipped
+    LOG_TEXT,            // text written as it is
+    LOG_PARSING,         // trader_id, text: the command
+    LOG_MATCH,           // resting order and owner, new order and owner,
+                         // value, fee
+    LOG_BOOK_TITLE,      //
+    LOG_PRODUCT,         // buy levels, sell levels, text: the product name
+    LOG_LEVEL,           // is_buy, quantity, price, number of orders
+    LOG_POSITIONS_TITLE, //
+    LOG_TRADER           // trader_id, number of products, then quantity
+                         // and value of each product, text: the product
+                         // names separated by spaces
+};
+
+// A record in the ring, followed by num_args long long arguments, then
+// text_len bytes of text, padded to 8 bytes
+struct log_header {
+    uint16_t format;
+    uint16_t num_args;
+    uint32_t text_len;
+};
+
+// Byte ring of records, head and tail count bytes ever written/read
+// A record never wraps, the space left at the end is skipped with LOG_PAD
+struct log_ring {
+    char *data;
+    atomic_ullong head;
+    atomic_ullong tail;
+
+    FILE *out;
+    pthread_t thread;
+    // Wakeups for the writer when the ring is empty, and for the logging
+    // thread when the ring is full
+    int record_eventfd;
+    int room_eventfd;
+    atomic_bool is_writer_waiting;
+    atomic_bool is_logger_waiting;
+    atomic_bool is_stopping;
+};
+
+int start_log(FILE *out);
+void stop_log();
+void log_record(enum log_format format, const long long *args, int num_args,
+                const char *text, int text_len);
+void log_text(const char *text);
+void log_printf(const char *format, ...);
+void flush_log();
+void format_record(FILE *out, enum log_format format, const long long *args,
+                    const char *text, int text_len);
+
+#endif
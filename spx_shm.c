@@ -0,0 +1,208 @@
+#include "spx_common.h"
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <inttypes.h>
+
+// Returns whether the exchange asked for the shared-memory transport
+bool is_shm_transport() {
+    char *transport = getenv(TRANSPORT_ENV);
+    return NULL != transport && 0 == strcmp(transport, TRANSPORT_SHM);
+}
+
+// Map the channel of the trader, creating the region if create is set
+static shm_channel *map_shm_channel(int trader_id, bool create) {
+    char name[BUFFER_SIZE] = "";
+    sprintf(name, SHM_CHANNEL, trader_id);
+
+    int flags = create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR;
+    int fd = shm_open(name, flags, 0600);
+    if (-1 == fd) {
+        #ifdef DEBUG
+            printf("Error in map_shm_channel(): shm_open returned -1, \
+                    errno: %s (%d)\n", strerror(errno), errno);
+        #endif
+        return NULL;
+    }
+
+    if (create && -1 == ftruncate(fd, sizeof(shm_channel))) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    shm_channel *channel = mmap(NULL, sizeof(shm_channel),
+                                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == channel) {
+        if (create) {
+            shm_unlink(name);
+        }
+        return NULL;
+    }
+    return channel;
+}
+
+// Create the channel of a trader (exchange side), its eventfds go in
+// eventfds and are published in the region for the trader
+// The exchange reads t2e non-blocking, the trader blocks on e2t
+// The eventfds are close-on-exec, so only the trader they were made for
+// inherits them (see inherit_shm_eventfds)
+shm_channel *create_shm_channel(int trader_id, shm_eventfds *eventfds) {
+    char name[BUFFER_SIZE] = "";
+    sprintf(name, SHM_CHANNEL, trader_id);
+    shm_unlink(name);
+
+    shm_channel *channel = map_shm_channel(trader_id, true);
+    if (NULL == channel) {
+        return NULL;
+    }
+
+    // The region is zero filled, so both rings start empty
+    eventfds->e2t = eventfd(0, EFD_CLOEXEC);
+    eventfds->t2e = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    eventfds->e2t_room = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    eventfds->t2e_room = eventfd(0, EFD_CLOEXEC);
+    if (-1 == eventfds->e2t || -1 == eventfds->t2e
+        || -1 == eventfds->e2t_room || -1 == eventfds->t2e_room) {
+        close_shm_channel(channel, trader_id, eventfds);
+        return NULL;
+    }
+    channel->eventfds = *eventfds;
+    return channel;
+}
+
+// Let the trader's process keep its channel's eventfds across execv
+// Called in the child, before execv
+// Returns 0 on success, -1 on error
+int inherit_shm_eventfds(shm_eventfds *eventfds) {
+    int fds[] = {eventfds->e2t, eventfds->t2e, eventfds->e2t_room,
+                    eventfds->t2e_room};
+    for (int i = 0; i < 4; i++) {
+        int flags = fcntl(fds[i], F_GETFD);
+        if (-1 == flags || -1 == fcntl(fds[i], F_SETFD, flags & ~FD_CLOEXEC)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Map the channel created by the exchange (trader side)
+shm_channel *open_shm_channel(int trader_id) {
+    return map_shm_channel(trader_id, false);
+}
+
+// Unmap the channel, the exchange also closes its eventfds (NULL for the
+// trader) and removes it
+// The ring this side reads is closed first, a writer waiting on it is woken
+void close_shm_channel(shm_channel *channel, int trader_id,
+                        shm_eventfds *eventfds) {
+    if (NULL == channel) {
+        return;
+    }
+
+    shm_ring *ring = (NULL != eventfds) ? &channel->t2e : &channel->e2t;
+    atomic_store(&ring->is_closed, true);
+    if (NULL != eventfds) {
+        wake_peer(eventfds->t2e_room);
+        close(eventfds->e2t);
+        close(eventfds->t2e);
+        close(eventfds->e2t_room);
+        close(eventfds->t2e_room);
+
+        char name[BUFFER_SIZE] = "";
+        sprintf(name, SHM_CHANNEL, trader_id);
+        shm_unlink(name);
+    }
+    munmap(channel, sizeof(shm_channel));
+}
+
+// Write up to len bytes to the ring without waiting for the reader
+// Returns the number of bytes written, -1 with errno EAGAIN if the ring is
+// full (the room eventfd is posted once the reader has read), or EPIPE once the
+// reader has closed the channel
+int shm_ring_write(shm_ring *ring, const char *data, int len) {
+    if (atomic_load(&ring->is_closed)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    int room = SHM_RING_SIZE - (head - tail);
+
+    // Ask for a wakeup, then look again in case the reader made room before
+    // it could see the flag
+    if (len > room) {
+        atomic_store(&ring->is_full, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        room = SHM_RING_SIZE - (head - tail);
+    }
+    if (0 == room && len > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Copy up to the end of the array, the rest wraps around
+    if (len > room) {
+        len = room;
+    }
+    int offset = head & (SHM_RING_SIZE - 1);
+    int first = (len < SHM_RING_SIZE - offset) ? len : SHM_RING_SIZE - offset;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, data + first, len - first);
+
+    // Publish the bytes to the reader
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+    return len;
+}
+
+// Read up to len bytes from the ring
+// Returns the number of bytes read, 0 if the ring is empty
+int shm_ring_read(shm_ring *ring, char *data, int len, int room_eventfd) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    int available = head - tail;
+    if (len > available) {
+        len = available;
+    }
+
+    int offset = tail & (SHM_RING_SIZE - 1);
+    int first = (len < SHM_RING_SIZE - offset) ? len : SHM_RING_SIZE - offset;
+    memcpy(data, ring->data + offset, first);
+    memcpy(data + first, ring->data, len - first);
+
+    // Hand the bytes back to the writer, waking it if it found the ring full
+    atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (len > 0 && atomic_load_explicit(&ring->is_full, memory_order_relaxed)
+        && atomic_exchange(&ring->is_full, false)) {
+        wake_peer(room_eventfd);
+    }
+    return len;
+}
+
+// Wake the other side of the channel
+int wake_peer(int event_fd) {
+    uint64_t count = 1;
+    if (sizeof(count) != write(event_fd, &count, sizeof(count))) {
+        #ifdef DEBUG
+            printf("Error in wake_peer(): write returned -1, \
+                    errno: %s (%d)\n", strerror(errno), errno);
+        #endif
+        return -1;
+    }
+    return 0;
+}
+
+// Wait until the other side wakes us (returns at once on a non-blocking
+// eventfd), consuming every wakeup posted so far
+int wait_for_peer(int event_fd) {
+    uint64_t count = 0;
+    while (sizeof(count) != read(event_fd, &count, sizeof(count))) {
+        if (EINTR != errno) {
+            return -1;
+        }
+    }
+    return 0;
+}
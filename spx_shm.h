@@ -0,0 +1,64 @@
+#ifndef SPX_SHM_H
+#define SPX_SHM_H
+
+// Shared-memory transport between the exchange and a trader
+// Each trader gets a region with one single-producer/single-consumer byte
+// ring per direction, and an eventfd per direction for wakeups
+// Shared by the exchange and the traders
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#define SHM_CHANNEL "/spx_channel_%d"
+#define SHM_RING_SIZE (1 << 16)
+#define TRANSPORT_ENV "SPX_TRANSPORT"
+#define TRANSPORT_SHM "shm"
+
+typedef struct shm_ring shm_ring;
+typedef struct shm_eventfds shm_eventfds;
+typedef struct shm_channel shm_channel;
+
+// Byte ring, head and tail count bytes ever written/read
+// The size is a power of 2
+// A writer that finds the ring full sets is_full, the reader then posts the
+// ring's room eventfd once it has read. is_closed is set when the reader
+// has gone
+struct shm_ring {
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_bool is_full;
+    atomic_bool is_closed;
+    char data[SHM_RING_SIZE];
+};
+
+// The eventfds of a channel: a wakeup per direction, and room in each ring
+// The exchange polls e2t_room non-blocking, the trader blocks on t2e_room
+struct shm_eventfds {
+    int e2t;
+    int t2e;
+    int e2t_room;
+    int t2e_room;
+};
+
+// The region mapped by the exchange and one trader
+// The eventfds are created by the exchange and inherited by the trader
+// The numbers in the region are only read by the trader, the exchange uses
+// its own copy (the trader can write to the region)
+struct shm_channel {
+    shm_eventfds eventfds;
+    shm_ring e2t;
+    shm_ring t2e;
+};
+
+bool is_shm_transport();
+shm_channel *create_shm_channel(int trader_id, shm_eventfds *eventfds);
+int inherit_shm_eventfds(shm_eventfds *eventfds);
+shm_channel *open_shm_channel(int trader_id);
+void close_shm_channel(shm_channel *channel, int trader_id,
+                        shm_eventfds *eventfds);
+int shm_ring_write(shm_ring *ring, const char *data, int len);
+int shm_ring_read(shm_ring *ring, char *data, int len, int room_eventfd);
+int wake_peer(int event_fd);
+int wait_for_peer(int event_fd);
+
+#endif
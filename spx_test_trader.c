@@ -3,6 +3,12 @@
 int num_traders = 0;
 static volatile sig_atomic_t usr_interrupt = 0;
 static volatile int sigusr1_count = 0;
+static shm_channel *channel = NULL;
+
+// Product ids sent by the exchange once the binary protocol is negotiated
+static char **product_names = NULL;
+static int num_product_names = 0;
+static bool is_binary = false;
 
 // Wrapper function for calloc
 void *my_calloc(size_t count, size_t size) {
@@ -78,17 +84,107 @@ void free_all(int fd_e2t, int fd_t2e, int trader_id, int *fds) {
     close(fd_e2t);
     my_free(fds);
     unlink_pipes(trader_id);
+    close_shm_channel(channel, trader_id, NULL);
+
+    for (int i = 0; i < num_product_names; i++) {
+        my_free(product_names[i]);
+    }
+    my_free(product_names);
+}
+
+// Read the reply to PROTOCOL BINARY; and store the product ids
+// MARKET messages queued before the reply are skipped
+// Returns 1 if the exchange switched to binary, 0 if it replied INVALID,
+// -1 on error
+int read_product_ids(frame_reader *reader) {
+    char buffer[BUFFER_SIZE] = {0};
+    do {
+        if (1 != read_frame(reader, buffer)) {
+            return -1;
+        }
+        if (0 == strcmp(buffer, "INVALID;")) {
+            return 0;
+        }
+    } while (1 != sscanf(buffer, "PROTOCOL BINARY %d;", &num_product_names));
+
+    product_names = my_calloc(num_product_names, sizeof(char *));
+    for (int i = 0; i < num_product_names; i++) {
+        char name[SIZE] = {0};
+        int product_id = 0;
+        if (1 != read_frame(reader, buffer)
+            || 2 != sscanf(buffer, "PRODUCT %d %127[^;];", &product_id, name)
+            || product_id != i) {
+            return -1;
+        }
+        product_names[i] = my_calloc(strlen(name) + 1, sizeof(char));
+        strcpy(product_names[i], name);
+    }
+    return 1;
+}
+
+// Encode a text command of the test file as a binary_command
+// A product without an id is encoded as UINT16_MAX
+void encode_order(char *order, binary_command *message) {
+    char product[SIZE] = {0};
+    int order_id = 0;
+    int quantity = 0;
+    int price = 0;
+    memset(message, 0, sizeof(binary_command));
+
+    if (1 == sscanf(order, "CANCEL %d;", &order_id)) {
+        message->type = CANCEL;
+    } else if (3 == sscanf(order, "AMEND %d %d %d;", &order_id, &quantity,
+                            &price)) {
+        message->type = AMEND;
+    } else if (4 == sscanf(order, "BUY %d %127s %d %d;", &order_id, product,
+                            &quantity, &price)) {
+        message->type = BUY;
+    } else if (4 == sscanf(order, "SELL %d %127s %d %d;", &order_id, product,
+                            &quantity, &price)) {
+        message->type = SELL;
+    } else {
+        message->type = UINT8_MAX;
+    }
+
+    message->order_id = order_id;
+    message->product_id = UINT16_MAX;
+    for (int i = 0; i < num_product_names; i++) {
+        if (0 == strcmp(product_names[i], product)) {
+            message->product_id = i;
+        }
+    }
+    message->quantity = quantity;
+    message->price = price;
 }
 
 // Send the order to the exchange
 int send_order(int t2e_fd, int exchange_pid, char *order) {
-    if (-1 == write(t2e_fd, order, strlen(order))) {
+    frame_writer writer;
+    init_frame_writer(&writer, t2e_fd);
+    if (NULL != channel) {
+        writer.ring = &channel->t2e;
+        writer.room_eventfd = channel->eventfds.t2e_room;
+    }
+
+    binary_command message;
+    int status = 0;
+    if (is_binary) {
+        encode_order(order, &message);
+        status = append_shared_frame(&writer, (char *) &message,
+                                        sizeof(binary_command));
+    } else {
+        status = append_frame(&writer, "%s", order);
+    }
+
+    if (-1 == status || -1 == flush_frames(&writer)) {
         printf("Error in send_order(): write returned -1, errno: %s (%d)\n",
                 strerror(errno), errno);
         return -1;
     }
 
-    if (0 != kill(exchange_pid, SIGUSR1)) {
+    status = (NULL != channel) ? wake_peer(channel->eventfds.t2e)
+                                : kill(exchange_pid, SIGUSR1);
+    if (0 != status) {
         printf("Error in send_order(): kill returned != 0, errno: %s (%d)\n",
                 strerror(errno), errno);
         return -1;
@@ -211,25 +307,37 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    // Wait for exchange to open the market
-    while (0 == sigusr1_count) {
-        nanosleep((const struct timespec[]){{0, TIME_250MS}}, NULL);
+    // Messages go through shared memory if the exchange asked for it
+    if (is_shm_transport()) {
+        channel = open_shm_channel(trader_id);
+        if (NULL == channel) {
+            return -1;
+        }
     }
 
-    sigusr1_count -= 1;
+    // Wait for exchange to open the market
+    if (NULL != channel) {
+        wait_for_peer(channel->eventfds.e2t);
+    } else {
+        while (0 == sigusr1_count) {
+            nanosleep((const struct timespec[]){{0, TIME_250MS}}, NULL);
+        }
+
+        sigusr1_count -= 1;
+    }
 
     // Extract file descriptors
     int e2t_fd = fds[0];
     int t2e_fd = fds[1];
 
-    char buffer[SIZE] = {0};
-
-    for (int i = 0; i < SIZE; i++) {
-        read(e2t_fd, buffer + i, sizeof(char));
-        if (';' == buffer[i]) {
-            break;
-        }
+    char buffer[BUFFER_SIZE] = {0};
+    frame_reader reader;
+    init_frame_reader(&reader, e2t_fd);
+    if (NULL != channel) {
+        reader.ring = &channel->e2t;
+        reader.room_eventfd = channel->eventfds.e2t_room;
     }
+    read_frame(&reader, buffer);
 
     if (0 != strcmp(buffer, "MARKET OPEN;")) {
         printf("Error: did not send correct message, wanted MARKET OPEN; \
@@ -255,6 +363,17 @@ int main(int argc, char *argv[]) {
             nanosleep((const struct timespec[]){{0, TIME_250MS}}, NULL);
         }
 
+        // Later commands are sent as binary_command messages
+        if (trader_id == current_event->trader_id && !is_binary
+            && 0 == strcmp(current_event->order_message, PROTOCOL_BINARY)) {
+            int status = read_product_ids(&reader);
+            if (-1 == status) {
+                printf("Error: could not read the product ids\n");
+                return -1;
+            }
+            is_binary = (1 == status);
+        }
+
         sigprocmask(SIG_BLOCK, &mask, &oldmask);
         usr_interrupt = 0;
         current_event = current_event->next;
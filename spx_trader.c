@@ -1,8 +1,15 @@
 #include "spx_common.h"
 #include "spx_trader.h"
+#include <poll.h>
 
-// Global counter that keeps track of received SIGUSR1 signals
-static volatile int sigusr1_count = 0;
+// SIGUSR1 is kept blocked and taken with sigtimedwait
+static sigset_t sigusr1_mask;
+
+// How long to wait for the exchange before checking the pipe anyway (ms)
+static int fallback_timeout_ms = DEFAULT_TIMEOUT_MS;
+
+// Shared-memory channel to the exchange, NULL with the FIFO transport
+static shm_channel *channel = NULL;
 
 // Wrapper function for calloc
 void *my_calloc(size_t count, size_t size) {
@@ -16,8 +23,9 @@ void my_free(void *ptr) {
 }
 
 // SIGUSR1 signal handler
+// SIGUSR1 stays blocked and is taken with sigtimedwait, the handler only
+// stops a stray unblocked SIGUSR1 from terminating the trader
 void sighandler(int signo, siginfo_t* sinfo, void* context) {
-    __sync_fetch_and_add(&sigusr1_count, 1);
 }
 
 // Unlinks the named pipes
@@ -60,6 +68,7 @@ void free_all(int fd_e2t, int fd_t2e, int trader_id, int *fds) {
     close(fd_e2t);
     unlink_pipes(trader_id);
     my_free(fds);
+    close_shm_channel(channel, trader_id, NULL);
 }
 
 // Frees the order struct
@@ -101,12 +110,18 @@ order *init_buy_order(char buffer[BUFFER_SIZE]) {
 // Takes in an order struct and sends the opposite order
 // eg. Receives BUY, sends out SELL (with same price and quantity)
 int send_opposite_order(int order_id, order *new_order, int fd_t2e) {
-    char response[BUFFER_SIZE] = {0};
-    sprintf(response, "BUY %d %s %d %d;", order_id, new_order->product_name,
-            new_order->quantity, new_order->price);
+    frame_writer writer;
+    init_frame_writer(&writer, fd_t2e);
+    if (NULL != channel) {
+        writer.ring = &channel->t2e;
+        writer.room_eventfd = channel->eventfds.t2e_room;
+    }
+    int status = append_frame(&writer, "BUY %d %s %d %d;", order_id,
+                                new_order->product_name, new_order->quantity,
+                                new_order->price);
     free_order(new_order);
 
-    if (-1 == write(fd_t2e, response, strlen(response))) {
+    if (-1 == status || -1 == flush_frames(&writer)) {
         #ifdef DEBUG
             printf("Error in send_opposite_order(): \
                     write returned -1, errno: %s (%d)\n", strerror(errno), errno);
@@ -114,7 +129,7 @@ int send_opposite_order(int order_id, order *new_order, int fd_t2e) {
         return -1;
     }
 
-    if (0 != kill(getppid(), SIGUSR1)) {
+    if (0 != wake_exchange()) {
         printf("Error in send_opposite_order(): \
                 errno: %s (%d)\n", strerror(errno), errno);
         return -1;
@@ -130,7 +145,7 @@ bool is_market_sell(char buffer[BUFFER_SIZE]) {
 
 // Sends a message to the exchange
 int send_message_to_exchange(char *message, int fd_t2e) {
-    if (-1 == write(fd_t2e, message, strlen(message))) {
+    if (-1 == write_all(fd_t2e, message, strlen(message))) {
         #ifdef DEBUG
             printf("Error in send_message_to_exchange(): write returned -1, \
                     errno: %s (%d)\n", strerror(errno), errno);
@@ -157,6 +172,53 @@ int send_signal(pid_t pid, int signal) {
     return 0;
 }
 
+// Tell the exchange that there are messages for it
+int wake_exchange() {
+    if (NULL != channel) {
+        return wake_peer(channel->eventfds.t2e);
+    }
+    return kill(getppid(), SIGUSR1);
+}
+
+// Get the fallback timeout from the environment, eg. SPX_TRADER_TIMEOUT_MS=50
+int get_fallback_timeout() {
+    char *timeout = getenv(TIMEOUT_ENV);
+    if (NULL == timeout || atoi(timeout) <= 0) {
+        return DEFAULT_TIMEOUT_MS;
+    }
+    return atoi(timeout);
+}
+
+// Block until the exchange wakes us or the fallback timeout passes
+// On a timeout, resend SIGUSR1 if resend is set, in case the exchange
+// missed ours (not needed for eventfds)
+// Returns true if the exchange woke us, callers check the pipe either way
+bool wait_for_exchange(bool resend) {
+    if (NULL != channel) {
+        struct pollfd event = {channel->eventfds.e2t, POLLIN, 0};
+        if (poll(&event, 1, fallback_timeout_ms) <= 0) {
+            return false;
+        }
+        wait_for_peer(channel->eventfds.e2t);
+        return true;
+    }
+
+    struct timespec timeout = {fallback_timeout_ms / 1000,
+                                (fallback_timeout_ms % 1000) * 1000000L};
+    while (true) {
+        if (SIGUSR1 == sigtimedwait(&sigusr1_mask, NULL, &timeout)) {
+            return true;
+        } else if (EINTR == errno) {
+            continue;
+        }
+
+        if (resend) {
+            send_signal(getppid(), SIGUSR1);
+        }
+        return false;
+    }
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         printf("Not enough arguments\n");
@@ -169,12 +231,13 @@ int main(int argc, char *argv[]) {
     sig.sa_flags = SA_SIGINFO | SA_RESTART;
     sigaction(SIGUSR1, &sig, NULL);
 
-    // Register signal mask
-    sigset_t oldmask;
-    sigemptyset(&oldmask);
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGUSR1);
+    // Block SIGUSR1 before the exchange can send it, signals stay pending
+    // until wait_for_exchange takes them
+    sigemptyset(&sigusr1_mask);
+    sigaddset(&sigusr1_mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &sigusr1_mask, NULL);
+
+    fallback_timeout_ms = get_fallback_timeout();
 
     // Get trader id
     int trader_id = atoi(argv[1]);
@@ -185,19 +248,37 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    // Wait for market open
-    while (0 == sigusr1_count) {
-        nanosleep((const struct timespec[]){{0, TIME_250MS}}, NULL);
+    // Messages go through shared memory if the exchange asked for it
+    if (is_shm_transport()) {
+        channel = open_shm_channel(trader_id);
+        if (NULL == channel) {
+            printf("Error: could not open the channel for trader %d\n",
+                    trader_id);
+            return -1;
+        }
+    }
+
+    // Wait for market open (the read below blocks on the pipe if it timed out)
+    wait_for_exchange(false);
+    if (NULL != channel) {
+        while (0 == channel->e2t.head) {
+            wait_for_exchange(false);
+        }
     }
-    __sync_fetch_and_sub(&sigusr1_count, 1);
 
     int fd_e2t = fds[0];
     int fd_t2e = fds[1];
 
     char buffer[BUFFER_SIZE] = {0};
+    frame_reader reader;
+    init_frame_reader(&reader, fd_e2t);
+    if (NULL != channel) {
+        reader.ring = &channel->e2t;
+        reader.room_eventfd = channel->eventfds.e2t_room;
+    }
 
-    // Get the message in the pipe
-    read(fd_e2t, buffer, BUFFER_SIZE);
+    // Get the first message in the pipe, later messages stay in the reader
+    read_frame(&reader, buffer);
     char *market_open = "MARKET OPEN;";
     if (0 != strncmp(buffer, market_open, strlen(market_open))) {
         printf("Error: did not send correct message, wanted \"MARKET OPEN;\"");
@@ -206,80 +287,61 @@ int main(int argc, char *argv[]) {
 
     memset(buffer, 0, BUFFER_SIZE);
 
+    // The exchange batches several messages per SIGUSR1, so each wakeup
+    // handles every message that has arrived
+    fcntl(fd_e2t, F_SETFL, fcntl(fd_e2t, F_GETFL) | O_NONBLOCK);
+
     // Market has opened
     int order_id = 0;
-    while (true) {
-        while (0 == sigusr1_count) {
-            nanosleep((const struct timespec[]){{0, TIME_250MS}}, NULL);
-        }
-        __sync_fetch_and_sub(&sigusr1_count, 1);
-
+    bool is_trading = true;
+    while (is_trading) {
+        wait_for_exchange(false);
 
-        // Read pipe up to the next ;
-        sigprocmask(SIG_BLOCK, &mask, &oldmask);
-        for (int i = 0; i < BUFFER_SIZE; i++) {
-            read(fd_e2t, buffer + i, sizeof(char));
-            if (';' == buffer[i]) {
+        while (is_trading) {
+            // Read the next message
+            if (1 != read_frame(&reader, buffer)) {
                 break;
             }
-        }
-        sigprocmask(SIG_UNBLOCK, &mask, NULL);
-
-        // Check that the command is MARKET SELL
-        if (!is_market_sell(buffer)) {
-            memset(buffer, 0, BUFFER_SIZE);
-            continue;
-        }
-
-
-        // Create an order struct using the buffer contents
-        order *new_order = init_buy_order(buffer);
-        if (new_order->quantity >= MAX_QUANTITY) {
-            free_order(new_order);
-            break;
-        } else if (0 == new_order->quantity) {
-            free_order(new_order);
-            continue;
-        }
 
-        sigprocmask(SIG_BLOCK, &mask, &oldmask);
-        send_opposite_order(order_id, new_order, fd_t2e);
-        sigprocmask(SIG_UNBLOCK, &mask, NULL);
-
-        // Wait for the ACCEPTED response
-        bool accepted = false;
-        while (!accepted) {
-            // Continue to send a signal while it hasn't been ACCEPTED
-            while (0 == sigusr1_count) {
-                nanosleep((const struct timespec[]){{0, TIME_250MS}}, NULL);
-                if (0 == sigusr1_count) {
-                    send_signal(getppid(), SIGUSR1);
-                }
+            // Check that the command is MARKET SELL
+            if (!is_market_sell(buffer)) {
+                continue;
             }
 
-            __sync_fetch_and_sub(&sigusr1_count, 1);
-
-            // Read response
-            for (int i = 0; i < BUFFER_SIZE; i++) {
-                read(fd_e2t, buffer + i, sizeof(char));
-                if (';' == buffer[i]) {
-                    break;
-                }
+            // Create an order struct using the buffer contents
+            order *new_order = init_buy_order(buffer);
+            if (new_order->quantity >= MAX_QUANTITY) {
+                free_order(new_order);
+                is_trading = false;
+                break;
+            } else if (0 == new_order->quantity) {
+                free_order(new_order);
+                continue;
             }
 
-            // Check if the order has been accepted
-            char expected_response[BUFFER_SIZE] = {0};
-            sprintf(expected_response, "ACCEPTED %d;", order_id);
-            if (0 == strncmp(expected_response, buffer,
-                                strlen(expected_response))) {
-                order_id += 1;
-                accepted = true;
+            send_opposite_order(order_id, new_order, fd_t2e);
+
+            // Wait for the ACCEPTED response
+            bool accepted = false;
+            while (!accepted) {
+                // Continue to send a signal while it hasn't been ACCEPTED
+                wait_for_exchange(true);
+
+                // Check the responses for ACCEPTED
+                char expected_response[BUFFER_SIZE] = {0};
+                sprintf(expected_response, "ACCEPTED %d;", order_id);
+                while (!accepted && 1 == read_frame(&reader, buffer)) {
+                    if (0 == strncmp(expected_response, buffer,
+                                        strlen(expected_response))) {
+                        order_id += 1;
+                        accepted = true;
+                    }
+                }
             }
         }
 
         // Reset buffer
         memset(buffer, 0, BUFFER_SIZE);
-
     }
 
     free_all(fd_e2t, fd_t2e, trader_id, fds);
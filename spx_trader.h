@@ -6,6 +6,8 @@
 
 #define MAX_QUANTITY (1000)
 #define SIZE (128)
+#define TIMEOUT_ENV "SPX_TRADER_TIMEOUT_MS"
+#define DEFAULT_TIMEOUT_MS (250)
 
 typedef struct event event;
 
@@ -30,5 +32,8 @@ order *init_buy_order(char buffer[BUFFER_SIZE]);
 int send_opposite_order(int order_id, order *new_order, int fd_t2e);
 bool is_market_sell(char buffer[BUFFER_SIZE]);
 int send_signal(pid_t pid, int signal);
+int get_fallback_timeout();
+bool wait_for_exchange(bool resend);
+int wake_exchange();
 
 #endif
@@ -0,0 +1,181 @@
+#ifdef IO_URING
+
+// Needed for syscall()
+#define _DEFAULT_SOURCE
+
+#include "spx_common.h"
+#include "spx_uring.h"
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Map the queues of a new ring with room for entries submissions
+int init_uring(uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(uring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (-1 == ring->fd) {
+        #ifdef DEBUG
+            printf("Error in init_uring(): io_uring_setup returned -1, \
+                    errno: %s (%d)\n", strerror(errno), errno);
+        #endif
+        return -1;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes
+                    + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->sq_ptr || MAP_FAILED == ring->cq_ptr
+        || MAP_FAILED == ring->sqes) {
+        free_uring(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+// Unmap the queues and close the ring
+void free_uring(uring *ring) {
+    if (NULL != ring->sq_ptr && MAP_FAILED != ring->sq_ptr) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (NULL != ring->cq_ptr && MAP_FAILED != ring->cq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (NULL != ring->sqes && MAP_FAILED != ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    close(ring->fd);
+    memset(ring, 0, sizeof(uring));
+    ring->fd = -1;
+}
+
+// Get a zeroed submission queue entry
+// Submits what is queued first if the queue is full
+struct io_uring_sqe *get_sqe(uring *ring) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned *) ring->sq_head,
+                                            memory_order_acquire);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head > ring->sq_mask) {
+        if (-1 == submit_uring(ring, 0)) {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+
+    // Publish the entry to the kernel
+    atomic_store_explicit((_Atomic unsigned *) ring->sq_tail, tail + 1,
+                            memory_order_release);
+    ring->num_pending += 1;
+    return sqe;
+}
+
+// Submit the queued entries and wait for wait_nr completions, in one
+// io_uring_enter
+int submit_uring(uring *ring, unsigned wait_nr) {
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+        int num_submitted = syscall(__NR_io_uring_enter, ring->fd,
+                                    ring->num_pending, wait_nr, flags, NULL, 0);
+        if (-1 == num_submitted && EINTR == errno) {
+            continue;
+        } else if (-1 == num_submitted) {
+            #ifdef DEBUG
+                printf("Error in submit_uring(): io_uring_enter returned -1, \
+                        errno: %s (%d)\n", strerror(errno), errno);
+            #endif
+            return -1;
+        }
+        ring->num_pending -= num_submitted;
+        return 0;
+    }
+}
+
+// Get the oldest completion, NULL if there is none
+struct io_uring_cqe *peek_cqe(uring *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *) ring->cq_tail,
+                                            memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// Hand the oldest completion back to the kernel
+void cqe_seen(uring *ring) {
+    atomic_store_explicit((_Atomic unsigned *) ring->cq_head,
+                            *ring->cq_head + 1, memory_order_release);
+}
+
+// Queue a read of up to len bytes
+struct io_uring_sqe *prep_read(uring *ring, int fd, void *buffer,
+                                unsigned len, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (NULL != sqe) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) buffer;
+        sqe->len = len;
+        sqe->off = (uint64_t) -1;
+        sqe->user_data = user_data;
+    }
+    return sqe;
+}
+
+// Queue a writev of the segments
+struct io_uring_sqe *prep_writev(uring *ring, int fd, struct iovec *segments,
+                                    unsigned num_segments, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (NULL != sqe) {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) segments;
+        sqe->len = num_segments;
+        sqe->off = (uint64_t) -1;
+        sqe->user_data = user_data;
+    }
+    return sqe;
+}
+
+// Queue a one-shot wait for events (POLLIN/POLLOUT) on fd
+struct io_uring_sqe *prep_poll(uring *ring, int fd, short events,
+                                uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (NULL != sqe) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->user_data = user_data;
+    }
+    return sqe;
+}
+
+#endif
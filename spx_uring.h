@@ -0,0 +1,50 @@
+#ifndef SPX_URING_H
+#define SPX_URING_H
+
+// Minimal io_uring wrapper for the exchange (built with IO_URING=1)
+// Talks to the kernel with the raw io_uring_setup/io_uring_enter syscalls
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct uring uring;
+
+// The submission and completion queues shared with the kernel
+struct uring {
+    int fd;
+    unsigned num_pending;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+int init_uring(uring *ring, unsigned entries);
+void free_uring(uring *ring);
+struct io_uring_sqe *get_sqe(uring *ring);
+int submit_uring(uring *ring, unsigned wait_nr);
+struct io_uring_cqe *peek_cqe(uring *ring);
+void cqe_seen(uring *ring);
+struct io_uring_sqe *prep_read(uring *ring, int fd, void *buffer,
+                                unsigned len, uint64_t user_data);
+struct io_uring_sqe *prep_writev(uring *ring, int fd, struct iovec *segments,
+                                    unsigned num_segments, uint64_t user_data);
+struct io_uring_sqe *prep_poll(uring *ring, int fd, short events,
+                                uint64_t user_data);
+
+#endif
@@ -28,6 +28,89 @@ static void test_positive_exchange_parse_args(void **state) {
     assert_string_equal(trader_filenames[1], "./spx_trader_b");
 }
 
+static void test_positive_trader_file(void **state) {
+    char filename[] = "/tmp/spx_traders_XXXXXX";
+    int fd = mkstemp(filename);
+    assert_true(-1 != fd);
+    char contents[] = "# Auto-traders\n./spx_trader 3\n\n./spx_trader_b\n";
+    assert_int_equal(write(fd, contents, strlen(contents)), strlen(contents));
+    close(fd);
+
+    char *argv[] = {"./spx_exchange", "products.txt", "test.in"};
+    int argc = 3;
+    char *loaded = NULL;
+    char **loaded_argv = load_trader_file(filename, &argc, argv, &loaded);
+    unlink(filename);
+    assert_non_null(loaded_argv);
+    assert_int_equal(argc, 7);
+
+    // The traders from the file come before the testing file
+    char product_filename[BUFFER_SIZE] = {0};
+    char testing_filename[BUFFER_SIZE] = {0};
+    char **trader_filenames = calloc(argc, sizeof(char *));
+    int num_traders = exchange_parse_args(argc, loaded_argv, product_filename,
+                                            trader_filenames, testing_filename);
+    assert_int_equal(num_traders, 4);
+    assert_string_equal(product_filename, "products.txt");
+    assert_string_equal(testing_filename, "test.in");
+    assert_string_equal(trader_filenames[0], "./spx_trader");
+    assert_string_equal(trader_filenames[2], "./spx_trader");
+    assert_string_equal(trader_filenames[3], "./spx_trader_b");
+
+    free(trader_filenames);
+    free(loaded_argv);
+    free(loaded);
+}
+
+static void test_negative_trader_file(void **state) {
+    char *argv[] = {"./spx_exchange", "products.txt", "test.in"};
+    int argc = 3;
+    char *loaded = NULL;
+    assert_null(load_trader_file("/tmp/spx_no_such_traders", &argc, argv,
+                                    &loaded));
+    assert_int_equal(argc, 3);
+
+    // Bad copy counts
+    char *bad_counts[] = {"./spx_trader 0\n", "./spx_trader -2\n",
+                            "./spx_trader 4000000000\n"};
+    for (int i = 0; i < 3; i++) {
+        char filename[] = "/tmp/spx_traders_XXXXXX";
+        int fd = mkstemp(filename);
+        assert_true(-1 != fd);
+        assert_int_equal(write(fd, bad_counts[i], strlen(bad_counts[i])),
+                            strlen(bad_counts[i]));
+        close(fd);
+        assert_null(load_trader_file(filename, &argc, argv, &loaded));
+        assert_int_equal(argc, 3);
+        unlink(filename);
+    }
+}
+
+static void test_positive_trader_registry(void **state) {
+    // Thousands of traders with pids close together and far apart
+    int num_traders = 5000;
+    trader **traders = calloc(num_traders, sizeof(trader *));
+    for (int i = 0; i < num_traders; i++) {
+        traders[i] = calloc(1, sizeof(trader));
+        traders[i]->trader_id = i;
+        traders[i]->pid = (i % 2) ? 1000 + i : 4194304 - 7 * i;
+    }
+    assert_int_equal(init_trader_registry(traders, num_traders), 0);
+
+    for (int i = 0; i < num_traders; i++) {
+        assert_ptr_equal(get_trader_id(traders[i]->pid), traders[i]);
+    }
+    assert_null(get_trader_id(999));
+    assert_null(get_trader_id(0));
+
+    free_trader_registry();
+    assert_null(get_trader_id(traders[0]->pid));
+    for (int i = 0; i < num_traders; i++) {
+        free(traders[i]);
+    }
+    free(traders);
+}
+
 static void test_negative_exchange_parse_args(void **state) {
     char *argv[] = {"./spx_exchange products.txt"};
     int argc = 2;
@@ -42,12 +125,54 @@ static void test_negative_exchange_parse_args(void **state) {
     assert_int_equal(-1, num_traders);
 }
 
-static void test_negative_init_amended_order(void **state) {
-    char buffer[BUFFER_SIZE] = "AMEND 0 -1 5;";
-    order *old_order = {0};
+static void test_positive_parse_options(void **state) {
+    // Any order, with the values given separately or attached
+    char *argv[] = {"./spx_exchange", "-m", "2", "-l", "-f2", "-e", "-c",
+                        "64", "products.txt", "./spx_trader_a", "test.in"};
+    int argc = 11;
+    char **args = argv;
+    exchange_options options;
+    assert_int_equal(parse_options(&argc, &args, &options), 0);
+    assert_true(options.is_event_loop);
+    assert_true(options.is_log_thread);
+    assert_true(options.is_pipelined);
+    assert_false(options.is_shm);
+    assert_int_equal(options.num_workers, 2);
+    assert_int_equal(options.num_matchers, 2);
+    assert_int_equal(options.pool_capacity, 64);
+    assert_null(options.trader_file);
+    assert_int_equal(argc, 4);
+    assert_string_equal(args[0], "./spx_exchange");
+    assert_string_equal(args[1], "products.txt");
 
-    order *new_order = init_amended_order(buffer, NULL, old_order);
-    assert_true(NULL == new_order);
+    // -s implies -e, -p starts a matcher, the pools keep their default size
+    char *shm_argv[] = {"./spx_exchange", "-p", "-t", "traders.txt", "-s",
+                            "products.txt", "test.in"};
+    argc = 7;
+    args = shm_argv;
+    assert_int_equal(parse_options(&argc, &args, &options), 0);
+    assert_true(options.is_shm);
+    assert_true(options.is_event_loop);
+    assert_int_equal(options.num_matchers, 1);
+    assert_int_equal(options.pool_capacity, DEFAULT_POOL_CAPACITY);
+    assert_string_equal(options.trader_file, "traders.txt");
+    assert_int_equal(argc, 3);
+    assert_string_equal(args[1], "products.txt");
+}
+
+static void test_negative_parse_options(void **state) {
+    char *unknown[] = {"./spx_exchange", "-e", "-x", "products.txt"};
+    char *missing[] = {"./spx_exchange", "-e", "-m"};
+    char *zero[] = {"./spx_exchange", "-m", "0", "products.txt"};
+    char *not_number[] = {"./spx_exchange", "-c", "4k", "products.txt"};
+    char **cases[] = {unknown, missing, zero, not_number};
+    int counts[] = {4, 3, 4, 4};
+    exchange_options options;
+    for (int i = 0; i < 4; i++) {
+        int argc = counts[i];
+        char **args = cases[i];
+        assert_int_equal(parse_options(&argc, &args, &options), -1);
+    }
 }
 
 static void test_negative_init_new_order(void **state) {
@@ -57,24 +182,67 @@ static void test_negative_init_new_order(void **state) {
 }
 
 static void test_negative_delete_order(void **state) {
-    order *deleted_order = delete_order(NULL, NULL);
-    assert_true(NULL == deleted_order);
+    int result = delete_order(NULL, NULL);
+    assert_int_equal(-1, result);
 }
 
-static void test_negative_is_valid_order_id(void **state) {
+static void test_negative_order_id(void **state) {
     char buffer[BUFFER_SIZE] = "BUY 1000000 GPU 10 1000;";
-    bool result = is_valid_order_id(buffer, NULL);
-    assert_false(result);
+    trader current_trader = {0};
+    command parsed;
+    assert_int_equal(parse_text_command(buffer, &parsed), 1);
+    assert_int_equal(parsed.order_id, MAX_VALUE + 1);
+    assert_false(is_valid_decoded_command(&parsed, &current_trader, 2));
 }
 
-static void test_negative_is_valid_command_format(void **state) {
-    char buffer[BUFFER_SIZE] = "BUY 0 GPU 10 500";
-    bool result = is_valid_command_format(buffer);
-    assert_false(result);
+static void test_negative_command_format(void **state) {
+    command parsed;
+    char *buffers[] = {
+        "BUY 0 GPU 10 500 ;", "BUY  0 GPU 10 500;", "BUY -1 GPU 10 500;",
+        "BUY 0 GPU 10;", "SELL 0 GPU 10 510 100;", "CANCEL 0 0;", "AMEND 0 1;",
+        "BUY 0 GP-U 10 500;", "BUY 0 GPU 10 500;;", ";", "PROTOCOL BINARY;"
+    };
+    for (int i = 0; i < sizeof(buffers) / sizeof(char *); i++) {
+        char buffer[BUFFER_SIZE] = {0};
+        strcpy(buffer, buffers[i]);
+        assert_int_equal(parse_text_command(buffer, &parsed), -1);
+        assert_int_equal(parsed.cmd, INVALID);
+    }
+}
+
+static void test_positive_parse_command(void **state) {
+    command parsed;
+    char buffer[BUFFER_SIZE] = "SELL 12 Router 30 999999;";
+    assert_int_equal(parse_text_command(buffer, &parsed), 1);
+    assert_int_equal(parsed.cmd, ACCEPTED_SELL);
+    assert_int_equal(parsed.order_id, 12);
+    assert_int_equal(parsed.product_id, 1);
+    assert_int_equal(parsed.quantity, 30);
+    assert_int_equal(parsed.price, 999999);
+
+    // The buffer is left as it was
+    assert_string_equal(buffer, "SELL 12 Router 30 999999;");
+
+    // Products that are not traded parse, and fail validation
+    strcpy(buffer, "BUY 0 Carrot 10 500;");
+    assert_int_equal(parse_text_command(buffer, &parsed), 1);
+    assert_int_equal(parsed.product_id, -1);
+
+    strcpy(buffer, "AMEND 3 10 20");
+    assert_int_equal(parse_text_command(buffer, &parsed), 0);
+    assert_int_equal(parsed.cmd, AMENDED);
+    assert_int_equal(parsed.order_id, 3);
+    assert_int_equal(parsed.quantity, 10);
+    assert_int_equal(parsed.price, 20);
+
+    strcpy(buffer, "CANCEL 7;");
+    assert_int_equal(parse_text_command(buffer, &parsed), 1);
+    assert_int_equal(parsed.cmd, CANCELLED);
+    assert_int_equal(parsed.order_id, 7);
 }
 
 void assert_order_equal(const order *order_a, const order *order_b) {
-    assert_string_equal(order_a->product_name, order_b->product_name);
+    assert_int_equal(order_a->product_id, order_b->product_id);
     assert_true(order_a->type == order_b->type);
     assert_true(order_a->amended == order_b->amended);
     assert_true(order_a->owner == order_b->owner);
@@ -83,7 +251,14 @@ void assert_order_equal(const order *order_a, const order *order_b) {
     assert_true(order_a->price == order_b->price);
 }
 
-static void test_positive_buy_linked_list(void **state) {
+void assert_level_equal(const price_level *level, int price,
+                        int64_t total_quantity, int num_orders) {
+    assert_int_equal(level->price, price);
+    assert_true(level->total_quantity == total_quantity);
+    assert_int_equal(level->num_orders, num_orders);
+}
+
+static void test_positive_buy_price_levels(void **state) {
     char buffer_a[BUFFER_SIZE] = "BUY 0 GPU 10 500";
     char buffer_b[BUFFER_SIZE] = "BUY 1 GPU 20 600";
     char buffer_c[BUFFER_SIZE] = "BUY 2 GPU 30 500";
@@ -94,51 +269,44 @@ static void test_positive_buy_linked_list(void **state) {
     order *order_c = init_new_order(ACCEPTED_BUY, buffer_c, NULL, BUY);
     order *order_d = init_new_order(ACCEPTED_BUY, buffer_d, NULL, BUY);
 
-    order *head = order_a;
-    head = insert_order(head, order_b, BUY);
-    head = insert_order(head, order_c, BUY);
-    head = insert_order(head, order_d, BUY);
-
-    order *cursor = head;
-    assert_order_equal(cursor, order_b);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_a);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_c);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_d);
-    cursor = cursor->next;
-    assert_true(NULL == cursor);
-
-    head = delete_order(order_c, head);
-    cursor = head;
-    assert_order_equal(cursor, order_b);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_a);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_d);
-    cursor = cursor->next;
-    assert_true(NULL == cursor);
-
-    head = delete_order(order_d, head);
-    cursor = head;
-    assert_order_equal(cursor, order_b);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_a);
-    cursor = cursor->next;
-    assert_true(NULL == cursor);
-
-    head = delete_order(order_b, head);
-    cursor = head;
-    assert_order_equal(cursor, order_a);
-    cursor = cursor->next;
-    assert_true(NULL == cursor);
-
-    head = delete_order(order_a, head);
-    assert_true(NULL == head);
-}
-
-static void test_positive_sell_linked_list(void **state) {
+    book_side side;
+    init_book_side(&side, BUY, SORTED_BOOK);
+    insert_order(&side, order_a);
+    insert_order(&side, order_b);
+    insert_order(&side, order_c);
+    insert_order(&side, order_d);
+
+    // Best (highest) price is the last level
+    assert_int_equal(get_num_levels(&side), 3);
+    assert_level_equal(side.levels[0], 400, 40, 1);
+    assert_level_equal(side.levels[1], 500, 40, 2);
+    assert_level_equal(side.levels[2], 600, 20, 1);
+    assert_order_equal(get_best_order(&side), order_b);
+
+    // Time priority within a level
+    price_level *level = get_level(&side, 500);
+    assert_order_equal(level->head, order_a);
+    assert_order_equal(level->head->next, order_c);
+    assert_true(NULL == level->head->next->next);
+
+    delete_order(&side, order_c);
+    assert_level_equal(get_level(&side, 500), 500, 10, 1);
+
+    delete_order(&side, order_d);
+    assert_int_equal(get_num_levels(&side), 2);
+    assert_true(NULL == get_level(&side, 400));
+
+    delete_order(&side, order_b);
+    assert_order_equal(get_best_order(&side), order_a);
+
+    delete_order(&side, order_a);
+    assert_int_equal(get_num_levels(&side), 0);
+    assert_true(NULL == get_best_order(&side));
+
+    free_book_side(&side);
+}
+
+static void test_positive_sell_price_levels(void **state) {
     char buffer_a[BUFFER_SIZE] = "SELL 0 GPU 10 500";
     char buffer_b[BUFFER_SIZE] = "SELL 1 GPU 20 600";
     char buffer_c[BUFFER_SIZE] = "SELL 2 GPU 30 500";
@@ -149,48 +317,1172 @@ static void test_positive_sell_linked_list(void **state) {
     order *order_c = init_new_order(ACCEPTED_SELL, buffer_c, NULL, SELL);
     order *order_d = init_new_order(ACCEPTED_SELL, buffer_d, NULL, SELL);
 
-    order *head = order_a;
-    head = insert_order(head, order_b, SELL);
-    head = insert_order(head, order_c, SELL);
-    head = insert_order(head, order_d, SELL);
-
-    order *cursor = head;
-    assert_order_equal(cursor, order_d);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_a);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_c);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_b);
-    cursor = cursor->next;
-    assert_true(NULL == cursor);
-
-    head = delete_order(order_a, head);
-    cursor = head;
-    assert_order_equal(cursor, order_d);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_c);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_b);
-    cursor = cursor->next;
-    assert_true(NULL == cursor);
-
-    head = delete_order(order_b, head);
-    cursor = head;
-    assert_order_equal(cursor, order_d);
-    cursor = cursor->next;
-    assert_order_equal(cursor, order_c);
-    cursor = cursor->next;
-    assert_true(NULL == cursor);
-
-    head = delete_order(order_d, head);
-    cursor = head;
-    assert_order_equal(cursor, order_c);
-    cursor = cursor->next;
-    assert_true(NULL == cursor);
-
-    head = delete_order(order_c, head);
-    assert_true(NULL == head);
+    book_side side;
+    init_book_side(&side, SELL, SORTED_BOOK);
+    insert_order(&side, order_a);
+    insert_order(&side, order_b);
+    insert_order(&side, order_c);
+    insert_order(&side, order_d);
+
+    // Best (lowest) price is the last level
+    assert_int_equal(get_num_levels(&side), 3);
+    assert_level_equal(side.levels[0], 600, 20, 1);
+    assert_level_equal(side.levels[1], 500, 40, 2);
+    assert_level_equal(side.levels[2], 400, 40, 1);
+    assert_order_equal(get_best_order(&side), order_d);
+    assert_int_equal(side.best_price, 400);
+    assert_true(100 == get_depth(&side));
+
+    delete_order(&side, order_a);
+    price_level *level = get_level(&side, 500);
+    assert_level_equal(level, 500, 30, 1);
+    assert_order_equal(level->head, order_c);
+
+    delete_order(&side, order_b);
+    assert_int_equal(get_num_levels(&side), 2);
+
+    delete_order(&side, order_d);
+    assert_order_equal(get_best_order(&side), order_c);
+
+    delete_order(&side, order_c);
+    assert_int_equal(get_num_levels(&side), 0);
+
+    free_book_side(&side);
+}
+
+static void test_negative_amend_order(void **state) {
+    char buffer[BUFFER_SIZE] = "BUY 0 GPU 10 500";
+    order *old_order = init_new_order(ACCEPTED_BUY, buffer, NULL, BUY);
+
+    book_side side;
+    init_book_side(&side, BUY, SORTED_BOOK);
+    insert_order(&side, old_order);
+
+    assert_int_equal(amend_order(&side, old_order, -1, 5), -1);
+    assert_int_equal(amend_order(NULL, old_order, 10, 5), -1);
+    assert_level_equal(get_best_level(&side), 500, 10, 1);
+
+    free_book_side(&side);
+}
+
+static void test_positive_amend_order(void **state) {
+    char buffer_a[BUFFER_SIZE] = "SELL 0 GPU 10 500";
+    char buffer_b[BUFFER_SIZE] = "SELL 1 GPU 20 500";
+    char buffer_c[BUFFER_SIZE] = "SELL 2 GPU 30 600";
+
+    order *order_a = init_new_order(ACCEPTED_SELL, buffer_a, NULL, SELL);
+    order *order_b = init_new_order(ACCEPTED_SELL, buffer_b, NULL, SELL);
+    order *order_c = init_new_order(ACCEPTED_SELL, buffer_c, NULL, SELL);
+
+    book_side side;
+    init_book_side(&side, SELL, SORTED_BOOK);
+    insert_order(&side, order_a);
+    insert_order(&side, order_b);
+    insert_order(&side, order_c);
+
+    // Same price: the order keeps its node but goes to the back of the level
+    assert_int_equal(amend_order(&side, order_a, 15, 500), 0);
+    price_level *level = get_level(&side, 500);
+    assert_true(order_b == level->head);
+    assert_true(order_a == level->tail);
+    assert_level_equal(level, 500, 35, 2);
+    assert_true(order_a->amended);
+
+    // New price: the order moves level, emptied levels are removed
+    assert_int_equal(amend_order(&side, order_c, 5, 400), 0);
+    assert_true(order_c == get_best_order(&side));
+    assert_null(get_level(&side, 600));
+    assert_int_equal(get_num_levels(&side), 2);
+    assert_true(40 == get_depth(&side));
+
+    free_book_side(&side);
+}
+
+static void test_positive_ladder_price_levels(void **state) {
+    char buffer_a[BUFFER_SIZE] = "BUY 0 GPU 10 500";
+    char buffer_b[BUFFER_SIZE] = "BUY 1 GPU 20 600";
+    char buffer_c[BUFFER_SIZE] = "BUY 2 GPU 30 500";
+    char buffer_d[BUFFER_SIZE] = "BUY 3 GPU 40 900000";
+    char buffer_e[BUFFER_SIZE] = "BUY 4 GPU 50 3000";
+
+    order *order_a = init_new_order(ACCEPTED_BUY, buffer_a, NULL, BUY);
+    order *order_b = init_new_order(ACCEPTED_BUY, buffer_b, NULL, BUY);
+    order *order_c = init_new_order(ACCEPTED_BUY, buffer_c, NULL, BUY);
+    order *order_d = init_new_order(ACCEPTED_BUY, buffer_d, NULL, BUY);
+    order *order_e = init_new_order(ACCEPTED_BUY, buffer_e, NULL, BUY);
+
+    book_side side;
+    init_book_side(&side, BUY, LADDER_BOOK);
+    insert_order(&side, order_a);
+    insert_order(&side, order_b);
+    insert_order(&side, order_c);
+
+    assert_int_equal(get_num_levels(&side), 2);
+    assert_order_equal(get_best_order(&side), order_b);
+    assert_level_equal(get_level(&side, 500), 500, 40, 2);
+
+    // Outside the window: the ladder is re-centred and widened
+    insert_order(&side, order_e);
+    assert_true(side.ladder.window > LADDER_WINDOW);
+    assert_order_equal(get_best_order(&side), order_e);
+    assert_level_equal(get_level(&side, 600), 600, 20, 1);
+
+    // Too far away for the widest window: kept with the sorted levels
+    insert_order(&side, order_d);
+    assert_true(side.ladder.window <= LADDER_MAX_WINDOW);
+    assert_int_equal(side.num_levels, 1);
+    assert_int_equal(get_num_levels(&side), 4);
+    assert_order_equal(get_best_order(&side), order_d);
+    assert_level_equal(get_level(&side, 900000), 900000, 40, 1);
+
+    // Levels are printed from highest to lowest price
+    char *printed = NULL;
+    size_t printed_len = 0;
+    FILE *out = open_memstream(&printed, &printed_len);
+    print_orders(out, &side);
+    fclose(out);
+    assert_string_equal(printed, "[SPX]\t\tBUY 40 @ $900000 (1 order)\n"
+                                    "[SPX]\t\tBUY 50 @ $3000 (1 order)\n"
+                                    "[SPX]\t\tBUY 20 @ $600 (1 order)\n"
+                                    "[SPX]\t\tBUY 40 @ $500 (2 orders)\n");
+    free(printed);
+
+    // Removing the best level finds the next best
+    delete_order(&side, order_d);
+    assert_order_equal(get_best_order(&side), order_e);
+    delete_order(&side, order_e);
+    assert_order_equal(get_best_order(&side), order_b);
+    delete_order(&side, order_b);
+    assert_order_equal(get_best_order(&side), order_a);
+    delete_order(&side, order_a);
+    delete_order(&side, order_c);
+    assert_int_equal(get_num_levels(&side), 0);
+    assert_null(get_best_order(&side));
+
+    // The empty ladder shrinks back
+    assert_int_equal(side.ladder.window, LADDER_WINDOW);
+
+    free_book_side(&side);
+}
+
+static void test_positive_book_section(void **state) {
+    char buffer_a[BUFFER_SIZE] = "SELL 0 GPU 10 700";
+    char buffer_b[BUFFER_SIZE] = "SELL 1 GPU 20 800";
+    char buffer_c[BUFFER_SIZE] = "BUY 2 GPU 30 500";
+    char buffer_d[BUFFER_SIZE] = "BUY 3 GPU 40 500";
+
+    order *order_a = init_new_order(ACCEPTED_SELL, buffer_a, NULL, SELL);
+    order *order_b = init_new_order(ACCEPTED_SELL, buffer_b, NULL, SELL);
+    order *order_c = init_new_order(ACCEPTED_BUY, buffer_c, NULL, BUY);
+    order *order_d = init_new_order(ACCEPTED_BUY, buffer_d, NULL, BUY);
+
+    product_order product = {.product_name = "GPU"};
+    init_book_side(&product.sell_side, SELL, SORTED_BOOK);
+    init_book_side(&product.buy_side, BUY, LADDER_BOOK);
+    insert_order(&product.sell_side, order_a);
+    insert_order(&product.sell_side, order_b);
+    insert_order(&product.buy_side, order_c);
+    insert_order(&product.buy_side, order_d);
+
+    // The levels are copied as they are printed: SELL then BUY, highest
+    // price first
+    book_section section = {0};
+    assert_int_equal(copy_book_section(&section, &product), 0);
+    assert_int_equal(section.num_sell_levels, 2);
+    assert_int_equal(section.num_buy_levels, 1);
+    assert_true(800 == section.levels[0].price
+                && 20 == section.levels[0].quantity);
+    assert_true(700 == section.levels[1].price
+                && 1 == section.levels[1].num_orders);
+    assert_true(500 == section.levels[2].price
+                && 70 == section.levels[2].quantity
+                && 2 == section.levels[2].num_orders);
+
+    // A later copy reuses the records
+    level_record *levels = section.levels;
+    delete_order(&product.sell_side, order_b);
+    assert_int_equal(copy_book_section(&section, &product), 0);
+    assert_ptr_equal(section.levels, levels);
+    assert_int_equal(section.num_sell_levels, 1);
+    assert_int_equal(section.levels[1].price, 500);
+
+    free_book_section(&section);
+    free_book_side(&product.sell_side);
+    free_book_side(&product.buy_side);
+}
+
+static void test_positive_ladder_outliers(void **state) {
+    char buffer_a[BUFFER_SIZE] = "SELL 0 GPU 10 900000";
+    char buffer_b[BUFFER_SIZE] = "SELL 1 GPU 20 500";
+    char buffer_c[BUFFER_SIZE] = "SELL 2 GPU 30 600";
+
+    order *order_a = init_new_order(ACCEPTED_SELL, buffer_a, NULL, SELL);
+    order *order_b = init_new_order(ACCEPTED_SELL, buffer_b, NULL, SELL);
+    order *order_c = init_new_order(ACCEPTED_SELL, buffer_c, NULL, SELL);
+
+    book_side side;
+    init_book_side(&side, SELL, LADDER_BOOK);
+    insert_order(&side, order_a);
+    insert_order(&side, order_b);
+    assert_int_equal(side.ladder.num_levels, 1);
+    assert_int_equal(side.num_levels, 1);
+    assert_order_equal(get_best_order(&side), order_b);
+
+    // Once the ladder is empty, the next price positions the window, which
+    // takes in the sorted levels it covers
+    delete_order(&side, order_a);
+    assert_order_equal(get_best_order(&side), order_b);
+    insert_order(&side, order_c);
+    assert_int_equal(side.ladder.num_levels, 2);
+    assert_int_equal(side.num_levels, 0);
+    assert_order_equal(get_best_order(&side), order_b);
+    assert_level_equal(get_level(&side, 500), 500, 20, 1);
+
+    free_book_side(&side);
+}
+
+static void test_positive_order_index(void **state) {
+    char buffer_a[BUFFER_SIZE] = "BUY 0 GPU 10 500";
+    char buffer_b[BUFFER_SIZE] = "BUY 100 GPU 20 600";
+
+    trader current_trader = {0};
+    order *order_a = init_new_order(ACCEPTED_BUY, buffer_a, &current_trader, BUY);
+    order *order_b = init_new_order(ACCEPTED_BUY, buffer_b, &current_trader, BUY);
+
+    book_side side;
+    init_book_side(&side, BUY, SORTED_BOOK);
+    insert_order(&side, order_a);
+    insert_order(&side, order_b);
+
+    assert_true(order_a == get_order(&current_trader, 0));
+    assert_true(order_b == get_order(&current_trader, 100));
+    assert_true(NULL == get_order(&current_trader, 1));
+    assert_true(NULL == get_order(&current_trader, -1));
+    assert_true(NULL == get_order(&current_trader, 1000000));
+
+    delete_order(&side, order_a);
+    assert_true(NULL == get_order(&current_trader, 0));
+    assert_true(order_b == get_order(&current_trader, 100));
+
+    free_book_side(&side);
+    my_free(current_trader.orders);
+    my_free(current_trader.order_products);
+}
+
+static void test_positive_symbol_table(void **state) {
+    assert_int_equal(get_product_id("GPU"), 0);
+    assert_int_equal(get_product_id("Router"), 1);
+    assert_int_equal(get_product_id("CPU"), -1);
+    assert_string_equal(get_product_name(1), "Router");
+
+    char buffer[BUFFER_SIZE] = "SELL 0 Router 10 500";
+    order *new_order = init_new_order(ACCEPTED_SELL, buffer, NULL, SELL);
+    assert_int_equal(new_order->product_id, 1);
+    free_order(new_order);
+}
+
+static void test_positive_object_pool(void **state) {
+    object_pool pool;
+    assert_int_equal(init_pool(&pool, sizeof(order), 2, true), 0);
+
+    order *order_a = pool_alloc(&pool);
+    order *order_b = pool_alloc(&pool);
+    assert_int_equal(pool.num_free, 0);
+
+    // Growable pools add another chunk when empty
+    order *order_c = pool_alloc(&pool);
+    assert_non_null(order_c);
+    assert_int_equal(pool.num_chunks, 2);
+
+    // Freed objects are reused and handed out zeroed
+    order_b->price = 500;
+    pool_free(&pool, order_b);
+    order *order_d = pool_alloc(&pool);
+    assert_true(order_b == order_d);
+    assert_int_equal(order_d->price, 0);
+
+    pool_free(&pool, order_a);
+    pool_free(&pool, order_c);
+    pool_free(&pool, order_d);
+    free_pool(&pool);
+}
+
+static void test_negative_object_pool(void **state) {
+    object_pool pool;
+    assert_int_equal(init_pool(&pool, sizeof(order), 1, false), 0);
+
+    order *order_a = pool_alloc(&pool);
+    assert_non_null(order_a);
+    assert_null(pool_alloc(&pool));
+
+    pool_free(&pool, order_a);
+    free_pool(&pool);
+}
+
+static void test_positive_signal_queue(void **state) {
+    static signal_ring ring;
+    signal_record record = {0};
+
+    assert_true(is_queue_empty(&ring));
+    assert_false(dequeue(&ring, &record));
+
+    // Signals come out in the order they went in
+    assert_true(enqueue(&ring, 100, SIGUSR1));
+    assert_true(enqueue(&ring, 200, SIGCHLD));
+    assert_false(is_queue_empty(&ring));
+
+    assert_true(dequeue(&ring, &record));
+    assert_int_equal(record.pid, 100);
+    assert_int_equal(record.signal, SIGUSR1);
+    assert_true(dequeue(&ring, &record));
+    assert_int_equal(record.pid, 200);
+    assert_int_equal(record.signal, SIGCHLD);
+    assert_true(is_queue_empty(&ring));
+
+    // A full ring drops new signals
+    for (int i = 0; i < SIGNAL_RING_CAPACITY; i++) {
+        assert_true(enqueue(&ring, i, SIGUSR1));
+    }
+    assert_false(enqueue(&ring, -1, SIGUSR1));
+    assert_true(dequeue(&ring, &record));
+    assert_int_equal(record.pid, 0);
+}
+
+static void test_positive_read_command(void **state) {
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    trader current_trader = {0};
+    current_trader.t2e_fd_rdonly = fds[0];
+    init_frame_reader(&current_trader.input, fds[0]);
+    char buffer[BUFFER_SIZE] = {0};
+
+    // A partial command waits for the rest of it
+    assert_int_equal(read_command(&current_trader, buffer), 0);
+    assert_int_equal(write(fds[1], "BUY 0 GPU", 9), 9);
+    assert_int_equal(read_command(&current_trader, buffer), 0);
+
+    // Commands are split at ';', the next one is kept for later
+    assert_int_equal(write(fds[1], " 10 500;SELL", 12), 12);
+    assert_int_equal(read_command(&current_trader, buffer), 1);
+    assert_string_equal(buffer, "BUY 0 GPU 10 500;");
+    assert_int_equal(read_command(&current_trader, buffer), 0);
+
+    assert_int_equal(write(fds[1], " 1 GPU 5 600;", 13), 13);
+    assert_int_equal(read_command(&current_trader, buffer), 1);
+    assert_string_equal(buffer, "SELL 1 GPU 5 600;");
+
+    // Several commands read in one chunk come out one at a time
+    assert_int_equal(write(fds[1], "CANCEL 0;CANCEL 1;", 18), 18);
+    assert_int_equal(read_command(&current_trader, buffer), 1);
+    assert_string_equal(buffer, "CANCEL 0;");
+    assert_int_equal(current_trader.input.len, 9);
+    assert_int_equal(read_command(&current_trader, buffer), 1);
+    assert_string_equal(buffer, "CANCEL 1;");
+    assert_int_equal(read_command(&current_trader, buffer), 0);
+
+    // The trader closed its end
+    close(fds[1]);
+    assert_int_equal(read_command(&current_trader, buffer), -1);
+    close(fds[0]);
+}
+
+static void test_positive_binary_command(void **state) {
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+
+    trader current_trader = {0};
+    init_frame_reader(&current_trader.input, fds[0]);
+    current_trader.input.width = sizeof(binary_command);
+
+    // Messages are cut at the fixed width, a ';' byte is not a delimiter
+    binary_command messages[2] = {
+        {BUY, 0, 1, 59, 10},
+        {CANCEL, 0, 0, 0, 0}
+    };
+    assert_int_equal(write(fds[1], messages, sizeof(messages)),
+                        sizeof(messages));
+    char buffer[BUFFER_SIZE] = {0};
+    assert_int_equal(read_command(&current_trader, buffer), 1);
+
+    command parsed;
+    decode_binary_command(buffer, &parsed);
+    assert_int_equal(parsed.cmd, ACCEPTED_BUY);
+    assert_int_equal(parsed.order_id, 0);
+    assert_int_equal(parsed.product_id, 1);
+    assert_int_equal(parsed.quantity, 59);
+    assert_int_equal(parsed.price, 10);
+    assert_true(is_valid_decoded_command(&parsed, &current_trader, 2));
+
+    char text[BUFFER_SIZE] = {0};
+    format_command(&parsed, text);
+    assert_string_equal(text, "BUY 0 Router 59 10");
+
+    assert_int_equal(read_command(&current_trader, buffer), 1);
+    decode_binary_command(buffer, &parsed);
+    assert_int_equal(parsed.cmd, CANCELLED);
+    assert_int_equal(parsed.product_id, -1);
+    assert_int_equal(current_trader.input.len, 0);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_negative_binary_command(void **state) {
+    trader current_trader = {0};
+    command parsed;
+
+    // Unknown message type
+    binary_command message = {7, 0, 0, 10, 10};
+    decode_binary_command((char *) &message, &parsed);
+    assert_int_equal(parsed.cmd, INVALID);
+
+    // Product id out of range
+    message = (binary_command) {SELL, 0, 2, 10, 10};
+    decode_binary_command((char *) &message, &parsed);
+    assert_false(is_valid_decoded_command(&parsed, &current_trader, 2));
+    char text[BUFFER_SIZE] = {0};
+    format_command(&parsed, text);
+    assert_string_equal(text, "SELL 0 #2 10 10");
+
+    // Values out of [1, 999999], including ones that would overflow an int
+    message = (binary_command) {BUY, 0, 0, 0, 10};
+    decode_binary_command((char *) &message, &parsed);
+    assert_false(is_valid_decoded_command(&parsed, &current_trader, 2));
+    message = (binary_command) {BUY, 0, 0, 10, UINT32_MAX};
+    decode_binary_command((char *) &message, &parsed);
+    assert_false(is_valid_decoded_command(&parsed, &current_trader, 2));
+
+    // Order id out of sequence, and AMEND of an order that does not exist
+    message = (binary_command) {BUY, 1, 0, 10, 10};
+    decode_binary_command((char *) &message, &parsed);
+    assert_false(is_valid_decoded_command(&parsed, &current_trader, 2));
+    message = (binary_command) {AMEND, 0, 0, 10, 10};
+    decode_binary_command((char *) &message, &parsed);
+    assert_false(is_valid_decoded_command(&parsed, &current_trader, 2));
+}
+
+static void test_positive_frame_writer(void **state) {
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+
+    frame_writer writer;
+    init_frame_writer(&writer, fds[1]);
+
+    // Messages are built up and written in one call
+    assert_int_equal(append_frame(&writer, "ACCEPTED %d;", 0), 0);
+    assert_int_equal(append_frame(&writer, "MARKET %s %s %d %d;", "BUY", "GPU",
+                                    10, 500), 0);
+    assert_int_equal(writer.len, 11 + 22);
+    assert_int_equal(writer.num_segments, 1);
+
+    // Shared messages are referenced, not copied
+    char *shared = "MARKET SELL Router 5 20;";
+    assert_int_equal(append_shared_frame(&writer, shared, strlen(shared)), 0);
+    assert_int_equal(append_frame(&writer, "FILL %d %d;", 0, 5), 0);
+    assert_int_equal(writer.num_segments, 3);
+    assert_true(has_frames(&writer));
+
+    assert_int_equal(flush_frames(&writer), 0);
+    assert_int_equal(writer.len, 0);
+    assert_false(has_frames(&writer));
+
+    frame_reader reader;
+    init_frame_reader(&reader, fds[0]);
+    char message[FRAME_SIZE] = {0};
+    assert_int_equal(read_frame(&reader, message), 1);
+    assert_string_equal(message, "ACCEPTED 0;");
+    assert_int_equal(read_frame(&reader, message), 1);
+    assert_string_equal(message, "MARKET BUY GPU 10 500;");
+    assert_int_equal(read_frame(&reader, message), 1);
+    assert_string_equal(message, "MARKET SELL Router 5 20;");
+    assert_int_equal(read_frame(&reader, message), 1);
+    assert_string_equal(message, "FILL 0 5;");
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_negative_frame_writer(void **state) {
+    frame_writer writer;
+    init_frame_writer(&writer, -1);
+
+    // A message larger than the buffer is rejected
+    char message[FRAME_SIZE + 1];
+    memset(message, 'A', FRAME_SIZE);
+    message[FRAME_SIZE] = '\0';
+    assert_int_equal(append_frame(&writer, "%s", message), -1);
+    assert_int_equal(writer.len, 0);
+}
+
+static void test_positive_complete_frames(void **state) {
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+
+    frame_writer writer;
+    init_frame_writer(&writer, fds[1]);
+    char *shared = "MARKET SELL Router 5 20;";
+    assert_int_equal(append_frame(&writer, "ACCEPTED %d;", 0), 0);
+    assert_int_equal(append_shared_frame(&writer, shared, strlen(shared)), 0);
+
+    // The first 15 bytes went out elsewhere (e.g. in an io_uring writev),
+    // only the rest is written
+    assert_int_equal(write(fds[1], "ACCEPTED 0;MARK", 15), 15);
+    assert_int_equal(complete_frames(&writer, 15), 0);
+    assert_false(has_frames(&writer));
+
+    frame_reader reader;
+    init_frame_reader(&reader, fds[0]);
+    char message[FRAME_SIZE] = {0};
+    assert_int_equal(read_frame(&reader, message), 1);
+    assert_string_equal(message, "ACCEPTED 0;");
+    assert_int_equal(read_frame(&reader, message), 1);
+    assert_string_equal(message, shared);
+
+    // Messages already in the buffer are taken without reading
+    memcpy(reader.buffer, "FILL 0 5;FILL", 13);
+    reader.start = 0;
+    reader.len = 13;
+    assert_int_equal(take_frame(&reader, message), 1);
+    assert_string_equal(message, "FILL 0 5;");
+    assert_int_equal(take_frame(&reader, message), 0);
+    assert_int_equal(compact_frames(&reader), FRAME_SIZE - 1 - 4);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_positive_frame_backlog(void **state) {
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+    // Fill the pipe so nothing more can be written
+    char filler[FRAME_SIZE];
+    memset(filler, 'x', FRAME_SIZE);
+    int num_filled = 0;
+    ssize_t num_written = 0;
+    while ((num_written = write(fds[1], filler, FRAME_SIZE)) > 0) {
+        num_filled += num_written;
+    }
+
+    frame_backlog backlog = {0};
+    frame_writer writer;
+    init_frame_writer(&writer, fds[1]);
+    writer.backlog = &backlog;
+
+    // The messages are queued instead of waiting for the reader
+    char *old_update = "MARKET SELL Router 5 20;";
+    char *new_update = "MARKET SELL Router 3 20;";
+    assert_int_equal(append_frame(&writer, "ACCEPTED %d;", 0), 0);
+    assert_int_equal(append_shared_frame(&writer, old_update,
+                                            strlen(old_update)), 0);
+    assert_int_equal(append_frame(&writer, "FILL %d %d;", 0, 2), 0);
+    assert_int_equal(flush_frames(&writer), 0);
+    assert_true(has_backlog(&writer));
+    assert_int_equal(backlog.num_stalls, 1);
+
+    // An update queued before the fill stays ahead of it
+    assert_int_equal(append_shared_frame(&writer, new_update,
+                                            strlen(new_update)), 0);
+    assert_int_equal(flush_frames(&writer), 0);
+    assert_int_equal(backlog.num_stalls, 1);
+    assert_int_equal(backlog.num_conflated, 0);
+
+    // A newer update of the same product and side replaces the waiting one
+    // when nothing else was queued after it
+    char *last_update = "MARKET SELL Router 1 20;";
+    assert_int_equal(append_shared_frame(&writer, last_update,
+                                            strlen(last_update)), 0);
+    assert_int_equal(flush_frames(&writer), 0);
+    assert_int_equal(backlog.num_conflated, 1);
+    assert_int_equal(drain_frames(&writer), 0);
+
+    // Once the reader catches up the backlog goes out in order
+    char *rest = "ACCEPTED 0;MARKET SELL Router 5 20;FILL 0 2;"
+                    "MARKET SELL Router 1 20;";
+    char buffer[FRAME_SIZE] = {0};
+    while (num_filled > 0) {
+        num_filled -= read(fds[0], buffer,
+                            (num_filled < FRAME_SIZE) ? num_filled : FRAME_SIZE);
+    }
+    assert_int_equal(drain_frames(&writer), strlen(rest));
+    assert_false(has_backlog(&writer));
+    memset(buffer, 0, FRAME_SIZE);
+    assert_int_equal(read(fds[0], buffer, FRAME_SIZE), strlen(rest));
+    assert_string_equal(buffer, rest);
+
+    free_backlog(&backlog);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_negative_frame_backlog_capacity(void **state) {
+    frame_backlog backlog = {0};
+
+    // Over the soft capacity an update is still queued, behind the fills
+    char *old_update = "MARKET BUY GPU 10 400;";
+    char *new_update = "MARKET BUY GPU 0 0;";
+    char *fill = "FILL 0 1;";
+    assert_int_equal(push_backlog(&backlog, old_update, strlen(old_update)), 0);
+    while (backlog.len <= FRAME_BACKLOG_CAPACITY) {
+        assert_int_equal(push_backlog(&backlog, fill, strlen(fill)), 0);
+    }
+    int len = backlog.len;
+    assert_int_equal(push_backlog(&backlog, "MARKET SELL GPU 1 1;", 20), 0);
+    assert_int_equal(backlog.len, len + 20);
+    assert_int_equal(backlog.num_dropped, 0);
+
+    // and the waiting update of the same product and side is dropped, even
+    // before a fill
+    assert_int_equal(push_backlog(&backlog, new_update, strlen(new_update)), 0);
+    assert_int_equal(backlog.num_dropped, 1);
+    assert_int_equal(backlog.num_conflated, 0);
+    assert_int_equal(backlog.len,
+                        len + 20 - strlen(old_update) + strlen(new_update));
+    assert_memory_equal(backlog.data, fill, strlen(fill));
+    assert_memory_equal(backlog.data + backlog.len - strlen(new_update),
+                        new_update, strlen(new_update));
+    assert_int_equal(backlog.barrier, len - strlen(old_update));
+
+    free_backlog(&backlog);
+}
+
+static void test_negative_frame_backlog_overflow(void **state) {
+    frame_backlog backlog = {0};
+
+    // Fills are kept until the hard limit
+    char *fill = "FILL 0 1;";
+    int len = strlen(fill);
+    int num_kept = FRAME_BACKLOG_LIMIT / len;
+    for (int i = 0; i < num_kept; i++) {
+        assert_int_equal(push_backlog(&backlog, fill, len), 0);
+    }
+    assert_false(backlog.is_overflowed);
+    assert_int_equal(backlog.len, num_kept * len);
+
+    // Past it the reader is cut off and every message is dropped
+    assert_int_equal(push_backlog(&backlog, fill, len), 0);
+    assert_true(backlog.is_overflowed);
+    assert_int_equal(backlog.len, 0);
+    assert_int_equal(push_backlog(&backlog, "ACCEPTED 1;", 11), 0);
+    assert_int_equal(backlog.len, 0);
+    assert_int_equal(backlog.num_dropped, 2);
+
+    free_backlog(&backlog);
+}
+
+static void test_negative_cut_off_trader(void **state) {
+    int e2t_fds[2];
+    int t2e_fds[2];
+    assert_int_equal(pipe(e2t_fds), 0);
+    assert_int_equal(pipe(t2e_fds), 0);
+
+    // An auto-trader is not sent SIGUSR2 when it is disconnected
+    trader slow_trader = {.trader_id = 0, .is_connected = true,
+                            .is_autotrader = true};
+    trader *traders[] = {&slow_trader};
+    slow_trader.e2t_fd_wronly = e2t_fds[1];
+    slow_trader.t2e_fd_rdonly = t2e_fds[0];
+    init_frame_writer(&slow_trader.output, e2t_fds[1]);
+    slow_trader.output.backlog = &slow_trader.backlog;
+
+    // Nothing is disconnected until a trader's backlog overflows
+    disconnect_cut_off_traders(traders, 1);
+    assert_true(slow_trader.is_connected);
+
+    // The writer only marks the trader, the main thread disconnects it and
+    // closes its pipes
+    slow_trader.backlog.is_overflowed = true;
+    assert_int_equal(append_frame(&slow_trader.output, "ACCEPTED %d;", 0), 0);
+    assert_int_equal(flush_outbound(&slow_trader, traders, 1), 0);
+    assert_true(atomic_load(&slow_trader.is_cut_off));
+    assert_true(slow_trader.is_connected);
+    disconnect_cut_off_traders(traders, 1);
+    assert_false(slow_trader.is_connected);
+    assert_int_equal(slow_trader.e2t_fd_wronly, -1);
+    assert_int_equal(slow_trader.t2e_fd_rdonly, -1);
+    char buffer[BUFFER_SIZE];
+    assert_int_equal(read(e2t_fds[0], buffer, BUFFER_SIZE), 0);
+
+    close(e2t_fds[0]);
+    close(t2e_fds[1]);
+}
+
+static void test_positive_shm_ring(void **state) {
+    static shm_ring ring;
+    char data[BUFFER_SIZE] = {0};
+
+    assert_int_equal(shm_ring_read(&ring, data, BUFFER_SIZE, -1), 0);
+
+    // Move the ring close to the end of the array so the next write wraps
+    atomic_store(&ring.head, SHM_RING_SIZE - 4);
+    atomic_store(&ring.tail, SHM_RING_SIZE - 4);
+
+    assert_int_equal(shm_ring_write(&ring, "BUY 0 GPU 10 500;", 17), 17);
+    assert_int_equal(shm_ring_read(&ring, data, 6, -1), 6);
+    assert_memory_equal(data, "BUY 0 ", 6);
+    assert_int_equal(shm_ring_read(&ring, data, BUFFER_SIZE, -1), 11);
+    assert_memory_equal(data, "GPU 10 500;", 11);
+    assert_int_equal(shm_ring_read(&ring, data, BUFFER_SIZE, -1), 0);
+
+    // Readers and writers take messages from the ring
+    frame_writer writer;
+    init_frame_writer(&writer, -1);
+    writer.ring = &ring;
+    assert_int_equal(append_frame(&writer, "ACCEPTED %d;", 3), 0);
+    assert_int_equal(append_shared_frame(&writer, "FILL 3 10;", 10), 0);
+    assert_int_equal(flush_frames(&writer), 0);
+
+    frame_reader reader;
+    init_frame_reader(&reader, -1);
+    reader.ring = &ring;
+    assert_int_equal(read_frame(&reader, data), 1);
+    assert_string_equal(data, "ACCEPTED 3;");
+    assert_int_equal(read_frame(&reader, data), 1);
+    assert_string_equal(data, "FILL 3 10;");
+    assert_int_equal(read_frame(&reader, data), 0);
+}
+
+static void test_negative_shm_ring_full(void **state) {
+    static shm_ring ring;
+    int room_eventfd = eventfd(0, EFD_NONBLOCK);
+    char data[BUFFER_SIZE] = {0};
+
+    // The ring has room for 4 more bytes
+    atomic_store(&ring.head, SHM_RING_SIZE - 4);
+
+    // The writer takes what fits and queues the rest in the backlog instead
+    // of waiting for the reader
+    frame_backlog backlog = {0};
+    frame_writer writer;
+    init_frame_writer(&writer, -1);
+    writer.ring = &ring;
+    writer.room_eventfd = room_eventfd;
+    writer.backlog = &backlog;
+    assert_int_equal(append_frame(&writer, "FILL %d %d;", 3, 10), 0);
+    assert_int_equal(flush_frames(&writer), 0);
+    assert_int_equal(append_frame(&writer, "ACCEPTED %d;", 4), 0);
+    assert_int_equal(flush_frames(&writer), 0);
+    assert_int_equal(backlog.len, strlen(" 3 10;ACCEPTED 4;"));
+    assert_true(atomic_load(&ring.is_full));
+    assert_int_equal(shm_ring_write(&ring, "x", 1), -1);
+    assert_int_equal(errno, EAGAIN);
+
+    // Reading makes room and posts the wakeup, then the backlog goes out
+    int num_skipped = 0;
+    while (num_skipped < SHM_RING_SIZE - 4) {
+        int len = SHM_RING_SIZE - 4 - num_skipped;
+        num_skipped += shm_ring_read(&ring, data,
+                                        (len < BUFFER_SIZE) ? len : BUFFER_SIZE,
+                                        room_eventfd);
+    }
+    assert_false(atomic_load(&ring.is_full));
+    assert_int_equal(wait_for_peer(room_eventfd), 0);
+    assert_int_equal(drain_frames(&writer), strlen(" 3 10;ACCEPTED 4;"));
+    assert_false(has_backlog(&writer));
+
+    frame_reader reader;
+    init_frame_reader(&reader, -1);
+    reader.ring = &ring;
+    assert_int_equal(read_frame(&reader, data), 1);
+    assert_string_equal(data, "FILL 3 10;");
+    assert_int_equal(read_frame(&reader, data), 1);
+    assert_string_equal(data, "ACCEPTED 4;");
+
+    // Nothing is written once the reader has gone
+    atomic_store(&ring.is_closed, true);
+    assert_int_equal(shm_ring_write(&ring, "FILL 4 1;", 9), -1);
+    assert_int_equal(errno, EPIPE);
+
+    free_backlog(&backlog);
+    close(room_eventfd);
+}
+
+static void test_positive_shm_channel(void **state) {
+    shm_eventfds eventfds;
+    shm_channel *channel = create_shm_channel(999, &eventfds);
+    assert_non_null(channel);
+
+    // The trader gets the numbers from the region, but no process launched
+    // later inherits the eventfds until inherit_shm_eventfds is called
+    assert_memory_equal(&channel->eventfds, &eventfds, sizeof(eventfds));
+    assert_true(fcntl(eventfds.e2t, F_GETFD) & FD_CLOEXEC);
+    assert_true(fcntl(eventfds.t2e_room, F_GETFD) & FD_CLOEXEC);
+    assert_int_equal(inherit_shm_eventfds(&eventfds), 0);
+    assert_false(fcntl(eventfds.e2t, F_GETFD) & FD_CLOEXEC);
+    assert_false(fcntl(eventfds.t2e_room, F_GETFD) & FD_CLOEXEC);
+
+    // The exchange closes its own copies, whatever is in the region
+    channel->eventfds.e2t = -1;
+    close_shm_channel(channel, 999, &eventfds);
+    assert_int_equal(fcntl(eventfds.e2t, F_GETFD), -1);
+}
+
+static void test_positive_position_matrix(void **state) {
+    trader trader_a = {.trader_id = 0};
+    trader trader_b = {.trader_id = 1};
+    assert_int_equal(init_positions(2, 2), 0);
+
+    char buffer_a[BUFFER_SIZE] = "BUY 0 Router 10 500";
+    char buffer_b[BUFFER_SIZE] = "SELL 0 Router 10 500";
+    order *buy_order = init_new_order(ACCEPTED_BUY, buffer_a, &trader_a, BUY);
+    order *sell_order = init_new_order(ACCEPTED_SELL, buffer_b, &trader_b, SELL);
+
+    trade_batch batch = {0};
+    append_trade(&batch, sell_order, buy_order, 10);
+    update_trader_positions(&batch.trades[0], 5000, 50);
+    free_trade_batch(&batch);
+
+    assert_true(10 == get_position(&trader_a, 1)->quantity);
+    assert_true(-5050 == get_position(&trader_a, 1)->value);
+    assert_true(-10 == get_position(&trader_b, 1)->quantity);
+    assert_true(5000 == get_position(&trader_b, 1)->value);
+    assert_true(0 == get_position(&trader_a, 0)->quantity);
+    assert_null(get_position(&trader_a, 2));
+
+    free_order(buy_order);
+    free_order(sell_order);
+    free_positions();
+}
+
+static void test_positive_match_order(void **state) {
+    trader trader_a = {.trader_id = 0};
+    trader trader_b = {.trader_id = 1};
+
+    char buffer_a[BUFFER_SIZE] = "SELL 0 GPU 10 500";
+    char buffer_b[BUFFER_SIZE] = "SELL 1 GPU 20 600";
+    char buffer_c[BUFFER_SIZE] = "BUY 0 GPU 25 600";
+
+    product_order product = {0};
+    init_book_side(&product.buy_side, BUY, SORTED_BOOK);
+    init_book_side(&product.sell_side, SELL, SORTED_BOOK);
+
+    insert_order(&product.sell_side,
+                    init_new_order(ACCEPTED_SELL, buffer_a, &trader_a, SELL));
+    insert_order(&product.sell_side,
+                    init_new_order(ACCEPTED_SELL, buffer_b, &trader_a, SELL));
+    product.sell_size = 2;
+
+    order *buy_order = init_new_order(ACCEPTED_BUY, buffer_c, &trader_b, BUY);
+    insert_order(&product.buy_side, buy_order);
+    product.buy_size = 1;
+
+    // The new order sweeps both levels, best price first
+    trade_batch batch = {0};
+    assert_int_equal(match_order(buy_order, &product, &batch), 2);
+    assert_int_equal(batch.size, 2);
+
+    assert_int_equal(batch.trades[0].resting_order_id, 0);
+    assert_int_equal(batch.trades[0].quantity, 10);
+    assert_int_equal(batch.trades[0].price, 500);
+    assert_int_equal(batch.trades[1].resting_order_id, 1);
+    assert_int_equal(batch.trades[1].quantity, 15);
+    assert_int_equal(batch.trades[1].price, 600);
+    assert_true(&trader_b == batch.trades[1].new_owner);
+
+    // Only the partially filled SELL order rests
+    assert_int_equal(product.buy_size, 0);
+    assert_int_equal(product.sell_size, 1);
+    assert_level_equal(get_best_level(&product.sell_side), 600, 5, 1);
+    assert_null(get_best_order(&product.buy_side));
+
+    // Cached top-of-book and depth follow the fills
+    assert_int_equal(get_best_bid(&product), 0);
+    assert_int_equal(get_best_ask(&product), 600);
+    assert_true(0 == get_depth(&product.buy_side));
+    assert_true(5 == get_depth(&product.sell_side));
+    assert_false(is_order_match(&product));
+
+    free_trade_batch(&batch);
+    free_book_side(&product.buy_side);
+    free_book_side(&product.sell_side);
+    my_free(trader_a.orders);
+    my_free(trader_a.order_products);
+    my_free(trader_b.orders);
+    my_free(trader_b.order_products);
+}
+
+static void test_positive_process_cancel(void **state) {
+    static char *products[] = {"GPU", "Router"};
+    enum book_mode modes[] = {SORTED_BOOK, SORTED_BOOK};
+    product_order **orderbook = calloc(2, sizeof(product_order *));
+    init_orderbook(orderbook, products, modes, 2);
+    trader trader_a = {.trader_id = 0};
+
+    command parsed;
+    char buffer[BUFFER_SIZE] = "BUY 0 GPU 10 500;";
+    assert_int_equal(parse_text_command(buffer, &parsed), 1);
+    order *new_order = process_command(&parsed, &trader_a, orderbook, 2);
+    assert_non_null(new_order);
+    assert_int_equal(orderbook[0]->buy_size, 1);
+
+    // The CANCEL carries the live order, which is removed when it is matched
+    strcpy(buffer, "CANCEL 0;");
+    assert_int_equal(parse_text_command(buffer, &parsed), 1);
+    assert_ptr_equal(process_command(&parsed, &trader_a, orderbook, 2),
+                        new_order);
+    char market[BUFFER_SIZE] = "";
+    format_market_update(CANCELLED, new_order, market);
+    assert_string_equal(market, "MARKET BUY GPU 0 0;");
+    assert_int_equal(match_command(&parsed, &trader_a, orderbook, 2), 0);
+    assert_null(get_order(&trader_a, 0));
+    assert_int_equal(orderbook[0]->buy_size, 0);
+
+    // There is nothing left to cancel
+    assert_null(process_command(&parsed, &trader_a, orderbook, 2));
+
+    free_orderbook(orderbook, 2);
+    free(trader_a.orders);
+    free(trader_a.order_products);
+}
+
+static void test_negative_process_missing_order(void **state) {
+    static char *products[] = {"GPU", "Router"};
+    enum book_mode modes[] = {SORTED_BOOK, SORTED_BOOK};
+    product_order **orderbook = calloc(2, sizeof(product_order *));
+    init_orderbook(orderbook, products, modes, 2);
+    trader trader_a = {.trader_id = 0};
+
+    // Orders that were never placed (or are gone) are not dereferenced
+    command parsed;
+    char buffer[BUFFER_SIZE] = "AMEND 3 10 500;";
+    assert_int_equal(parse_text_command(buffer, &parsed), 1);
+    assert_null(process_command(&parsed, &trader_a, orderbook, 2));
+    assert_int_equal(process_amend(&parsed, &trader_a, orderbook, 2), 0);
+
+    strcpy(buffer, "CANCEL 3;");
+    assert_int_equal(parse_text_command(buffer, &parsed), 1);
+    assert_null(process_command(&parsed, &trader_a, orderbook, 2));
+    assert_int_equal(process_cancel(&parsed, &trader_a, orderbook, 2), -1);
+
+    free_orderbook(orderbook, 2);
+}
+
+static void test_positive_matchers(void **state) {
+    static char *products[] = {"GPU", "Router"};
+    enum book_mode modes[] = {SORTED_BOOK, LADDER_BOOK};
+    product_order **orderbook = calloc(2, sizeof(product_order *));
+    init_orderbook(orderbook, products, modes, 2);
+    assert_int_equal(init_positions(2, 2), 0);
+
+    // The traders are not connected, so nothing is written to them
+    trader trader_a = {.trader_id = 0};
+    trader trader_b = {.trader_id = 1};
+    trader *traders[] = {&trader_a, &trader_b};
+    init_frame_writer(&trader_a.output, -1);
+    init_frame_writer(&trader_b.output, -1);
+
+    // One product per matcher
+    assert_int_equal(start_matchers(2, 16, orderbook, 2), 0);
+    char buffer[BUFFER_SIZE] = "SELL 0 GPU 10 500;";
+    assert_true(submit_command(buffer, &trader_a, traders, 2, 2));
+    strcpy(buffer, "SELL 1 Router 5 100;");
+    assert_true(submit_command(buffer, &trader_a, traders, 2, 2));
+    strcpy(buffer, "BUY 0 GPU 10 600;");
+    assert_true(submit_command(buffer, &trader_b, traders, 2, 2));
+
+    // Cancelling the filled order is only rejected by its matcher
+    strcpy(buffer, "CANCEL 0;");
+    assert_true(submit_command(buffer, &trader_a, traders, 2, 2));
+
+    // Invalid commands are left to handle_command
+    strcpy(buffer, "CANCEL 5;");
+    assert_false(submit_command(buffer, &trader_a, traders, 2, 2));
+    strcpy(buffer, "BUY 0 GPU 10 600;");
+    assert_false(submit_command(buffer, &trader_b, traders, 2, 2));
+
+    // The fills are applied when the jobs retire
+    assert_true(50 == stop_matchers(traders, 2));
+    assert_int_equal(trader_a.current_order_id, 2);
+    assert_int_equal(trader_b.current_order_id, 1);
+    assert_true(-10 == get_position(&trader_a, 0)->quantity);
+    assert_true(5000 == get_position(&trader_a, 0)->value);
+    assert_true(10 == get_position(&trader_b, 0)->quantity);
+    assert_true(-5050 == get_position(&trader_b, 0)->value);
+    assert_int_equal(orderbook[0]->sell_size, 0);
+    assert_int_equal(orderbook[1]->sell_size, 1);
+    assert_true(NULL != get_order(&trader_a, 1));
+
+    free_orderbook(orderbook, 2);
+    free_matchers();
+    free_positions();
+    free(trader_a.orders);
+    free(trader_a.order_products);
+    free(trader_b.orders);
+    free(trader_b.order_products);
+}
+
+static void test_positive_pipeline(void **state) {
+    static char *products[] = {"GPU", "Router"};
+    enum book_mode modes[] = {SORTED_BOOK, SORTED_BOOK};
+    product_order **orderbook = calloc(2, sizeof(product_order *));
+    init_orderbook(orderbook, products, modes, 2);
+    assert_int_equal(init_positions(2, 2), 0);
+
+    trader trader_a = {.trader_id = 0};
+    trader trader_b = {.trader_id = 1};
+    trader *traders[] = {&trader_a, &trader_b};
+    init_frame_writer(&trader_a.output, -1);
+    init_frame_writer(&trader_b.output, -1);
+
+    // Both products on one matcher, the jobs retire on the publisher
+    assert_int_equal(start_matchers(1, 16, orderbook, 2), 0);
+    assert_int_equal(start_publisher(traders, 2, 0), 0);
+    assert_false(owns_output());
+
+    // Growing the order index pauses the pipeline
+    char buffer[BUFFER_SIZE] = "SELL 0 GPU 10 500;";
+    assert_true(submit_command(buffer, &trader_a, traders, 2, 2));
+    strcpy(buffer, "BUY 0 GPU 4 500;");
+    assert_true(submit_command(buffer, &trader_b, traders, 2, 2));
+
+    // Nothing is in flight while the pipeline is paused
+    pause_pipeline(traders, 2);
+    assert_true(-4 == get_position(&trader_a, 0)->quantity);
+    assert_true(4 == get_position(&trader_b, 0)->quantity);
+    assert_int_equal(orderbook[0]->sell_size, 1);
+    resume_pipeline();
+
+    strcpy(buffer, "AMEND 0 6 400;");
+    assert_true(submit_command(buffer, &trader_a, traders, 2, 2));
+    strcpy(buffer, "BUY 1 GPU 6 400;");
+    assert_true(submit_command(buffer, &trader_b, traders, 2, 2));
+
+    // 1% of 2000, then of 2400
+    assert_true(44 == stop_matchers(traders, 2));
+    assert_true(-10 == get_position(&trader_a, 0)->quantity);
+    assert_true(4400 == get_position(&trader_a, 0)->value);
+    assert_true(10 == get_position(&trader_b, 0)->quantity);
+    assert_true(-4444 == get_position(&trader_b, 0)->value);
+    assert_int_equal(orderbook[0]->sell_size, 0);
+
+    free_orderbook(orderbook, 2);
+    free_matchers();
+    free_positions();
+    free(trader_a.orders);
+    free(trader_a.order_products);
+    free(trader_b.orders);
+    free(trader_b.order_products);
+}
+
+static void test_positive_fanout(void **state) {
+    static char *products[] = {"GPU", "Router"};
+    enum book_mode modes[] = {SORTED_BOOK, SORTED_BOOK};
+    product_order **orderbook = calloc(2, sizeof(product_order *));
+    init_orderbook(orderbook, products, modes, 2);
+    assert_int_equal(init_positions(2, 2), 0);
+
+    trader trader_a = {.trader_id = 0};
+    trader trader_b = {.trader_id = 1};
+    trader *traders[] = {&trader_a, &trader_b};
+    init_frame_writer(&trader_a.output, -1);
+    init_frame_writer(&trader_b.output, -1);
+
+    // The log of every event goes to the log thread, not the test output
+    FILE *logged = fopen("/dev/null", "w");
+    assert_non_null(logged);
+    assert_int_equal(start_log(logged), 0);
+
+    // One worker per trader
+    assert_int_equal(start_matchers(2, 16, orderbook, 2), 0);
+    assert_int_equal(start_publisher(traders, 2, 2), 0);
+    char buffer[BUFFER_SIZE] = "SELL 0 GPU 10 100;";
+    assert_true(submit_command(buffer, &trader_a, traders, 2, 2));
+    strcpy(buffer, "BUY 0 GPU 10 100;");
+    assert_true(submit_command(buffer, &trader_b, traders, 2, 2));
+
+    // More events than the ring holds, cancelling the filled order is
+    // rejected by its matcher
+    for (int i = 0; i < 2 * FANOUT_RING_CAPACITY; i++) {
+        strcpy(buffer, "CANCEL 0;");
+        assert_true(submit_command(buffer, &trader_a, traders, 2, 2));
+    }
+
+    assert_true(10 == stop_matchers(traders, 2));
+    stop_log();
+    fclose(logged);
+    assert_true(-10 == get_position(&trader_a, 0)->quantity);
+    assert_true(1000 == get_position(&trader_a, 0)->value);
+    assert_true(10 == get_position(&trader_b, 0)->quantity);
+    assert_true(-1010 == get_position(&trader_b, 0)->value);
+    assert_int_equal(orderbook[0]->sell_size, 0);
+
+    free_orderbook(orderbook, 2);
+    free_matchers();
+    free_positions();
+    free(trader_a.orders);
+    free(trader_a.order_products);
+    free(trader_b.orders);
+    free(trader_b.order_products);
+}
+
+// Read back everything written to a temporary file
+static char *read_back(FILE *file) {
+    long len = ftell(file);
+    char *data = calloc(len + 1, 1);
+    rewind(file);
+    assert_int_equal(fread(data, 1, len, file), len);
+    return data;
+}
+
+static void test_positive_log(void **state) {
+    FILE *logged = tmpfile();
+    FILE *expected = tmpfile();
+    assert_non_null(logged);
+    assert_non_null(expected);
+    assert_int_equal(start_log(logged), 0);
+
+    // More records than the ring holds, so it wraps and fills up
+    for (long long i = 0; i < 40000; i++) {
+        long long match[] = {i, 0, i + 1, 1, 100 * i, i};
+        log_record(LOG_MATCH, match, 6, NULL, 0);
+        format_record(expected, LOG_MATCH, match, NULL, 0);
+
+        long long level[] = {i % 2, i, 500, 1 + i % 3};
+        log_record(LOG_LEVEL, level, 4, NULL, 0);
+        format_record(expected, LOG_LEVEL, level, NULL, 0);
+
+        long long position[] = {i % 4, 2, -i, 10 * i, i, -10 * i};
+        log_record(LOG_TRADER, position, 6, "GPU Router", 10);
+        format_record(expected, LOG_TRADER, position, "GPU Router", 10);
+    }
+    log_parsing(&(trader) {.trader_id = 3}, "BUY 0 GPU 10 200;", 16);
+    format_record(expected, LOG_PARSING, (long long[]) {3}, "BUY 0 GPU 10 200",
+                    16);
+    log_printf("%s Trading completed\n", LOG_PREFIX);
+    fprintf(expected, "[SPX] Trading completed\n");
+    stop_log();
+
+    char *logged_data = read_back(logged);
+    char *expected_data = read_back(expected);
+    assert_string_equal(logged_data, expected_data);
+    assert_non_null(strstr(logged_data,
+            "[SPX] Match: Order 7 [T0], New Order 8 [T1], value: $700, fee: $7.\n"
+            "[SPX]\t\tBUY 7 @ $500 (2 orders)\n"
+            "[SPX]\tTrader 3: GPU -7 ($70), Router 7 ($-70)\n"));
+    assert_non_null(strstr(logged_data,
+            "[SPX] [T3] Parsing command: <BUY 0 GPU 10 200>\n"));
+
+    free(logged_data);
+    free(expected_data);
+    fclose(logged);
+    fclose(expected);
+}
+
+static int setup_symbol_table(void **state) {
+    static char *products[] = {"GPU", "Router"};
+    if (-1 == init_pools(DEFAULT_POOL_CAPACITY)) {
+        return -1;
+    }
+    return init_symbol_table(products, 2);
+}
+
+static int teardown_symbol_table(void **state) {
+    free_symbol_table();
+    free_pools();
+    return 0;
 }
 
 int main() {
@@ -198,15 +1490,52 @@ int main() {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_positive_exchange_parse_args),
         cmocka_unit_test(test_negative_exchange_parse_args),
-        cmocka_unit_test(test_negative_init_amended_order),
+        cmocka_unit_test(test_positive_parse_options),
+        cmocka_unit_test(test_negative_parse_options),
+        cmocka_unit_test(test_positive_trader_file),
+        cmocka_unit_test(test_negative_trader_file),
+        cmocka_unit_test(test_positive_trader_registry),
+        cmocka_unit_test(test_negative_amend_order),
+        cmocka_unit_test(test_positive_amend_order),
         cmocka_unit_test(test_negative_init_new_order),
         cmocka_unit_test(test_negative_delete_order),
-        cmocka_unit_test(test_negative_is_valid_order_id),
-        cmocka_unit_test(test_negative_is_valid_command_format),
-        cmocka_unit_test(test_positive_buy_linked_list),
-        cmocka_unit_test(test_positive_sell_linked_list)
+        cmocka_unit_test(test_negative_order_id),
+        cmocka_unit_test(test_negative_command_format),
+        cmocka_unit_test(test_positive_parse_command),
+        cmocka_unit_test(test_positive_buy_price_levels),
+        cmocka_unit_test(test_positive_sell_price_levels),
+        cmocka_unit_test(test_positive_ladder_price_levels),
+        cmocka_unit_test(test_positive_ladder_outliers),
+        cmocka_unit_test(test_positive_book_section),
+        cmocka_unit_test(test_positive_order_index),
+        cmocka_unit_test(test_positive_symbol_table),
+        cmocka_unit_test(test_positive_object_pool),
+        cmocka_unit_test(test_negative_object_pool),
+        cmocka_unit_test(test_positive_signal_queue),
+        cmocka_unit_test(test_positive_read_command),
+        cmocka_unit_test(test_positive_binary_command),
+        cmocka_unit_test(test_negative_binary_command),
+        cmocka_unit_test(test_positive_frame_writer),
+        cmocka_unit_test(test_negative_frame_writer),
+        cmocka_unit_test(test_positive_complete_frames),
+        cmocka_unit_test(test_positive_frame_backlog),
+        cmocka_unit_test(test_negative_frame_backlog_capacity),
+        cmocka_unit_test(test_negative_frame_backlog_overflow),
+        cmocka_unit_test(test_negative_cut_off_trader),
+        cmocka_unit_test(test_positive_shm_ring),
+        cmocka_unit_test(test_negative_shm_ring_full),
+        cmocka_unit_test(test_positive_shm_channel),
+        cmocka_unit_test(test_positive_position_matrix),
+        cmocka_unit_test(test_positive_match_order),
+        cmocka_unit_test(test_positive_process_cancel),
+        cmocka_unit_test(test_negative_process_missing_order),
+        cmocka_unit_test(test_positive_matchers),
+        cmocka_unit_test(test_positive_pipeline),
+        cmocka_unit_test(test_positive_fanout),
+        cmocka_unit_test(test_positive_log)
     };
 
     // Run the tests
-    return cmocka_run_group_tests(tests, NULL, NULL);
+    return cmocka_run_group_tests(tests, setup_symbol_table,
+                                    teardown_symbol_table);
 }
\ No newline at end of file